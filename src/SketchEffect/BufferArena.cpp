@@ -0,0 +1,189 @@
+#include "BufferArena.h"
+
+#include <cstdlib>
+#include <algorithm>
+
+#if defined(_WIN32)
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#endif
+
+using namespace std;
+
+
+namespace
+{
+    // Alignment of every block (a cache line, two AVX2 / one AVX-512 register)
+    const size_t kAlignment = 64;
+    // Huge page size (x86-64 / AArch64 with 4 KiB pages), the blocks from this size are aligned and rounded to it
+    const size_t kHugePage = size_t(2) << 20;
+
+    // Size of the block handed out for bytes
+    size_t BlockSize(size_t bytes)
+    {
+        const size_t granule = bytes >= kHugePage ? kHugePage : kAlignment;
+        return (max(bytes, size_t(1)) + granule - 1) / granule * granule;
+    }
+}
+
+
+BufferArena::BufferArena() : stats() {}
+
+
+BufferArena::~BufferArena()
+{
+    Trim();
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: Acquire
+// Description: Hands out a block: the smallest kept block that fits, if it wastes at most a quarter of the request
+//              (the stages of a pipeline ask for the same few sizes run after run), else a new block from the system
+//              (allocated outside of the lock, the stages of a graph acquire their buffers at the same time). Only
+//              a new block is placed (see SetPlacement), before anything touches its pages.
+// Parameters:
+//   - bytes: Requested size.
+// Returns:
+//   - The block, at least bytes long and 64 byte aligned, its content is undefined.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void* BufferArena::Acquire(size_t bytes)
+{
+    size_t size = BlockSize(bytes);
+    void* block = nullptr;
+    {
+        lock_guard<mutex> lock(arenaMutex);
+        auto fit = kept.lower_bound(size);
+        if (fit != kept.end() && fit->first <= size + size / 4)
+        {
+            size = fit->first;
+            block = fit->second;
+            kept.erase(fit);
+            ++stats.reuses;
+        }
+    }
+
+    if (block == nullptr)
+    {
+        block = Allocate(size);
+        if (placement)
+        {
+            placement(block, size);
+        }
+    }
+
+    lock_guard<mutex> lock(arenaMutex);
+    used[block] = size;
+    stats.currentBytes += size;
+    stats.peakBytes = max(stats.peakBytes, stats.currentBytes);
+    ++stats.acquires;
+    return block;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: Release
+// Description: Takes a block back, it is kept (not freed) until Trim or the destruction of the arena.
+// Parameters:
+//   - block: Block handed out by Acquire.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void BufferArena::Release(void* block)
+{
+    lock_guard<mutex> lock(arenaMutex);
+    auto handed = used.find(block);
+    if (handed == used.end())
+    {
+        return;
+    }
+    stats.currentBytes -= handed->second;
+    kept.insert(make_pair(handed->second, block));
+    used.erase(handed);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: Trim
+// Description: Frees the kept blocks, the blocks handed out stay valid.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void BufferArena::Trim()
+{
+    multimap<size_t, void*> blocks;
+    {
+        lock_guard<mutex> lock(arenaMutex);
+        blocks.swap(kept);
+    }
+    for (const auto& block : blocks)
+    {
+        Free(block.second);
+    }
+}
+
+
+BufferArena::Stats BufferArena::GetStats() const
+{
+    lock_guard<mutex> lock(arenaMutex);
+    Stats current = stats;
+    current.reservedBytes = current.currentBytes;
+    for (const auto& block : kept)
+    {
+        current.reservedBytes += block.first;
+    }
+    return current;
+}
+
+
+void BufferArena::ResetPeak()
+{
+    lock_guard<mutex> lock(arenaMutex);
+    stats.peakBytes = stats.currentBytes;
+}
+
+
+void BufferArena::SetPlacement(function<void(void*, size_t)> place)
+{
+    placement = std::move(place);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: Allocate / Free
+// Description: Aligned blocks from the system. A block of 2 MiB or more is 2 MiB aligned and advised for
+//              transparent huge pages (Linux): a 4K RGBA image then faults 16 pages in instead of 8100.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void* BufferArena::Allocate(size_t bytes)
+{
+    const size_t alignment = bytes >= kHugePage ? kHugePage : kAlignment;
+    void* block = nullptr;
+
+#if defined(_WIN32)
+    block = _aligned_malloc(max(bytes, size_t(1)), alignment);
+#else
+    if (posix_memalign(&block, alignment, max(bytes, size_t(1))) != 0)
+    {
+        block = nullptr;
+    }
+#if defined(MADV_HUGEPAGE)
+    if (block != nullptr && alignment == kHugePage)
+    {
+        madvise(block, bytes, MADV_HUGEPAGE);
+    }
+#endif
+#endif
+
+    if (block == nullptr)
+    {
+        throw bad_alloc();
+    }
+    return block;
+}
+
+
+void BufferArena::Free(void* block)
+{
+#if defined(_WIN32)
+    _aligned_free(block);
+#else
+    free(block);
+#endif
+}
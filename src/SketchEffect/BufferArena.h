@@ -0,0 +1,142 @@
+#pragma once
+
+#ifndef BUFFER_ARENA_H
+#define BUFFER_ARENA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/// Arena of the stage buffers of a pipeline: the blocks released by the images and the temporary planes are kept
+/// and handed out again to the next buffers of about the same size, so the stages of the following runs neither
+/// fault fresh pages in nor zero them. Blocks are 64 byte aligned (cache lines, widest SIMD loads), the blocks of
+/// 2 MiB and more are 2 MiB aligned and advised to be backed by huge pages.
+
+
+class BufferArena
+{
+public:
+	// Usage of the arena (bytes of the blocks, rounded up from the requested sizes)
+    struct Stats
+    {
+        size_t currentBytes;    // handed out
+        size_t peakBytes;       // maximum of currentBytes since the arena was created (or ResetPeak)
+        size_t reservedBytes;   // allocated from the system, handed out or kept for reuse
+        size_t acquires;        // blocks handed out
+        size_t reuses;          // blocks handed out again instead of allocated
+    };
+
+    BufferArena();
+    ~BufferArena();
+
+    BufferArena(const BufferArena&) = delete;
+    BufferArena& operator=(const BufferArena&) = delete;
+
+	// Block of at least bytes (a kept block if one fits, else a new one), its content is undefined.
+    void* Acquire(size_t bytes);
+	// Give a block back to the arena, kept for the next Acquire.
+    void Release(void* block);
+	// Free the kept blocks (e.g. after a run on a larger image than the next ones).
+    void Trim();
+
+    Stats GetStats() const;
+	// Restart the peak from the current usage.
+    void ResetPeak();
+	// Placement of the pages of the new blocks (e.g. on NUMA nodes), set before the first Acquire: a kept block
+	// handed out again keeps the pages it has.
+    void SetPlacement(std::function<void(void*, size_t)> place);
+
+	// Aligned block from the system (64 bytes, 2 MiB and huge pages from 2 MiB), and its release.
+    static void* Allocate(size_t bytes);
+    static void Free(void* block);
+
+private:
+    mutable std::mutex arenaMutex;
+	// Kept blocks by size (best fit), blocks handed out and their sizes
+    std::multimap<size_t, void*> kept;
+    std::unordered_map<void*, size_t> used;
+    Stats stats;
+    std::function<void(void*, size_t)> placement;
+};
+
+
+// Allocator of the buffers of an arena (system blocks without arena). The elements are default initialized: a
+// resize leaves the bytes as they are instead of zeroing them, the stages write every byte they publish.
+// A copy of a buffer does not belong to the arena, so it may outlive the pipeline.
+template <typename T>
+class ArenaAllocator
+{
+public:
+    typedef T value_type;
+    typedef std::true_type propagate_on_container_move_assignment;
+    typedef std::true_type propagate_on_container_swap;
+
+    ArenaAllocator(BufferArena* arena = nullptr) : arena(arena) {}
+
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other) : arena(other.arena) {}
+
+    T* allocate(size_t count)
+    {
+        const size_t bytes = count * sizeof(T);
+        return static_cast<T*>(arena != nullptr ? arena->Acquire(bytes) : BufferArena::Allocate(bytes));
+    }
+
+    void deallocate(T* block, size_t)
+    {
+        if (arena != nullptr)
+        {
+            arena->Release(block);
+        }
+        else
+        {
+            BufferArena::Free(block);
+        }
+    }
+
+    template <typename U>
+    void construct(U* element)
+    {
+        ::new (static_cast<void*>(element)) U;
+    }
+
+    template <typename U, typename... Args>
+    void construct(U* element, Args&&... args)
+    {
+        ::new (static_cast<void*>(element)) U(std::forward<Args>(args)...);
+    }
+
+    ArenaAllocator select_on_container_copy_construction() const
+    {
+        return ArenaAllocator();
+    }
+
+    BufferArena* arena;
+};
+
+template <typename T, typename U>
+bool operator==(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b)
+{
+    return a.arena == b.arena;
+}
+
+template <typename T, typename U>
+bool operator!=(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b)
+{
+    return a.arena != b.arena;
+}
+
+
+// Pixels of an image or a stage plane, allocated from an arena
+typedef std::vector<unsigned char, ArenaAllocator<unsigned char>> PixelBuffer;
+// Packed binary plane (1 bit per pixel, CPU_Kernels::BitWords per row), allocated from an arena
+typedef std::vector<uint64_t, ArenaAllocator<uint64_t>> BitBuffer;
+
+#endif // BUFFER_ARENA_H
@@ -0,0 +1,2474 @@
+#include "CPU_Kernels.h"
+
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define SKETCH_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define SKETCH_NEON 1
+#include <arm_neon.h>
+#endif
+
+/// GCC/Clang need the target attribute to emit SSE4.1/AVX2 code without global -m flags,
+/// MSVC accepts the intrinsics in any function.
+#if defined(__GNUC__) || defined(__clang__)
+#define SKETCH_TARGET(isa) __attribute__((target(isa)))
+#else
+#define SKETCH_TARGET(isa)
+#endif
+
+using namespace std;
+
+
+namespace
+{
+	// Cache budget for the rows ring of a vertical blur strip, L1 sized (large radii spill to L2
+	// through the 16 pixels minimum strip width)
+    const size_t kBandCacheBytes = 32 * 1024;
+	// Alpha byte of a RGBA8 pixel, forced to 255 by the RGBA kernels
+    const unsigned int kAlphaMask = 0xFF000000u;
+
+    inline int Clamp(int value, int low, int high)
+    {
+        return value < low ? low : (value > high ? high : value);
+    }
+
+	// Bytes of the 2 * radius + 1 tap pointers of a blur at the front of its scratch, whole cache lines (the rows
+	// after them stay aligned)
+    inline size_t TapBytes(int radius)
+    {
+        return (static_cast<size_t>(2 * radius + 1) * sizeof(void*) + 63) / 64 * 64;
+    }
+
+	// Gray nuance of a RGBA8 pixel
+    inline float GrayNuance(const unsigned char* pixel)
+    {
+        float r = pixel[0] / 255.0f;
+        float g = pixel[1] / 255.0f;
+        float b = pixel[2] / 255.0f;
+        return 0.21f * r + 0.71f * g + 0.07f * b;
+    }
+
+	// u8 -> [0, 1] float, IEEE division is correctly rounded so it holds the same values as in[index] / 255.0f
+    struct UnitTable
+    {
+        float value[256];
+
+        UnitTable()
+        {
+            for (int i = 0; i < 256; ++i)
+            {
+                value[i] = i / 255.0f;
+            }
+        }
+    };
+
+    const UnitTable& Unit()
+    {
+        static const UnitTable table;
+        return table;
+    }
+
+	// Scalar weighted sum of the element i over the tap streams src[k] (used for the SIMD tails),
+	// saturated to [0, 255] like the SIMD packs (only the recursive blur can leave the range).
+    inline unsigned char WeightedElement(const float* const* src, int taps, const float* weights, int i)
+    {
+        float sum = 0.0f;
+        for (int k = 0; k < taps; ++k)
+        {
+            sum += src[k][i] * weights[k];
+        }
+        float value = sum * 255.0f;
+        return value <= 0.0f ? 0 : (value >= 255.0f ? 255 : static_cast<unsigned char>(value));
+    }
+
+    inline void WeightedTail(
+        const float* const* src, int taps, const float* weights,
+        unsigned char* out, int i, int n, unsigned int alpha)
+    {
+        for (; i < n; ++i)
+        {
+            out[i] = (alpha != 0 && (i & 3) == 3) ? 255 : WeightedElement(src, taps, weights, i);
+        }
+    }
+
+
+	// Q0.16 coefficients of the gray nuance (0.21, 0.71, 0.07), a fixed point gray is a Q8.16 integer
+    const unsigned int kLumaR = 13763;
+    const unsigned int kLumaG = 46531;
+    const unsigned int kLumaB = 4588;
+
+    inline unsigned int GrayFixed(const unsigned char* pixel)
+    {
+        return kLumaR * pixel[0] + kLumaG * pixel[1] + kLumaB * pixel[2];
+    }
+
+	// Start value of a fixed point accumulator: rounding of the store (128) + half of the truncation of the taps,
+	// a constant row stays constant up to 255 taps.
+    inline unsigned short FixedBias(int taps)
+    {
+        return static_cast<unsigned short>(taps < 254 ? 128 + taps / 2 : 255);
+    }
+
+	// Fixed point weighted sum of the element i: 8.8 pixels times Q0.16 weights (high half of the product)
+	// accumulated in u16, the weights sum to 1.0 so the accumulator holds the 8.8 result without overflow.
+    inline unsigned char FixedElement(const unsigned char* const* src, int taps, const unsigned short* weights, int i)
+    {
+        unsigned short sum = FixedBias(taps);
+        for (int k = 0; k < taps; ++k)
+        {
+            sum = static_cast<unsigned short>(sum + (((static_cast<unsigned int>(src[k][i]) << 8) * weights[k]) >> 16));
+        }
+        return static_cast<unsigned char>(sum >> 8);
+    }
+
+    inline void FixedTail(
+        const unsigned char* const* src, int taps, const unsigned short* weights,
+        unsigned char* out, int i, int n, unsigned int alpha)
+    {
+        for (; i < n; ++i)
+        {
+            out[i] = (alpha != 0 && (i & 3) == 3) ? 255 : FixedElement(src, taps, weights, i);
+        }
+    }
+
+
+	// Bit x of a packed row (1 = white / 255, 0 = black / 0)
+    inline unsigned int Bit(const uint64_t* bits, int x)
+    {
+        return static_cast<unsigned int>(bits[x >> 6] >> (x & 63)) & 1u;
+    }
+
+	// Packs in[j] >= level of the elements [x, n) (x multiple of 64), the unused bits of the last word are 0.
+    inline void AtLeastTail(const unsigned char* in, int x, int n, int level, uint64_t* bits)
+    {
+        for (; x < n; x += 64)
+        {
+            const int count = (n - x) < 64 ? (n - x) : 64;
+            uint64_t word = 0;
+            for (int j = 0; j < count; ++j)
+            {
+                word |= static_cast<uint64_t>(in[x + j] >= level) << j;
+            }
+            bits[x >> 6] = word;
+        }
+    }
+
+
+	// Largest squared Sobel gradient of a luma plane: (4 * 255)^2 + (4 * 255)^2
+    const int kSobelMaxSquared = 2 * 1020 * 1020;
+
+	// magnitude / 255 >= threshold <=> gx^2 + gy^2 >= (255 * threshold)^2, the sum is an integer so the bound is rounded up
+    inline int SobelLimit(float threshold)
+    {
+        double bound = 255.0 * threshold;
+        bound = bound * bound;
+        return threshold <= 0.0f ? 0 : (bound > kSobelMaxSquared ? kSobelMaxSquared + 1 : static_cast<int>(ceil(bound)));
+    }
+
+	// Bytes binarized on the stack before they are packed to bits (multiple of 64)
+    const int kBitChunk = 256;
+
+	// Separable Sobel of the pixel x of padded luma rows (index x + 1 is the pixel x):
+	// gx = s[x + 1] - s[x - 1] with s = above + 2 * row + below, gy = d[x - 1] + 2 * d[x] + d[x + 1] with d = below - above.
+	// Luma bytes are exact integers, so the squared magnitude is exact and compared without sqrt.
+    inline unsigned char SobelPixel(
+        const unsigned char* above, const unsigned char* row, const unsigned char* below,
+        int x, int limit)
+    {
+        int left = above[x] + 2 * row[x] + below[x];
+        int right = above[x + 2] + 2 * row[x + 2] + below[x + 2];
+        int gx = right - left;
+        int gy = (below[x] - above[x]) + 2 * (below[x + 1] - above[x + 1]) + (below[x + 2] - above[x + 2]);
+
+        return (gx * gx + gy * gy >= limit) ? 0 : 255;
+    }
+
+	// Floats processed together by the recursive blur: a column strip row (16 RGBA / 64 plane pixels)
+	// or one pixel of a block of rows (8 RGBA / 64 plane rows), independent chains that hide the latency
+    const int kRecursiveLanes = 64;
+
+	// One step of the recursive gaussian on n lanes, in place: cur = B * cur + a3 * p3 + a2 * p2 + a1 * p1
+	// (the newest output is added last so the dependency between two steps is one multiply and one add).
+    inline void RecursiveTail(float* cur, const float* p1, const float* p2, const float* p3, int i, int n, const float* k)
+    {
+        for (; i < n; ++i)
+        {
+            cur[i] = k[0] * cur[i] + k[3] * p3[i] + k[2] * p2[i] + k[1] * p1[i];
+        }
+    }
+
+	// Elements of a column strip of the vertical box blur (64 RGBA / 256 plane pixels)
+    const int kBoxLanes = 256;
+	// Widest box of the 16 bit fixed point passes (the u32 products of the divisions must not overflow)
+    const int kBoxMaxRadius = 127;
+
+	// Division of a box sum by its width as a multiply + shift: out = (sum * mul + 2^(shift - 1)) >> shift.
+	// u8 -> u16 passes produce 8.8 fixed point values (x 256), u16 -> u8 passes remove the scale.
+    struct BoxDivision
+    {
+        unsigned int mul;
+        int shift;
+
+        BoxDivision(int radius, int shift, unsigned int numerator)
+            : mul((numerator + (2 * radius + 1) / 2) / (2 * radius + 1)), shift(shift) {}
+
+        unsigned int operator()(unsigned int sum) const
+        {
+            return (sum * mul + (1u << (shift - 1))) >> shift;
+        }
+    };
+
+    inline BoxDivision BoxPassDivision(int pass, int radius)
+    {
+        switch (pass)
+        {
+        case 0:  return BoxDivision(radius, 16, 1u << 24); // u8 -> 8.8
+        case 1:  return BoxDivision(radius, 16, 1u << 16); // 8.8 -> 8.8
+        default: return BoxDivision(radius, 24, 1u << 16); // 8.8 -> u8
+        }
+    }
+
+	// Box pass on n elements of a strip row: out = sums / width, then the window slides (+ add row, - sub row)
+    template <typename Src, typename Dst>
+    inline void BoxColumnTail(const Src* add, const Src* sub, unsigned int* sums, Dst* out, int i, int n, const BoxDivision& division)
+    {
+        for (; i < n; ++i)
+        {
+            out[i] = static_cast<Dst>(division(sums[i]));
+            sums[i] += add[i];
+            sums[i] -= sub[i];
+        }
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    // Scalar reference kernels (same arithmetic as the original per pixel loops)
+    // Channels == 4: RGBA8, the 3 colors are blurred and alpha is set to 255 / Channels == 1: single channel plane
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    template <int Channels>
+    void BlurRow_Scalar(
+        const unsigned char* in, unsigned char* out,
+        int width, const float* weights, int radius)
+    {
+        const int colors = Channels == 4 ? 3 : Channels;
+
+        for (int x = 0; x < width; ++x)
+        {
+            float sum[Channels] = { 0.0f };
+
+            for (int i = -radius; i <= radius; ++i)
+            {
+                int index = Clamp(x + i, 0, width - 1) * Channels;
+                float weight = weights[i + radius];
+
+                for (int c = 0; c < colors; ++c)
+                {
+                    float value = in[index + c] / 255.0f;
+                    sum[c] += value * weight;
+                }
+            }
+
+            for (int c = 0; c < colors; ++c)
+            {
+                out[x * Channels + c] = static_cast<unsigned char>(sum[c] * 255.0f);
+            }
+            if (Channels == 4)
+            {
+                out[x * Channels + 3] = 255;
+            }
+        }
+    }
+
+    template <int Channels>
+    void BlurBand_Scalar(
+        const unsigned char* in, unsigned char* out,
+        int width, int height, int y0, int y1,
+        const float* weights, int radius)
+    {
+        const int colors = Channels == 4 ? 3 : Channels;
+
+        for (int y = y0; y < y1; ++y)
+        {
+            for (int x = 0; x < width; ++x)
+            {
+                float sum[Channels] = { 0.0f };
+
+                for (int i = -radius; i <= radius; ++i)
+                {
+                    int index = (Clamp(y + i, 0, height - 1) * width + x) * Channels;
+                    float weight = weights[i + radius];
+
+                    for (int c = 0; c < colors; ++c)
+                    {
+                        float value = in[index + c] / 255.0f;
+                        sum[c] += value * weight;
+                    }
+                }
+
+                int idx = (y * width + x) * Channels;
+                for (int c = 0; c < colors; ++c)
+                {
+                    out[idx + c] = static_cast<unsigned char>(sum[c] * 255.0f);
+                }
+                if (Channels == 4)
+                {
+                    out[idx + 3] = 255;
+                }
+            }
+        }
+    }
+
+
+#if defined(SKETCH_X86)
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    // SSE4.1 kernels: 4 floats per register, 16 elements (4 RGBA pixels) per iteration
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    SKETCH_TARGET("sse4.1")
+    inline void Store16_SSE41(unsigned char* out, __m128 a0, __m128 a1, __m128 a2, __m128 a3, unsigned int alpha)
+    {
+        const __m128 scale = _mm_set1_ps(255.0f);
+        __m128i i0 = _mm_cvttps_epi32(_mm_mul_ps(a0, scale));
+        __m128i i1 = _mm_cvttps_epi32(_mm_mul_ps(a1, scale));
+        __m128i i2 = _mm_cvttps_epi32(_mm_mul_ps(a2, scale));
+        __m128i i3 = _mm_cvttps_epi32(_mm_mul_ps(a3, scale));
+
+        __m128i packed = _mm_packus_epi16(_mm_packus_epi32(i0, i1), _mm_packus_epi32(i2, i3));
+        packed = _mm_or_si128(packed, _mm_set1_epi32(static_cast<int>(alpha)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out), packed);
+    }
+
+    SKETCH_TARGET("sse4.1")
+    void ToUnit_SSE41(const unsigned char* in, float* out, int n)
+    {
+        const __m128 unit = _mm_set1_ps(255.0f);
+        int i = 0;
+        for (; i + 16 <= n; i += 16)
+        {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+            _mm_storeu_ps(out + i + 0, _mm_div_ps(_mm_cvtepi32_ps(_mm_cvtepu8_epi32(v)), unit));
+            _mm_storeu_ps(out + i + 4, _mm_div_ps(_mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_srli_si128(v, 4))), unit));
+            _mm_storeu_ps(out + i + 8, _mm_div_ps(_mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_srli_si128(v, 8))), unit));
+            _mm_storeu_ps(out + i + 12, _mm_div_ps(_mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_srli_si128(v, 12))), unit));
+        }
+
+        for (; i < n; ++i)
+        {
+            out[i] = in[i] / 255.0f;
+        }
+    }
+
+    SKETCH_TARGET("sse4.1")
+    void WeightedSum_SSE41(
+        const float* const* src, int taps, const float* weights,
+        unsigned char* out, int n, unsigned int alpha)
+    {
+        int i = 0;
+        for (; i + 16 <= n; i += 16)
+        {
+            __m128 a0 = _mm_setzero_ps(), a1 = _mm_setzero_ps();
+            __m128 a2 = _mm_setzero_ps(), a3 = _mm_setzero_ps();
+
+            for (int k = 0; k < taps; ++k)
+            {
+                const __m128 w = _mm_set1_ps(weights[k]);
+                const float* s = src[k] + i;
+                a0 = _mm_add_ps(a0, _mm_mul_ps(_mm_loadu_ps(s + 0), w));
+                a1 = _mm_add_ps(a1, _mm_mul_ps(_mm_loadu_ps(s + 4), w));
+                a2 = _mm_add_ps(a2, _mm_mul_ps(_mm_loadu_ps(s + 8), w));
+                a3 = _mm_add_ps(a3, _mm_mul_ps(_mm_loadu_ps(s + 12), w));
+            }
+
+            Store16_SSE41(out + i, a0, a1, a2, a3, alpha);
+        }
+
+        WeightedTail(src, taps, weights, out, i, n, alpha);
+    }
+
+
+	// Fixed point weighted sum, 8 u16 lanes per register (twice the float lanes)
+    SKETCH_TARGET("sse4.1")
+    void FixedSum_SSE41(
+        const unsigned char* const* src, int taps, const unsigned short* weights,
+        unsigned char* out, int n, unsigned int alpha)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i bias = _mm_set1_epi16(static_cast<short>(FixedBias(taps)));
+
+        int i = 0;
+        for (; i + 16 <= n; i += 16)
+        {
+            __m128i lo = bias, hi = bias;
+
+            for (int k = 0; k < taps; ++k)
+            {
+                const __m128i w = _mm_set1_epi16(static_cast<short>(weights[k]));
+                __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src[k] + i));
+                lo = _mm_add_epi16(lo, _mm_mulhi_epu16(_mm_unpacklo_epi8(zero, v), w));
+                hi = _mm_add_epi16(hi, _mm_mulhi_epu16(_mm_unpackhi_epi8(zero, v), w));
+            }
+
+            __m128i packed = _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8));
+            packed = _mm_or_si128(packed, _mm_set1_epi32(static_cast<int>(alpha)));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), packed);
+        }
+
+        FixedTail(src, taps, weights, out, i, n, alpha);
+    }
+
+
+	// 64 bits of in >= level (unsigned compare: max(v, level) == v), 16 per movemask
+    SKETCH_TARGET("sse4.1")
+    void AtLeastBits_SSE41(const unsigned char* in, int n, unsigned char level, uint64_t* bits)
+    {
+        const __m128i l = _mm_set1_epi8(static_cast<char>(level));
+
+        int x = 0;
+        for (; x + 64 <= n; x += 64)
+        {
+            uint64_t word = 0;
+            for (int j = 0; j < 4; ++j)
+            {
+                __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + x + j * 16));
+                unsigned int m = static_cast<unsigned int>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(v, l), v)));
+                word |= static_cast<uint64_t>(m) << (j * 16);
+            }
+            bits[x >> 6] = word;
+        }
+
+        AtLeastTail(in, x, n, level, bits);
+    }
+
+
+	// 8 bytes widened to 16 bits
+    SKETCH_TARGET("sse4.1")
+    inline __m128i Load8_SSE41(const unsigned char* p)
+    {
+        return _mm_cvtepu8_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(p)));
+    }
+
+    SKETCH_TARGET("sse4.1")
+    void SobelRow_SSE41(
+        const unsigned char* above, const unsigned char* row, const unsigned char* below,
+        unsigned char* out, int width, int limit)
+    {
+        const __m128i limits = _mm_set1_epi32(limit);
+
+        int x = 0;
+        for (; x + 8 <= width; x += 8)
+        {
+            __m128i a0 = Load8_SSE41(above + x), a1 = Load8_SSE41(above + x + 1), a2 = Load8_SSE41(above + x + 2);
+            __m128i r0 = Load8_SSE41(row + x), r2 = Load8_SSE41(row + x + 2);
+            __m128i b0 = Load8_SSE41(below + x), b1 = Load8_SSE41(below + x + 1), b2 = Load8_SSE41(below + x + 2);
+
+			// Vertical [1 2 1] smoothing at x - 1 / x + 1, vertical [-1 0 1] difference at x - 1, x, x + 1 (16 bits)
+            __m128i left = _mm_add_epi16(_mm_add_epi16(a0, b0), _mm_slli_epi16(r0, 1));
+            __m128i right = _mm_add_epi16(_mm_add_epi16(a2, b2), _mm_slli_epi16(r2, 1));
+            __m128i gx = _mm_sub_epi16(right, left);
+            __m128i gy = _mm_add_epi16(_mm_add_epi16(_mm_sub_epi16(b0, a0), _mm_sub_epi16(b2, a2)),
+                _mm_slli_epi16(_mm_sub_epi16(b1, a1), 1));
+
+			// gx * gx + gy * gy on 32 bits with one multiply-add per 4 pixels
+            __m128i lo = _mm_unpacklo_epi16(gx, gy);
+            __m128i hi = _mm_unpackhi_epi16(gx, gy);
+            __m128i keepLo = _mm_cmpgt_epi32(limits, _mm_madd_epi16(lo, lo));
+            __m128i keepHi = _mm_cmpgt_epi32(limits, _mm_madd_epi16(hi, hi));
+
+            __m128i packed = _mm_packs_epi16(_mm_packs_epi32(keepLo, keepHi), _mm_setzero_si128());
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(out + x), packed);
+        }
+
+        for (; x < width; ++x)
+        {
+            out[x] = SobelPixel(above, row, below, x, limit);
+        }
+    }
+
+    SKETCH_TARGET("sse4.1")
+    void RecursiveStep_SSE41(float* cur, const float* p1, const float* p2, const float* p3, int n, const float* k)
+    {
+        const __m128 B = _mm_set1_ps(k[0]), a1 = _mm_set1_ps(k[1]), a2 = _mm_set1_ps(k[2]), a3 = _mm_set1_ps(k[3]);
+        int i = 0;
+        for (; i + 4 <= n; i += 4)
+        {
+            __m128 sum = _mm_add_ps(_mm_mul_ps(B, _mm_loadu_ps(cur + i)), _mm_mul_ps(a3, _mm_loadu_ps(p3 + i)));
+            sum = _mm_add_ps(sum, _mm_mul_ps(a2, _mm_loadu_ps(p2 + i)));
+            sum = _mm_add_ps(sum, _mm_mul_ps(a1, _mm_loadu_ps(p1 + i)));
+            _mm_storeu_ps(cur + i, sum);
+        }
+
+        RecursiveTail(cur, p1, p2, p3, i, n, k);
+    }
+
+	// 4 u8 / u16 widened to u32, 4 u32 narrowed (saturated) to u16 / u8
+    SKETCH_TARGET("sse4.1")
+    inline __m128i Widen4_SSE41(const unsigned char* p)
+    {
+        int bytes;
+        memcpy(&bytes, p, sizeof(bytes));
+        return _mm_cvtepu8_epi32(_mm_cvtsi32_si128(bytes));
+    }
+
+    SKETCH_TARGET("sse4.1")
+    inline __m128i Widen4_SSE41(const unsigned short* p)
+    {
+        return _mm_cvtepu16_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(p)));
+    }
+
+    SKETCH_TARGET("sse4.1")
+    inline void Narrow4_SSE41(unsigned short* p, __m128i v)
+    {
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(p), _mm_packus_epi32(v, v));
+    }
+
+    SKETCH_TARGET("sse4.1")
+    inline void Narrow4_SSE41(unsigned char* p, __m128i v)
+    {
+        __m128i words = _mm_packus_epi32(v, v);
+        int bytes = _mm_cvtsi128_si32(_mm_packus_epi16(words, words));
+        memcpy(p, &bytes, sizeof(bytes));
+    }
+
+    template <typename Src, typename Dst>
+    SKETCH_TARGET("sse4.1")
+    void BoxColumnStep_SSE41(const Src* add, const Src* sub, unsigned int* sums, Dst* out, int n, const BoxDivision& division)
+    {
+        const __m128i mul = _mm_set1_epi32(static_cast<int>(division.mul));
+        const __m128i round = _mm_set1_epi32(1 << (division.shift - 1));
+        const __m128i shift = _mm_cvtsi32_si128(division.shift);
+
+        int i = 0;
+        for (; i + 4 <= n; i += 4)
+        {
+            __m128i sum = _mm_loadu_si128(reinterpret_cast<const __m128i*>(sums + i));
+            Narrow4_SSE41(out + i, _mm_srl_epi32(_mm_add_epi32(_mm_mullo_epi32(sum, mul), round), shift));
+            sum = _mm_sub_epi32(_mm_add_epi32(sum, Widen4_SSE41(add + i)), Widen4_SSE41(sub + i));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(sums + i), sum);
+        }
+
+        BoxColumnTail(add, sub, sums, out, i, n, division);
+    }
+
+	// Box pass along a RGBA row, the 4 channels of a pixel in one register (the alpha lane is overwritten later)
+    template <typename Src, typename Dst>
+    SKETCH_TARGET("sse4.1")
+    void BoxRowPassRGBA_SSE41(const Src* src, Dst* dst, int width, int radius, const BoxDivision& division)
+    {
+        const __m128i mul = _mm_set1_epi32(static_cast<int>(division.mul));
+        const __m128i round = _mm_set1_epi32(1 << (division.shift - 1));
+        const __m128i shift = _mm_cvtsi32_si128(division.shift);
+        const int last = width - 1;
+
+        __m128i sum = _mm_mullo_epi32(Widen4_SSE41(src), _mm_set1_epi32(radius + 1));
+        for (int i = 1; i <= radius; ++i)
+        {
+            sum = _mm_add_epi32(sum, Widen4_SSE41(src + (i < last ? i : last) * 4));
+        }
+
+        for (int x = 0; x < width; ++x)
+        {
+            Narrow4_SSE41(dst + x * 4, _mm_srl_epi32(_mm_add_epi32(_mm_mullo_epi32(sum, mul), round), shift));
+
+            int add = x + radius + 1;
+            int sub = x - radius;
+            sum = _mm_add_epi32(sum, Widen4_SSE41(src + (add < last ? add : last) * 4));
+            sum = _mm_sub_epi32(sum, Widen4_SSE41(src + (sub > 0 ? sub : 0) * 4));
+        }
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    // AVX2 kernels: 8 floats per register, 32 elements (8 RGBA pixels) per iteration
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    SKETCH_TARGET("avx2")
+    inline void Store32_AVX2(unsigned char* out, __m256 a0, __m256 a1, __m256 a2, __m256 a3, unsigned int alpha)
+    {
+        const __m256 scale = _mm256_set1_ps(255.0f);
+        __m256i i0 = _mm256_cvttps_epi32(_mm256_mul_ps(a0, scale));
+        __m256i i1 = _mm256_cvttps_epi32(_mm256_mul_ps(a1, scale));
+        __m256i i2 = _mm256_cvttps_epi32(_mm256_mul_ps(a2, scale));
+        __m256i i3 = _mm256_cvttps_epi32(_mm256_mul_ps(a3, scale));
+
+		// packs work per 128-bit lane, the permute restores the element order
+        __m256i packed = _mm256_packus_epi16(_mm256_packus_epi32(i0, i1), _mm256_packus_epi32(i2, i3));
+        packed = _mm256_permutevar8x32_epi32(packed, _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+        packed = _mm256_or_si256(packed, _mm256_set1_epi32(static_cast<int>(alpha)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), packed);
+    }
+
+    SKETCH_TARGET("avx2")
+    void ToUnit_AVX2(const unsigned char* in, float* out, int n)
+    {
+        const __m256 unit = _mm256_set1_ps(255.0f);
+        int i = 0;
+        for (; i + 16 <= n; i += 16)
+        {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+            _mm256_storeu_ps(out + i + 0, _mm256_div_ps(_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(v)), unit));
+            _mm256_storeu_ps(out + i + 8, _mm256_div_ps(_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_srli_si128(v, 8))), unit));
+        }
+
+        for (; i < n; ++i)
+        {
+            out[i] = in[i] / 255.0f;
+        }
+    }
+
+    SKETCH_TARGET("avx2")
+    void WeightedSum_AVX2(
+        const float* const* src, int taps, const float* weights,
+        unsigned char* out, int n, unsigned int alpha)
+    {
+        int i = 0;
+        for (; i + 32 <= n; i += 32)
+        {
+            __m256 a0 = _mm256_setzero_ps(), a1 = _mm256_setzero_ps();
+            __m256 a2 = _mm256_setzero_ps(), a3 = _mm256_setzero_ps();
+
+            for (int k = 0; k < taps; ++k)
+            {
+                const __m256 w = _mm256_set1_ps(weights[k]);
+                const float* s = src[k] + i;
+                a0 = _mm256_add_ps(a0, _mm256_mul_ps(_mm256_loadu_ps(s + 0), w));
+                a1 = _mm256_add_ps(a1, _mm256_mul_ps(_mm256_loadu_ps(s + 8), w));
+                a2 = _mm256_add_ps(a2, _mm256_mul_ps(_mm256_loadu_ps(s + 16), w));
+                a3 = _mm256_add_ps(a3, _mm256_mul_ps(_mm256_loadu_ps(s + 24), w));
+            }
+
+            Store32_AVX2(out + i, a0, a1, a2, a3, alpha);
+        }
+
+        WeightedTail(src, taps, weights, out, i, n, alpha);
+    }
+
+    SKETCH_TARGET("avx2")
+    void FixedSum_AVX2(
+        const unsigned char* const* src, int taps, const unsigned short* weights,
+        unsigned char* out, int n, unsigned int alpha)
+    {
+        const __m256i zero = _mm256_setzero_si256();
+        const __m256i bias = _mm256_set1_epi16(static_cast<short>(FixedBias(taps)));
+
+        const __m256i alphaMask = _mm256_set1_epi32(static_cast<int>(alpha));
+
+        int i = 0;
+        for (; i + 64 <= n; i += 64)
+        {
+            __m256i lo0 = bias, hi0 = bias, lo1 = bias, hi1 = bias;
+
+            for (int k = 0; k < taps; ++k)
+            {
+                const __m256i w = _mm256_set1_epi16(static_cast<short>(weights[k]));
+                __m256i v0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src[k] + i));
+                __m256i v1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src[k] + i + 32));
+                lo0 = _mm256_add_epi16(lo0, _mm256_mulhi_epu16(_mm256_unpacklo_epi8(zero, v0), w));
+                hi0 = _mm256_add_epi16(hi0, _mm256_mulhi_epu16(_mm256_unpackhi_epi8(zero, v0), w));
+                lo1 = _mm256_add_epi16(lo1, _mm256_mulhi_epu16(_mm256_unpacklo_epi8(zero, v1), w));
+                hi1 = _mm256_add_epi16(hi1, _mm256_mulhi_epu16(_mm256_unpackhi_epi8(zero, v1), w));
+            }
+
+            // unpack and pack both work per 128 bit lane, the bytes come back in order
+            __m256i p0 = _mm256_packus_epi16(_mm256_srli_epi16(lo0, 8), _mm256_srli_epi16(hi0, 8));
+            __m256i p1 = _mm256_packus_epi16(_mm256_srli_epi16(lo1, 8), _mm256_srli_epi16(hi1, 8));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm256_or_si256(p0, alphaMask));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i + 32), _mm256_or_si256(p1, alphaMask));
+        }
+
+        FixedTail(src, taps, weights, out, i, n, alpha);
+    }
+
+    SKETCH_TARGET("avx2")
+    void AtLeastBits_AVX2(const unsigned char* in, int n, unsigned char level, uint64_t* bits)
+    {
+        const __m256i l = _mm256_set1_epi8(static_cast<char>(level));
+
+        int x = 0;
+        for (; x + 64 <= n; x += 64)
+        {
+            __m256i v0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + x));
+            __m256i v1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + x + 32));
+            unsigned int m0 = static_cast<unsigned int>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(v0, l), v0)));
+            unsigned int m1 = static_cast<unsigned int>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(v1, l), v1)));
+            bits[x >> 6] = static_cast<uint64_t>(m0) | (static_cast<uint64_t>(m1) << 32);
+        }
+
+        AtLeastTail(in, x, n, level, bits);
+    }
+
+
+	// 16 bytes widened to 16 bits
+    SKETCH_TARGET("avx2")
+    inline __m256i Load16_AVX2(const unsigned char* p)
+    {
+        return _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+    }
+
+    SKETCH_TARGET("avx2")
+    void SobelRow_AVX2(
+        const unsigned char* above, const unsigned char* row, const unsigned char* below,
+        unsigned char* out, int width, int limit)
+    {
+        const __m256i limits = _mm256_set1_epi32(limit);
+
+        int x = 0;
+        for (; x + 16 <= width; x += 16)
+        {
+            __m256i a0 = Load16_AVX2(above + x), a1 = Load16_AVX2(above + x + 1), a2 = Load16_AVX2(above + x + 2);
+            __m256i r0 = Load16_AVX2(row + x), r2 = Load16_AVX2(row + x + 2);
+            __m256i b0 = Load16_AVX2(below + x), b1 = Load16_AVX2(below + x + 1), b2 = Load16_AVX2(below + x + 2);
+
+            __m256i left = _mm256_add_epi16(_mm256_add_epi16(a0, b0), _mm256_slli_epi16(r0, 1));
+            __m256i right = _mm256_add_epi16(_mm256_add_epi16(a2, b2), _mm256_slli_epi16(r2, 1));
+            __m256i gx = _mm256_sub_epi16(right, left);
+            __m256i gy = _mm256_add_epi16(_mm256_add_epi16(_mm256_sub_epi16(b0, a0), _mm256_sub_epi16(b2, a2)),
+                _mm256_slli_epi16(_mm256_sub_epi16(b1, a1), 1));
+
+			// unpack/pack work per 128-bit lane and undo each other, the final permute joins the two lanes
+            __m256i lo = _mm256_unpacklo_epi16(gx, gy);
+            __m256i hi = _mm256_unpackhi_epi16(gx, gy);
+            __m256i keepLo = _mm256_cmpgt_epi32(limits, _mm256_madd_epi16(lo, lo));
+            __m256i keepHi = _mm256_cmpgt_epi32(limits, _mm256_madd_epi16(hi, hi));
+
+            __m256i packed = _mm256_packs_epi16(_mm256_packs_epi32(keepLo, keepHi), _mm256_setzero_si256());
+            packed = _mm256_permute4x64_epi64(packed, 0x08);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + x), _mm256_castsi256_si128(packed));
+        }
+
+        for (; x < width; ++x)
+        {
+            out[x] = SobelPixel(above, row, below, x, limit);
+        }
+    }
+    SKETCH_TARGET("avx2")
+    void RecursiveStep_AVX2(float* cur, const float* p1, const float* p2, const float* p3, int n, const float* k)
+    {
+        const __m256 B = _mm256_set1_ps(k[0]), a1 = _mm256_set1_ps(k[1]), a2 = _mm256_set1_ps(k[2]), a3 = _mm256_set1_ps(k[3]);
+        int i = 0;
+        for (; i + 8 <= n; i += 8)
+        {
+            __m256 sum = _mm256_add_ps(_mm256_mul_ps(B, _mm256_loadu_ps(cur + i)), _mm256_mul_ps(a3, _mm256_loadu_ps(p3 + i)));
+            sum = _mm256_add_ps(sum, _mm256_mul_ps(a2, _mm256_loadu_ps(p2 + i)));
+            sum = _mm256_add_ps(sum, _mm256_mul_ps(a1, _mm256_loadu_ps(p1 + i)));
+            _mm256_storeu_ps(cur + i, sum);
+        }
+
+        RecursiveTail(cur, p1, p2, p3, i, n, k);
+    }
+	// 8 u8 / u16 widened to u32, 8 u32 narrowed (saturated) to u16 / u8
+    SKETCH_TARGET("avx2")
+    inline __m256i Widen8_AVX2(const unsigned char* p)
+    {
+        return _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(p)));
+    }
+
+    SKETCH_TARGET("avx2")
+    inline __m256i Widen8_AVX2(const unsigned short* p)
+    {
+        return _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+    }
+
+    SKETCH_TARGET("avx2")
+    inline __m128i Narrow8_AVX2(__m256i v)
+    {
+        return _mm256_castsi256_si128(_mm256_permute4x64_epi64(_mm256_packus_epi32(v, v), 0x08));
+    }
+
+    SKETCH_TARGET("avx2")
+    inline void Narrow8_AVX2(unsigned short* p, __m256i v)
+    {
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(p), Narrow8_AVX2(v));
+    }
+
+    SKETCH_TARGET("avx2")
+    inline void Narrow8_AVX2(unsigned char* p, __m256i v)
+    {
+        __m128i words = Narrow8_AVX2(v);
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(p), _mm_packus_epi16(words, words));
+    }
+
+    template <typename Src, typename Dst>
+    SKETCH_TARGET("avx2")
+    void BoxColumnStep_AVX2(const Src* add, const Src* sub, unsigned int* sums, Dst* out, int n, const BoxDivision& division)
+    {
+        const __m256i mul = _mm256_set1_epi32(static_cast<int>(division.mul));
+        const __m256i round = _mm256_set1_epi32(1 << (division.shift - 1));
+        const __m128i shift = _mm_cvtsi32_si128(division.shift);
+
+        int i = 0;
+        for (; i + 8 <= n; i += 8)
+        {
+            __m256i sum = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(sums + i));
+            Narrow8_AVX2(out + i, _mm256_srl_epi32(_mm256_add_epi32(_mm256_mullo_epi32(sum, mul), round), shift));
+            sum = _mm256_sub_epi32(_mm256_add_epi32(sum, Widen8_AVX2(add + i)), Widen8_AVX2(sub + i));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(sums + i), sum);
+        }
+
+        BoxColumnTail(add, sub, sums, out, i, n, division);
+    }
+#endif // SKETCH_X86
+
+
+#if defined(SKETCH_NEON)
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    // NEON kernels (AArch64): 4 floats per register, 16 elements (4 RGBA pixels) per iteration
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    inline void Store16_NEON(unsigned char* out, float32x4_t a0, float32x4_t a1, float32x4_t a2, float32x4_t a3, unsigned int alpha)
+    {
+        const float32x4_t scale = vdupq_n_f32(255.0f);
+        uint16x4_t i0 = vqmovn_u32(vcvtq_u32_f32(vmulq_f32(a0, scale)));
+        uint16x4_t i1 = vqmovn_u32(vcvtq_u32_f32(vmulq_f32(a1, scale)));
+        uint16x4_t i2 = vqmovn_u32(vcvtq_u32_f32(vmulq_f32(a2, scale)));
+        uint16x4_t i3 = vqmovn_u32(vcvtq_u32_f32(vmulq_f32(a3, scale)));
+
+        uint8x16_t packed = vcombine_u8(vqmovn_u16(vcombine_u16(i0, i1)), vqmovn_u16(vcombine_u16(i2, i3)));
+        packed = vorrq_u8(packed, vreinterpretq_u8_u32(vdupq_n_u32(alpha)));
+        vst1q_u8(out, packed);
+    }
+
+    void ToUnit_NEON(const unsigned char* in, float* out, int n)
+    {
+        const float32x4_t unit = vdupq_n_f32(255.0f);
+        int i = 0;
+        for (; i + 16 <= n; i += 16)
+        {
+            uint8x16_t v = vld1q_u8(in + i);
+            uint16x8_t lo = vmovl_u8(vget_low_u8(v));
+            uint16x8_t hi = vmovl_u8(vget_high_u8(v));
+            vst1q_f32(out + i + 0, vdivq_f32(vcvtq_f32_u32(vmovl_u16(vget_low_u16(lo))), unit));
+            vst1q_f32(out + i + 4, vdivq_f32(vcvtq_f32_u32(vmovl_u16(vget_high_u16(lo))), unit));
+            vst1q_f32(out + i + 8, vdivq_f32(vcvtq_f32_u32(vmovl_u16(vget_low_u16(hi))), unit));
+            vst1q_f32(out + i + 12, vdivq_f32(vcvtq_f32_u32(vmovl_u16(vget_high_u16(hi))), unit));
+        }
+
+        for (; i < n; ++i)
+        {
+            out[i] = in[i] / 255.0f;
+        }
+    }
+
+    void WeightedSum_NEON(
+        const float* const* src, int taps, const float* weights,
+        unsigned char* out, int n, unsigned int alpha)
+    {
+        int i = 0;
+        for (; i + 16 <= n; i += 16)
+        {
+            float32x4_t a0 = vdupq_n_f32(0.0f), a1 = vdupq_n_f32(0.0f);
+            float32x4_t a2 = vdupq_n_f32(0.0f), a3 = vdupq_n_f32(0.0f);
+
+            for (int k = 0; k < taps; ++k)
+            {
+                const float32x4_t w = vdupq_n_f32(weights[k]);
+                const float* s = src[k] + i;
+                a0 = vaddq_f32(a0, vmulq_f32(vld1q_f32(s + 0), w));
+                a1 = vaddq_f32(a1, vmulq_f32(vld1q_f32(s + 4), w));
+                a2 = vaddq_f32(a2, vmulq_f32(vld1q_f32(s + 8), w));
+                a3 = vaddq_f32(a3, vmulq_f32(vld1q_f32(s + 12), w));
+            }
+
+            Store16_NEON(out + i, a0, a1, a2, a3, alpha);
+        }
+
+        WeightedTail(src, taps, weights, out, i, n, alpha);
+    }
+
+
+	// (8.8 pixels * Q0.16 weight) >> 16 of 8 lanes
+    inline uint16x8_t FixedProduct_NEON(uint16x8_t v, uint16x4_t w)
+    {
+        return vcombine_u16(vshrn_n_u32(vmull_u16(vget_low_u16(v), w), 16), vshrn_n_u32(vmull_u16(vget_high_u16(v), w), 16));
+    }
+
+    void FixedSum_NEON(
+        const unsigned char* const* src, int taps, const unsigned short* weights,
+        unsigned char* out, int n, unsigned int alpha)
+    {
+        const uint16x8_t bias = vdupq_n_u16(FixedBias(taps));
+
+        int i = 0;
+        for (; i + 16 <= n; i += 16)
+        {
+            uint16x8_t lo = bias, hi = bias;
+
+            for (int k = 0; k < taps; ++k)
+            {
+                const uint16x4_t w = vdup_n_u16(weights[k]);
+                uint8x16_t v = vld1q_u8(src[k] + i);
+                lo = vaddq_u16(lo, FixedProduct_NEON(vshll_n_u8(vget_low_u8(v), 8), w));
+                hi = vaddq_u16(hi, FixedProduct_NEON(vshll_n_u8(vget_high_u8(v), 8), w));
+            }
+
+            uint8x16_t packed = vcombine_u8(vshrn_n_u16(lo, 8), vshrn_n_u16(hi, 8));
+            packed = vorrq_u8(packed, vreinterpretq_u8_u32(vdupq_n_u32(alpha)));
+            vst1q_u8(out + i, packed);
+        }
+
+        FixedTail(src, taps, weights, out, i, n, alpha);
+    }
+
+
+	// NEON has no movemask: the compare lanes keep their bit weight, then pairwise adds gather 8 lanes per byte
+    void AtLeastBits_NEON(const unsigned char* in, int n, unsigned char level, uint64_t* bits)
+    {
+        static const uint8_t kWeights[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+        const uint8x16_t weights = vld1q_u8(kWeights);
+        const uint8x16_t l = vdupq_n_u8(level);
+
+        int x = 0;
+        for (; x + 64 <= n; x += 64)
+        {
+            uint64_t word = 0;
+            for (int j = 0; j < 4; ++j)
+            {
+                uint8x16_t m = vandq_u8(vcgeq_u8(vld1q_u8(in + x + j * 16), l), weights);
+                uint8x8_t sum = vpadd_u8(vget_low_u8(m), vget_high_u8(m));
+                sum = vpadd_u8(sum, sum);
+                sum = vpadd_u8(sum, sum);
+                word |= static_cast<uint64_t>(vget_lane_u16(vreinterpret_u16_u8(sum), 0)) << (j * 16);
+            }
+            bits[x >> 6] = word;
+        }
+
+        AtLeastTail(in, x, n, level, bits);
+    }
+
+
+	// 8 bytes widened to 16 bits
+    inline int16x8_t Load8_NEON(const unsigned char* p)
+    {
+        return vreinterpretq_s16_u16(vmovl_u8(vld1_u8(p)));
+    }
+
+    void SobelRow_NEON(
+        const unsigned char* above, const unsigned char* row, const unsigned char* below,
+        unsigned char* out, int width, int limit)
+    {
+        const int32x4_t limits = vdupq_n_s32(limit);
+
+        int x = 0;
+        for (; x + 8 <= width; x += 8)
+        {
+            int16x8_t a0 = Load8_NEON(above + x), a1 = Load8_NEON(above + x + 1), a2 = Load8_NEON(above + x + 2);
+            int16x8_t r0 = Load8_NEON(row + x), r2 = Load8_NEON(row + x + 2);
+            int16x8_t b0 = Load8_NEON(below + x), b1 = Load8_NEON(below + x + 1), b2 = Load8_NEON(below + x + 2);
+
+            int16x8_t left = vaddq_s16(vaddq_s16(a0, b0), vshlq_n_s16(r0, 1));
+            int16x8_t right = vaddq_s16(vaddq_s16(a2, b2), vshlq_n_s16(r2, 1));
+            int16x8_t gx = vsubq_s16(right, left);
+            int16x8_t gy = vaddq_s16(vaddq_s16(vsubq_s16(b0, a0), vsubq_s16(b2, a2)), vshlq_n_s16(vsubq_s16(b1, a1), 1));
+
+            int32x4_t lo = vmlal_s16(vmull_s16(vget_low_s16(gx), vget_low_s16(gx)), vget_low_s16(gy), vget_low_s16(gy));
+            int32x4_t hi = vmlal_s16(vmull_s16(vget_high_s16(gx), vget_high_s16(gx)), vget_high_s16(gy), vget_high_s16(gy));
+            uint16x8_t keep = vcombine_u16(vmovn_u32(vcltq_s32(lo, limits)), vmovn_u32(vcltq_s32(hi, limits)));
+
+            vst1_u8(out + x, vmovn_u16(keep));
+        }
+
+        for (; x < width; ++x)
+        {
+            out[x] = SobelPixel(above, row, below, x, limit);
+        }
+    }
+    void RecursiveStep_NEON(float* cur, const float* p1, const float* p2, const float* p3, int n, const float* k)
+    {
+        const float32x4_t B = vdupq_n_f32(k[0]), a1 = vdupq_n_f32(k[1]), a2 = vdupq_n_f32(k[2]), a3 = vdupq_n_f32(k[3]);
+        int i = 0;
+        for (; i + 4 <= n; i += 4)
+        {
+            float32x4_t sum = vaddq_f32(vmulq_f32(B, vld1q_f32(cur + i)), vmulq_f32(a3, vld1q_f32(p3 + i)));
+            sum = vaddq_f32(sum, vmulq_f32(a2, vld1q_f32(p2 + i)));
+            sum = vaddq_f32(sum, vmulq_f32(a1, vld1q_f32(p1 + i)));
+            vst1q_f32(cur + i, sum);
+        }
+
+        RecursiveTail(cur, p1, p2, p3, i, n, k);
+    }
+	// 4 u8 / u16 widened to u32, 4 u32 narrowed (saturated) to u16 / u8
+    inline uint32x4_t Widen4_NEON(const unsigned char* p)
+    {
+        uint8x8_t bytes = vreinterpret_u8_u32(vld1_dup_u32(reinterpret_cast<const uint32_t*>(p)));
+        return vmovl_u16(vget_low_u16(vmovl_u8(bytes)));
+    }
+
+    inline uint32x4_t Widen4_NEON(const unsigned short* p)
+    {
+        return vmovl_u16(vld1_u16(p));
+    }
+
+    inline void Narrow4_NEON(unsigned short* p, uint32x4_t v)
+    {
+        vst1_u16(p, vqmovn_u32(v));
+    }
+
+    inline void Narrow4_NEON(unsigned char* p, uint32x4_t v)
+    {
+        uint16x4_t words = vqmovn_u32(v);
+        uint8x8_t bytes = vqmovn_u16(vcombine_u16(words, words));
+        vst1_lane_u32(reinterpret_cast<uint32_t*>(p), vreinterpret_u32_u8(bytes), 0);
+    }
+
+    template <typename Src, typename Dst>
+    void BoxColumnStep_NEON(const Src* add, const Src* sub, unsigned int* sums, Dst* out, int n, const BoxDivision& division)
+    {
+        const uint32x4_t mul = vdupq_n_u32(division.mul);
+        const uint32x4_t round = vdupq_n_u32(1u << (division.shift - 1));
+        const int32x4_t shift = vdupq_n_s32(-division.shift);
+
+        int i = 0;
+        for (; i + 4 <= n; i += 4)
+        {
+            uint32x4_t sum = vld1q_u32(sums + i);
+            Narrow4_NEON(out + i, vshlq_u32(vaddq_u32(vmulq_u32(sum, mul), round), shift));
+            sum = vsubq_u32(vaddq_u32(sum, Widen4_NEON(add + i)), Widen4_NEON(sub + i));
+            vst1q_u32(sums + i, sum);
+        }
+
+        BoxColumnTail(add, sub, sums, out, i, n, division);
+    }
+
+    template <typename Src, typename Dst>
+    void BoxRowPassRGBA_NEON(const Src* src, Dst* dst, int width, int radius, const BoxDivision& division)
+    {
+        const uint32x4_t mul = vdupq_n_u32(division.mul);
+        const uint32x4_t round = vdupq_n_u32(1u << (division.shift - 1));
+        const int32x4_t shift = vdupq_n_s32(-division.shift);
+        const int last = width - 1;
+
+        uint32x4_t sum = vmulq_n_u32(Widen4_NEON(src), radius + 1);
+        for (int i = 1; i <= radius; ++i)
+        {
+            sum = vaddq_u32(sum, Widen4_NEON(src + (i < last ? i : last) * 4));
+        }
+
+        for (int x = 0; x < width; ++x)
+        {
+            Narrow4_NEON(dst + x * 4, vshlq_u32(vaddq_u32(vmulq_u32(sum, mul), round), shift));
+
+            int add = x + radius + 1;
+            int sub = x - radius;
+            sum = vaddq_u32(sum, Widen4_NEON(src + (add < last ? add : last) * 4));
+            sum = vsubq_u32(sum, Widen4_NEON(src + (sub > 0 ? sub : 0) * 4));
+        }
+    }
+#endif // SKETCH_NEON
+
+
+	// Converts n bytes to floats in [0, 1].
+    void ToUnit(KernelISA isa, const unsigned char* in, float* out, int n)
+    {
+        switch (isa)
+        {
+#if defined(SKETCH_X86)
+        case KernelISA::AVX2:  ToUnit_AVX2(in, out, n); return;
+        case KernelISA::SSE41: ToUnit_SSE41(in, out, n); return;
+#endif
+#if defined(SKETCH_NEON)
+        case KernelISA::NEON:  ToUnit_NEON(in, out, n); return;
+#endif
+        default:
+            {
+                const float* unit = Unit().value;
+                for (int i = 0; i < n; ++i)
+                {
+                    out[i] = unit[in[i]];
+                }
+            }
+            return;
+        }
+    }
+
+	// out[i] = sum_k weights[k] * src[k][i] for n elements, every 4th byte is set to 255 when alpha is kAlphaMask.
+    void WeightedSum(
+        KernelISA isa,
+        const float* const* src, int taps, const float* weights,
+        unsigned char* out, int n, unsigned int alpha)
+    {
+        switch (isa)
+        {
+#if defined(SKETCH_X86)
+        case KernelISA::AVX2:  WeightedSum_AVX2(src, taps, weights, out, n, alpha); return;
+        case KernelISA::SSE41: WeightedSum_SSE41(src, taps, weights, out, n, alpha); return;
+#endif
+#if defined(SKETCH_NEON)
+        case KernelISA::NEON:  WeightedSum_NEON(src, taps, weights, out, n, alpha); return;
+#endif
+        default: WeightedTail(src, taps, weights, out, 0, n, alpha); return;
+        }
+    }
+
+	// Fixed point version of WeightedSum on byte streams with Q0.16 weights.
+    void FixedSum(
+        KernelISA isa,
+        const unsigned char* const* src, int taps, const unsigned short* weights,
+        unsigned char* out, int n, unsigned int alpha)
+    {
+        switch (isa)
+        {
+#if defined(SKETCH_X86)
+        case KernelISA::AVX2:  FixedSum_AVX2(src, taps, weights, out, n, alpha); return;
+        case KernelISA::SSE41: FixedSum_SSE41(src, taps, weights, out, n, alpha); return;
+#endif
+#if defined(SKETCH_NEON)
+        case KernelISA::NEON:  FixedSum_NEON(src, taps, weights, out, n, alpha); return;
+#endif
+        default: FixedTail(src, taps, weights, out, 0, n, alpha); return;
+        }
+    }
+
+	// Packed bits of in[x] >= level for n bytes (level 256: no bit set).
+    void AtLeastBits(KernelISA isa, const unsigned char* in, int n, int level, uint64_t* bits)
+    {
+        if (level > 255)
+        {
+            memset(bits, 0, ((n + 63) / 64) * sizeof(uint64_t));
+            return;
+        }
+
+        switch (isa)
+        {
+#if defined(SKETCH_X86)
+        case KernelISA::AVX2:  AtLeastBits_AVX2(in, n, static_cast<unsigned char>(level), bits); return;
+        case KernelISA::SSE41: AtLeastBits_SSE41(in, n, static_cast<unsigned char>(level), bits); return;
+#endif
+#if defined(SKETCH_NEON)
+        case KernelISA::NEON:  AtLeastBits_NEON(in, n, static_cast<unsigned char>(level), bits); return;
+#endif
+        default: AtLeastTail(in, 0, n, level, bits); return;
+        }
+    }
+
+
+	// Sobel + binarization of a row of padded luma rows, limit is the squared threshold (on the 0..255 scale).
+    void SobelBinary(
+        KernelISA isa,
+        const unsigned char* above, const unsigned char* row, const unsigned char* below,
+        unsigned char* out, int width, int limit)
+    {
+        switch (isa)
+        {
+#if defined(SKETCH_X86)
+        case KernelISA::AVX2:  SobelRow_AVX2(above, row, below, out, width, limit); return;
+        case KernelISA::SSE41: SobelRow_SSE41(above, row, below, out, width, limit); return;
+#endif
+#if defined(SKETCH_NEON)
+        case KernelISA::NEON:  SobelRow_NEON(above, row, below, out, width, limit); return;
+#endif
+        default:
+            for (int x = 0; x < width; ++x)
+            {
+                out[x] = SobelPixel(above, row, below, x, limit);
+            }
+            return;
+        }
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    // Function: BlurRow
+    // Description: Horizontal blur of a row of channels bytes per pixel. The row is converted once to floats
+    //              with radius clamped pixels on both sides, so the taps need no bounds checks and no per tap
+    //              conversion, then tap k reads the padded row shifted by k pixels. The tap pointers and the
+    //              padded row are in the scratch of the caller (nothing is allocated per row).
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    void BlurRow(
+        KernelISA isa,
+        const unsigned char* in, unsigned char* out,
+        int width, const float* weights, int radius,
+        float* scratch, int channels)
+    {
+        if (isa == KernelISA::Scalar)
+        {
+            if (channels == 4) BlurRow_Scalar<4>(in, out, width, weights, radius);
+            else BlurRow_Scalar<1>(in, out, width, weights, radius);
+            return;
+        }
+
+        const float** src = reinterpret_cast<const float**>(scratch);
+        scratch += TapBytes(radius) / sizeof(float);
+
+        const float* unit = Unit().value;
+        for (int c = 0; c < channels; ++c)
+        {
+            float first = unit[in[c]];
+            float last = unit[in[(width - 1) * channels + c]];
+            for (int p = 0; p < radius; ++p)
+            {
+                scratch[p * channels + c] = first;
+                scratch[(radius + width + p) * channels + c] = last;
+            }
+        }
+        ToUnit(isa, in, scratch + radius * channels, width * channels);
+
+        const int taps = 2 * radius + 1;
+        for (int k = 0; k < taps; ++k)
+        {
+            src[k] = scratch + k * channels;
+        }
+
+        WeightedSum(isa, src, taps, weights, out, width * channels, channels == 4 ? kAlphaMask : 0);
+    }
+
+
+	// Width (in pixels) of the column strips walked by BlurBand, the ring of 2 * radius + 1 converted rows
+	// of a strip stays resident in L1 (L2 for large radii).
+    int BandStripWidth(int width, int radius, int channels)
+    {
+        const int taps = 2 * radius + 1;
+        int strip = static_cast<int>(kBandCacheBytes / (taps * channels * sizeof(float)));
+        strip = (strip / 16) * 16;
+        strip = strip < 16 ? 16 : strip;
+        return strip < width ? strip : width;
+    }
+
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    // Function: BlurBand
+    // Description: Vertical blur of the rows [y0, y1) of an image of channels bytes per pixel.
+    //              The image is walked in column strips, each strip keeps a ring of 2 * radius + 1 rows already
+    //              converted to float, every input row is converted once per strip and read sequentially
+    //              (no strided per pixel walk down the columns).
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    void BlurBand(
+        KernelISA isa,
+        const unsigned char* in, unsigned char* out,
+        int width, int height, int y0, int y1,
+        const float* weights, int radius,
+        float* scratch, int channels)
+    {
+        if (isa == KernelISA::Scalar)
+        {
+            if (channels == 4) BlurBand_Scalar<4>(in, out, width, height, y0, y1, weights, radius);
+            else BlurBand_Scalar<1>(in, out, width, height, y0, y1, weights, radius);
+            return;
+        }
+
+        const int taps = 2 * radius + 1;
+        const int strip = BandStripWidth(width, radius, channels);
+        const int stride = strip * channels;
+        const unsigned int alpha = channels == 4 ? kAlphaMask : 0;
+        const float** src = reinterpret_cast<const float**>(scratch);
+        scratch += TapBytes(radius) / sizeof(float);
+
+        for (int x0 = 0; x0 < width; x0 += strip)
+        {
+            const int count = ((width - x0) < strip ? (width - x0) : strip) * channels;
+            auto ConvertRow = [&](int y, float* dst)
+            {
+                ToUnit(isa, in + (Clamp(y, 0, height - 1) * width + x0) * channels, dst, count);
+            };
+
+			// Ring slot k holds the row y0 - radius + k (the last slot is filled by the first output row)
+            for (int k = 0; k < taps - 1; ++k)
+            {
+                ConvertRow(y0 - radius + k, scratch + k * stride);
+            }
+
+            for (int y = y0; y < y1; ++y)
+            {
+                const int base = y - y0;
+                ConvertRow(y + radius, scratch + ((base + taps - 1) % taps) * stride);
+
+                for (int k = 0; k < taps; ++k)
+                {
+                    src[k] = scratch + ((base + k) % taps) * stride;
+                }
+
+                WeightedSum(isa, src, taps, weights, out + (y * width + x0) * channels, count, alpha);
+            }
+        }
+    }
+
+
+	// Pixels copied as they are, the alpha of RGBA8 pixels forced to 255 (as the RGBA kernels do)
+    void CopyPixels(const unsigned char* in, unsigned char* out, int count, int channels)
+    {
+        memcpy(out, in, static_cast<size_t>(count) * channels);
+        if (channels == 4)
+        {
+            for (int p = 0; p < count; ++p)
+            {
+                out[p * 4 + 3] = 255;
+            }
+        }
+    }
+
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    // Function: BlurRowFixed / BlurBandFixed
+    // Description: Fixed point blurs. The bytes are read as they are (no float conversion): the row is copied once
+    //              with radius clamped pixels on both sides, the vertical taps point straight into the clamped
+    //              input rows. The tap pointers are in the scratch of the caller. A single Q0.16 tap cannot weigh
+    //              1.0 (see FixedWeights): the blurs of radius 0 copy their input (alpha forced as by the sums).
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    void BlurRowFixed(
+        KernelISA isa,
+        const unsigned char* in, unsigned char* out,
+        int width, const unsigned short* weights, int radius,
+        unsigned char* scratch, int channels)
+    {
+        if (radius == 0)
+        {
+            CopyPixels(in, out, width, channels);
+            return;
+        }
+
+        const unsigned char** src = reinterpret_cast<const unsigned char**>(scratch);
+        scratch += TapBytes(radius);
+
+        for (int p = 0; p < radius; ++p)
+        {
+            memcpy(scratch + p * channels, in, channels);
+            memcpy(scratch + (radius + width + p) * channels, in + (width - 1) * channels, channels);
+        }
+        memcpy(scratch + radius * channels, in, width * channels);
+
+        const int taps = 2 * radius + 1;
+        for (int k = 0; k < taps; ++k)
+        {
+            src[k] = scratch + k * channels;
+        }
+
+        FixedSum(isa, src, taps, weights, out, width * channels, channels == 4 ? kAlphaMask : 0);
+    }
+
+    void BlurBandFixed(
+        KernelISA isa,
+        const unsigned char* in, unsigned char* out,
+        int width, int height, int y0, int y1,
+        const unsigned short* weights, int radius, unsigned char* scratch, int channels)
+    {
+        const int taps = 2 * radius + 1;
+        const int stride = width * channels;
+        if (radius == 0)
+        {
+            CopyPixels(in + y0 * stride, out + y0 * stride, (y1 - y0) * width, channels);
+            return;
+        }
+
+        const unsigned char** src = reinterpret_cast<const unsigned char**>(scratch);
+
+        for (int y = y0; y < y1; ++y)
+        {
+            for (int k = 0; k < taps; ++k)
+            {
+                src[k] = in + Clamp(y - radius + k, 0, height - 1) * stride;
+            }
+            FixedSum(isa, src, taps, weights, out + y * stride, stride, channels == 4 ? kAlphaMask : 0);
+        }
+    }
+
+
+	// k = (B, a1, a2, a3) of a recursive gaussian.
+    void RecursiveStep(KernelISA isa, float* cur, const float* p1, const float* p2, const float* p3, int n, const float* k)
+    {
+        switch (isa)
+        {
+#if defined(SKETCH_X86)
+        case KernelISA::AVX2:  RecursiveStep_AVX2(cur, p1, p2, p3, n, k); return;
+        case KernelISA::SSE41: RecursiveStep_SSE41(cur, p1, p2, p3, n, k); return;
+#endif
+#if defined(SKETCH_NEON)
+        case KernelISA::NEON:  RecursiveStep_NEON(cur, p1, p2, p3, n, k); return;
+#endif
+        default: RecursiveTail(cur, p1, p2, p3, 0, n, k); return;
+        }
+    }
+
+	// Right border state (v[N - 1], v[N], v[N + 1]) of the anticausal pass for a signal clamped after N - 1,
+	// from the last 3 causal outputs w[N - 1], w[N - 2], w[N - 3] and the border value u (Triggs - Sdika).
+    inline void RightBorder(const CPU_Kernels::RecursiveGaussian& g, float w0, float w1, float w2, float u, float v[3])
+    {
+        const float d0 = w0 - u, d1 = w1 - u, d2 = w2 - u;
+        for (int k = 0; k < 3; ++k)
+        {
+            v[k] = g.M[3 * k + 0] * d0 + g.M[3 * k + 1] * d1 + g.M[3 * k + 2] * d2 + u;
+        }
+    }
+
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    // Function: RecursivePass
+    // Description: Causal then anticausal pass of the recursive gaussian over count steps of n lanes, lane i of step t
+    //              is lines[t * n + i] (already holds the input, replaced by the output). first/last are the input
+    //              values before the first and after the last step (clamped borders), virtuals holds 2 * n floats.
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    void RecursivePass(
+        KernelISA isa, const CPU_Kernels::RecursiveGaussian& g,
+        float* lines, int count, int n,
+        const float* first, const float* last, float* virtuals)
+    {
+        const float k[4] = { g.B, g.a[0], g.a[1], g.a[2] };
+
+		// Steady state of a constant signal clamped before the first step
+        const float* p1 = first;
+        const float* p2 = first;
+        const float* p3 = first;
+        for (int t = 0; t < count; ++t)
+        {
+            float* cur = lines + t * n;
+            RecursiveStep(isa, cur, p1, p2, p3, n, k);
+            p3 = p2; p2 = p1; p1 = cur;
+        }
+
+        float* w0 = lines + (count - 1) * n;
+        const float* w1 = lines + (count >= 2 ? count - 2 : 0) * n;
+        const float* w2 = lines + (count >= 3 ? count - 3 : 0) * n;
+        float* v1 = virtuals;
+        float* v2 = virtuals + n;
+        for (int i = 0; i < n; ++i)
+        {
+            float v[3];
+            RightBorder(g, w0[i], w1[i], w2[i], last[i], v);
+            w0[i] = v[0]; v1[i] = v[1]; v2[i] = v[2];
+        }
+
+        p1 = w0; p2 = v1; p3 = v2;
+        for (int t = count - 2; t >= 0; --t)
+        {
+            float* cur = lines + t * n;
+            RecursiveStep(isa, cur, p1, p2, p3, n, k);
+            p3 = p2; p2 = p1; p1 = cur;
+        }
+    }
+
+
+	// Stores n floats in [0, 1] as bytes (truncated and saturated like the direct blur, alpha forced by the mask).
+    inline void StoreUnit(KernelISA isa, const float* in, unsigned char* out, int n, unsigned int alpha)
+    {
+        static const float one = 1.0f;
+        WeightedSum(isa, &in, 1, &one, out, n, alpha);
+    }
+
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    // Function: RecursiveRows
+    // Description: Horizontal recursive blur of the rows [y0, y1). The rows are taken by blocks of
+    //              kRecursiveLanes / channels, one step holds the pixel x of every row of the block, so the
+    //              serial recursion of each row runs next to the others (independent chains, vector wide).
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    template <int Channels>
+    void RecursiveRows(
+        KernelISA isa,
+        const unsigned char* in, unsigned char* out,
+        int width, int y0, int y1,
+        const CPU_Kernels::RecursiveGaussian& g,
+        float* scratch)
+    {
+        const int channels = Channels;
+        const int blockRows = kRecursiveLanes / channels;
+        const int stride = width * channels;
+        const unsigned int alpha = channels == 4 ? kAlphaMask : 0;
+
+        for (int yb = y0; yb < y1; yb += blockRows)
+        {
+            const int rows = (y1 - yb) < blockRows ? (y1 - yb) : blockRows;
+            const int n = rows * channels;
+            float* lines = scratch;
+            float* first = lines + width * n;
+            float* last = first + n;
+            float* virtuals = last + n;
+            float* row = virtuals + 2 * n;
+
+			// Row r of the block is converted once, then its pixels go to the lanes r * channels .. r * channels + channels - 1
+            for (int r = 0; r < rows; ++r)
+            {
+                ToUnit(isa, in + (yb + r) * stride, row, stride);
+                for (int x = 0; x < width; ++x)
+                {
+                    memcpy(lines + x * n + r * channels, row + x * channels, channels * sizeof(float));
+                }
+                memcpy(first + r * channels, row, channels * sizeof(float));
+                memcpy(last + r * channels, row + stride - channels, channels * sizeof(float));
+            }
+
+            RecursivePass(isa, g, lines, width, n, first, last, virtuals);
+
+            for (int r = 0; r < rows; ++r)
+            {
+                for (int x = 0; x < width; ++x)
+                {
+                    memcpy(row + x * channels, lines + x * n + r * channels, channels * sizeof(float));
+                }
+                StoreUnit(isa, row, out + (yb + r) * stride, stride, alpha);
+            }
+        }
+    }
+
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    // Function: RecursiveColumns
+    // Description: Vertical recursive blur of the columns [x0, x1), walked in strips of kRecursiveLanes floats.
+    //              One step is a strip row (contiguous), the strip (height * 256 bytes) stays in L2 between the
+    //              causal and the anticausal pass. Only the rows [y0, y1) are written to out.
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    void RecursiveColumns(
+        KernelISA isa,
+        const unsigned char* in, unsigned char* out,
+        int width, int height, int x0, int x1, int y0, int y1,
+        const CPU_Kernels::RecursiveGaussian& g,
+        float* scratch, int channels)
+    {
+        const int stripPixels = kRecursiveLanes / channels;
+        const unsigned int alpha = channels == 4 ? kAlphaMask : 0;
+
+        for (int xs = x0; xs < x1; xs += stripPixels)
+        {
+            const int n = ((x1 - xs) < stripPixels ? (x1 - xs) : stripPixels) * channels;
+            float* lines = scratch;
+            float* first = lines + height * n;
+            float* last = first + n;
+            float* virtuals = last + n;
+
+            for (int y = 0; y < height; ++y)
+            {
+                ToUnit(isa, in + (y * width + xs) * channels, lines + y * n, n);
+            }
+            memcpy(first, lines, n * sizeof(float));
+            memcpy(last, lines + (height - 1) * n, n * sizeof(float));
+
+            RecursivePass(isa, g, lines, height, n, first, last, virtuals);
+
+            for (int y = y0; y < y1; ++y)
+            {
+                StoreUnit(isa, lines + y * n, out + (y * width + xs) * channels, n, alpha);
+            }
+        }
+    }
+
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    // Function: BoxRowPass
+    // Description: One running sum box pass along a row (borders clamped), each output costs one add and one
+    //              subtract whatever the radius.
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    template <int Channels, typename Src, typename Dst>
+    void BoxRowPass(const Src* src, Dst* dst, int width, int radius, const BoxDivision& division)
+    {
+        const int colors = Channels == 4 ? 3 : Channels;
+        const int last = width - 1;
+
+        for (int c = 0; c < colors; ++c)
+        {
+            unsigned int sum = (radius + 1) * src[c];
+            for (int i = 1; i <= radius; ++i)
+            {
+                sum += src[(i < last ? i : last) * Channels + c];
+            }
+
+            for (int x = 0; x < width; ++x)
+            {
+                dst[x * Channels + c] = static_cast<Dst>(division(sum));
+
+                int add = x + radius + 1;
+                int sub = x - radius;
+                sum += src[(add < last ? add : last) * Channels + c];
+                sum -= src[(sub > 0 ? sub : 0) * Channels + c];
+            }
+        }
+    }
+
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    // Function: BoxColumnPass
+    // Description: One running sum box pass down the n elements of a strip, the running sums are a whole strip row
+    //              (contiguous). The source holds the rows [srcFirst, ...) with a stride of srcStride elements,
+    //              rows outside the image are clamped, the rows [dstFirst, dstLast) are written.
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    template <typename Src, typename Dst>
+    void BoxColumnPass(
+        KernelISA isa,
+        const Src* src, int srcFirst, int srcStride,
+        Dst* dst, int dstFirst, int dstLast, int dstStride,
+        int height, int n, int radius, const BoxDivision& division,
+        unsigned int* sums)
+    {
+        auto Row = [&](int y)
+        {
+            y = Clamp(y, 0, height - 1);
+            return src + (y - srcFirst) * srcStride;
+        };
+
+        for (int i = 0; i < n; ++i)
+        {
+            sums[i] = 0;
+        }
+        for (int k = -radius; k <= radius; ++k)
+        {
+            const Src* row = Row(dstFirst + k);
+            for (int i = 0; i < n; ++i)
+            {
+                sums[i] += row[i];
+            }
+        }
+
+        for (int y = dstFirst; y < dstLast; ++y)
+        {
+            Dst* out = dst + (y - dstFirst) * dstStride;
+            const Src* sub = Row(y - radius);
+            // The sums after the last row are not used, its next row can be past the rows held by the source
+            const Src* add = y + 1 < dstLast ? Row(y + radius + 1) : sub;
+
+            switch (isa)
+            {
+#if defined(SKETCH_X86)
+            case KernelISA::AVX2:  BoxColumnStep_AVX2(add, sub, sums, out, n, division); break;
+            case KernelISA::SSE41: BoxColumnStep_SSE41(add, sub, sums, out, n, division); break;
+#endif
+#if defined(SKETCH_NEON)
+            case KernelISA::NEON:  BoxColumnStep_NEON(add, sub, sums, out, n, division); break;
+#endif
+            default: BoxColumnTail(add, sub, sums, out, 0, n, division); break;
+            }
+        }
+    }
+
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    // Function: BoxRow
+    // Description: Three box passes along a row (u8 -> 8.8 -> 8.8 -> u8), scratch: 2 * width * Channels u16.
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    template <int Channels, typename Src, typename Dst>
+    void BoxRowPass(KernelISA isa, const Src* src, Dst* dst, int width, int radius, const BoxDivision& division)
+    {
+        if (Channels == 4)
+        {
+            switch (isa)
+            {
+#if defined(SKETCH_X86)
+            case KernelISA::AVX2:
+            case KernelISA::SSE41: BoxRowPassRGBA_SSE41(src, dst, width, radius, division); return;
+#endif
+#if defined(SKETCH_NEON)
+            case KernelISA::NEON:  BoxRowPassRGBA_NEON(src, dst, width, radius, division); return;
+#endif
+            default: break;
+            }
+        }
+        BoxRowPass<Channels>(src, dst, width, radius, division);
+    }
+
+    template <int Channels>
+    void BoxRow(KernelISA isa, const unsigned char* in, unsigned char* out, int width, const int radii[3], unsigned short* scratch)
+    {
+        unsigned short* first = scratch;
+        unsigned short* second = scratch + width * Channels;
+
+        BoxRowPass<Channels>(isa, in, first, width, radii[0], BoxPassDivision(0, radii[0]));
+        BoxRowPass<Channels>(isa, first, second, width, radii[1], BoxPassDivision(1, radii[1]));
+        BoxRowPass<Channels>(isa, second, out, width, radii[2], BoxPassDivision(2, radii[2]));
+
+        if (Channels == 4)
+        {
+            for (int x = 0; x < width; ++x)
+            {
+                out[x * 4 + 3] = 255;
+            }
+        }
+    }
+
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    // Function: BoxBand
+    // Description: Three box passes down the rows [y0, y1), walked in column strips of kBoxLanes elements.
+    //              Each pass produces the rows the next one reads (the band plus the radii of the next passes),
+    //              so a band only depends on the input image.
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    void BoxBand(
+        KernelISA isa,
+        const unsigned char* in, unsigned char* out,
+        int width, int height, int y0, int y1,
+        const int radii[3], unsigned short* scratch, int channels)
+    {
+        const int b0 = y0 - radii[2] > 0 ? y0 - radii[2] : 0;
+        const int b1 = y1 + radii[2] < height ? y1 + radii[2] : height;
+        const int a0 = b0 - radii[1] > 0 ? b0 - radii[1] : 0;
+        const int a1 = b1 + radii[1] < height ? b1 + radii[1] : height;
+        const int stride = width * channels;
+        const int stripPixels = kBoxLanes / channels;
+        unsigned int sums[kBoxLanes];
+
+        for (int xs = 0; xs < width; xs += stripPixels)
+        {
+            const int n = ((width - xs) < stripPixels ? (width - xs) : stripPixels) * channels;
+            unsigned short* first = scratch;
+            unsigned short* second = scratch + (a1 - a0) * n;
+
+            BoxColumnPass(isa, in + xs * channels, 0, stride, first, a0, a1, n, height, n, radii[0], BoxPassDivision(0, radii[0]), sums);
+            BoxColumnPass(isa, first, a0, n, second, b0, b1, n, height, n, radii[1], BoxPassDivision(1, radii[1]), sums);
+            BoxColumnPass(isa, second, b0, n, out + y0 * stride + xs * channels, y0, y1, stride, height, n, radii[2], BoxPassDivision(2, radii[2]), sums);
+
+            if (channels == 4)
+            {
+                for (int y = y0; y < y1; ++y)
+                {
+                    unsigned char* row = out + y * stride + xs * channels;
+                    for (int i = 3; i < n; i += 4)
+                    {
+                        row[i] = 255;
+                    }
+                }
+            }
+        }
+    }
+
+
+	// Hatching line lit at the texture coordinates (u, v), only depends on the position and the hatch parameters.
+    inline bool HatchLine(float u, float v, const float* hatch)
+    {
+        float hatchLine = sin(hatch[0] * u + hatch[1] * v);
+        return hatchLine > hatch[2];
+    }
+
+	// Gray test of the hatching on a RGBA8 pixel (1 when the pixel is white whatever the lines):
+	// gray > threshold on the black background, gray < threshold on the white one.
+    struct HatchGrayTest
+    {
+        const float* unit;
+        float threshold;
+        bool invertBackground;
+
+        HatchGrayTest(float threshold, bool invertBackground)
+            : unit(Unit().value), threshold(threshold), invertBackground(invertBackground) {}
+
+        unsigned int operator()(const unsigned char* pixel) const
+        {
+            // Same operations as GrayNuance, the table holds the u8 / 255.0f quotients
+            float gray = 0.21f * unit[pixel[0]] + 0.71f * unit[pixel[1]] + 0.07f * unit[pixel[2]];
+            return invertBackground ? (gray < threshold) : (gray > threshold);
+        }
+    };
+
+	// Same test on the Q8.16 integer gray, against the integer bounds of the threshold.
+    struct HatchGrayTestFixed
+    {
+        int limit;
+        bool invertBackground;
+
+        HatchGrayTestFixed(float threshold, bool invertBackground) : invertBackground(invertBackground)
+        {
+            const double scaled = static_cast<double>(threshold) * 255.0 * 65536.0;
+            const double bound = invertBackground ? ceil(scaled) : floor(scaled);
+            limit = bound < -1.0 ? -1 : (bound > 16777216.0 ? 16777216 : static_cast<int>(bound));
+        }
+
+        unsigned int operator()(const unsigned char* pixel) const
+        {
+            int gray = static_cast<int>(GrayFixed(pixel));
+            return invertBackground ? (gray < limit) : (gray > limit);
+        }
+    };
+
+	// Masked hatching of a RGBA8 row to RGBA8 (0 - bit is 0x00 or 0xFF).
+    template <typename Test>
+    void HatchRowBytes(const unsigned char* in, const uint64_t* mask, unsigned char* out, int width, bool invertBackground, const Test& test)
+    {
+        const unsigned int flip = invertBackground ? 1u : 0u;
+
+        for (int x = 0; x < width; ++x)
+        {
+            unsigned char value = static_cast<unsigned char>(0u - (test(in + x * 4) | (Bit(mask, x) ^ flip)));
+
+            out[x * 4 + 0] = value;
+            out[x * 4 + 1] = value;
+            out[x * 4 + 2] = value;
+            out[x * 4 + 3] = 255;
+        }
+    }
+
+	// Masked hatching of a RGBA8 row to packed bits.
+    template <typename Test>
+    void HatchRowBits(const unsigned char* in, const uint64_t* mask, uint64_t* out, int width, bool invertBackground, const Test& test)
+    {
+        for (int x = 0; x < width; x += 64)
+        {
+            const int count = (width - x) < 64 ? (width - x) : 64;
+            uint64_t word = 0;
+            for (int j = 0; j < count; ++j)
+            {
+                word |= static_cast<uint64_t>(test(in + (x + j) * 4)) << j;
+            }
+
+            const uint64_t lines = mask[x >> 6];
+            out[x >> 6] = word | (invertBackground ? ~lines : lines);
+        }
+    }
+
+	// Smallest byte whose normalized value passes the gray test of the hatching (256 when none does):
+	// unit > threshold for the black background, unit >= threshold for the white one (gray < threshold fails).
+    int HatchLevel(float threshold, bool invertBackground)
+    {
+        const float* unit = Unit().value;
+        int level = 0;
+        while (level < 256 && (invertBackground ? unit[level] < threshold : !(unit[level] > threshold)))
+        {
+            ++level;
+        }
+        return level;
+    }
+
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    // Function: ParseISA
+    // Description: Reads the SKETCH_ISA environment variable (scalar, sse41, avx2, neon).
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    bool ParseISA(const char* name, KernelISA& isa)
+    {
+        if (name == nullptr) return false;
+        if (strcmp(name, "scalar") == 0) { isa = KernelISA::Scalar; return true; }
+        if (strcmp(name, "sse41") == 0)  { isa = KernelISA::SSE41;  return true; }
+        if (strcmp(name, "avx2") == 0)   { isa = KernelISA::AVX2;   return true; }
+        if (strcmp(name, "neon") == 0)   { isa = KernelISA::NEON;   return true; }
+        return false;
+    }
+
+    bool Supported(KernelISA isa)
+    {
+        KernelISA best = CPU_Kernels::DetectISA();
+        switch (isa)
+        {
+        case KernelISA::Scalar: return true;
+        case KernelISA::SSE41:  return best == KernelISA::SSE41 || best == KernelISA::AVX2;
+        case KernelISA::AVX2:   return best == KernelISA::AVX2;
+        case KernelISA::NEON:   return best == KernelISA::NEON;
+        }
+        return false;
+    }
+
+    atomic<int>& Selected()
+    {
+        static atomic<int> selected([] {
+            KernelISA isa = CPU_Kernels::DetectISA();
+            KernelISA requested;
+            if (ParseISA(getenv("SKETCH_ISA"), requested) && Supported(requested))
+            {
+                isa = requested;
+            }
+            return static_cast<int>(isa);
+        }());
+        return selected;
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: DetectISA
+// Description: Detects the best instruction set of the running CPU.
+// Returns:
+//   - AVX2 / SSE4.1 on x86 (AVX2 also requires the OS to save the YMM state), NEON on AArch64, Scalar otherwise.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+KernelISA CPU_Kernels::DetectISA()
+{
+    static const KernelISA detected = [] {
+#if defined(SKETCH_X86) && defined(_MSC_VER)
+        int info[4] = { 0 };
+        __cpuid(info, 0);
+        int maxLeaf = info[0];
+
+        __cpuid(info, 1);
+        bool sse41 = (info[2] & (1 << 19)) != 0;
+        bool osxsave = (info[2] & (1 << 27)) != 0;
+        bool avx = (info[2] & (1 << 28)) != 0;
+        bool avx2 = false;
+
+        if (maxLeaf >= 7 && osxsave && avx && (_xgetbv(0) & 0x6) == 0x6)
+        {
+            __cpuidex(info, 7, 0);
+            avx2 = (info[1] & (1 << 5)) != 0;
+        }
+
+        if (avx2) return KernelISA::AVX2;
+        if (sse41) return KernelISA::SSE41;
+        return KernelISA::Scalar;
+#elif defined(SKETCH_X86)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) return KernelISA::AVX2;
+        if (__builtin_cpu_supports("sse4.1")) return KernelISA::SSE41;
+        return KernelISA::Scalar;
+#elif defined(SKETCH_NEON)
+        return KernelISA::NEON;
+#else
+        return KernelISA::Scalar;
+#endif
+    }();
+    return detected;
+}
+
+
+KernelISA CPU_Kernels::ActiveISA()
+{
+    return static_cast<KernelISA>(Selected().load(memory_order_relaxed));
+}
+
+
+void CPU_Kernels::SetISA(KernelISA isa)
+{
+    Selected().store(static_cast<int>(Supported(isa) ? isa : DetectISA()), memory_order_relaxed);
+}
+
+
+const char* CPU_Kernels::ISAName(KernelISA isa)
+{
+    switch (isa)
+    {
+    case KernelISA::Scalar: return "Scalar";
+    case KernelISA::SSE41:  return "SSE4.1";
+    case KernelISA::AVX2:   return "AVX2";
+    case KernelISA::NEON:   return "NEON";
+    }
+    return "Unknown";
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: BlurRowRGBA / BlurRowPlane
+// Description: Horizontal gaussian blur of a row, dispatched on the active instruction set.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void CPU_Kernels::BlurRowRGBA(
+    const unsigned char* in, unsigned char* out,
+    int width, const float* weights, int radius,
+    float* scratch)
+{
+    BlurRow(ActiveISA(), in, out, width, weights, radius, scratch, 4);
+}
+
+
+void CPU_Kernels::BlurRowPlane(
+    const unsigned char* in, unsigned char* out,
+    int width, const float* weights, int radius,
+    float* scratch)
+{
+    BlurRow(ActiveISA(), in, out, width, weights, radius, scratch, 1);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: BlurBandRGBA / BlurBandPlane
+// Description: Vertical gaussian blur of the rows [y0, y1) of an image, dispatched on the active instruction set.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void CPU_Kernels::BlurBandRGBA(
+    const unsigned char* in, unsigned char* out,
+    int width, int height, int y0, int y1,
+    const float* weights, int radius,
+    float* scratch)
+{
+    BlurBand(ActiveISA(), in, out, width, height, y0, y1, weights, radius, scratch, 4);
+}
+
+
+void CPU_Kernels::BlurBandPlane(
+    const unsigned char* in, unsigned char* out,
+    int width, int height, int y0, int y1,
+    const float* weights, int radius,
+    float* scratch)
+{
+    BlurBand(ActiveISA(), in, out, width, height, y0, y1, weights, radius, scratch, 1);
+}
+
+
+size_t CPU_Kernels::BlurRowScratchSize(int width, int radius, int channels)
+{
+    return TapBytes(radius) / sizeof(float) + static_cast<size_t>(width + 2 * radius) * channels;
+}
+
+
+size_t CPU_Kernels::BlurBandScratchSize(int width, int radius, int channels)
+{
+    return TapBytes(radius) / sizeof(float) +
+        static_cast<size_t>(2 * radius + 1) * BandStripWidth(width, radius, channels) * channels;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: FixedWeights
+// Description: Quantizes a normalized float kernel to Q0.16 weights. The rounding error is given to the center
+//              tap so the weights sum exactly to 1.0 (65536) and a constant image stays constant. A single tap
+//              (radius 0) is the exception: 1.0 does not fit in 16 bits, its weight is 65535 and the fixed blurs
+//              copy their input for radius 0 instead of weighing it.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void CPU_Kernels::FixedWeights(const float* weights, int taps, unsigned short* fixed)
+{
+    int sum = 0;
+    for (int k = 0; k < taps; ++k)
+    {
+        int w = Clamp(static_cast<int>(weights[k] * 65536.0f + 0.5f), 0, 65535);
+        fixed[k] = static_cast<unsigned short>(w);
+        sum += w;
+    }
+
+    const int center = taps / 2;
+    fixed[center] = static_cast<unsigned short>(Clamp(fixed[center] + 65536 - sum, 0, 65535));
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: BlurRowFixedRGBA / BlurRowFixedPlane / BlurBandFixedRGBA / BlurBandFixedPlane
+// Description: Fixed point gaussian blurs (Q0.16 weights, u16 accumulators, rounded saturating stores).
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void CPU_Kernels::BlurRowFixedRGBA(
+    const unsigned char* in, unsigned char* out,
+    int width, const unsigned short* weights, int radius,
+    unsigned char* scratch)
+{
+    BlurRowFixed(ActiveISA(), in, out, width, weights, radius, scratch, 4);
+}
+
+
+void CPU_Kernels::BlurRowFixedPlane(
+    const unsigned char* in, unsigned char* out,
+    int width, const unsigned short* weights, int radius,
+    unsigned char* scratch)
+{
+    BlurRowFixed(ActiveISA(), in, out, width, weights, radius, scratch, 1);
+}
+
+
+void CPU_Kernels::BlurBandFixedRGBA(
+    const unsigned char* in, unsigned char* out,
+    int width, int height, int y0, int y1,
+    const unsigned short* weights, int radius,
+    unsigned char* scratch)
+{
+    BlurBandFixed(ActiveISA(), in, out, width, height, y0, y1, weights, radius, scratch, 4);
+}
+
+
+void CPU_Kernels::BlurBandFixedPlane(
+    const unsigned char* in, unsigned char* out,
+    int width, int height, int y0, int y1,
+    const unsigned short* weights, int radius,
+    unsigned char* scratch)
+{
+    BlurBandFixed(ActiveISA(), in, out, width, height, y0, y1, weights, radius, scratch, 1);
+}
+
+
+size_t CPU_Kernels::BlurRowFixedScratchSize(int width, int radius, int channels)
+{
+    return TapBytes(radius) + static_cast<size_t>(width + 2 * radius) * channels;
+}
+
+
+size_t CPU_Kernels::BlurBandFixedScratchSize(int radius)
+{
+    return TapBytes(radius);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: RecursiveCoefficients
+// Description: Coefficients of the recursive gaussian of Young - van Vliet (3rd order causal + anticausal passes),
+//              with the Triggs - Sdika initialisation of the anticausal pass for clamped borders.
+// Parameters:
+//   - sigma: Standard deviation of the gaussian (>= 0.5).
+// Returns:
+//   - The input gain, the 3 feedback coefficients and the right border matrix (scaled by the gain).
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+CPU_Kernels::RecursiveGaussian CPU_Kernels::RecursiveCoefficients(float sigma)
+{
+    double s = sigma < 0.5f ? 0.5 : sigma;
+    double q = s >= 2.5 ? 0.98711 * s - 0.96330 : 3.97156 - 4.14554 * sqrt(1.0 - 0.26891 * s);
+
+    double b0 = 1.57825 + 2.44413 * q + 1.4281 * q * q + 0.422205 * q * q * q;
+    double a1 = (2.44413 * q + 2.85619 * q * q + 1.26661 * q * q * q) / b0;
+    double a2 = -(1.4281 * q * q + 1.26661 * q * q * q) / b0;
+    double a3 = (0.422205 * q * q * q) / b0;
+    double B = 1.0 - (a1 + a2 + a3);
+
+    double scale = B / ((1.0 + a1 - a2 + a3) * (1.0 - a1 - a2 - a3) * (1.0 + a2 + (a1 - a3) * a3));
+    double M[9] =
+    {
+        -a3 * a1 + 1.0 - a3 * a3 - a2,
+        (a3 + a1) * (a2 + a3 * a1),
+        a3 * (a1 + a3 * a2),
+        a1 + a3 * a2,
+        -(a2 - 1.0) * (a2 + a3 * a1),
+        -a3 * (a3 * a1 + a3 * a3 + a2 - 1.0),
+        a3 * a1 + a2 + a1 * a1 - a2 * a2,
+        a1 * a2 + a3 * a2 * a2 - a1 * a3 * a3 - a3 * a3 * a3 - a3 * a2 + a3,
+        a3 * (a1 + a3 * a2),
+    };
+
+    RecursiveGaussian g;
+    g.B = static_cast<float>(B);
+    g.a[0] = static_cast<float>(a1);
+    g.a[1] = static_cast<float>(a2);
+    g.a[2] = static_cast<float>(a3);
+    for (int k = 0; k < 9; ++k)
+    {
+        g.M[k] = static_cast<float>(M[k] * scale);
+    }
+    return g;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: RecursiveRowsRGBA / RecursiveRowsPlane
+// Description: Horizontal recursive gaussian blur of the rows [y0, y1), the cost per pixel does not depend on sigma.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void CPU_Kernels::RecursiveRowsRGBA(
+    const unsigned char* in, unsigned char* out,
+    int width, int y0, int y1,
+    const RecursiveGaussian& g,
+    float* scratch)
+{
+    RecursiveRows<4>(ActiveISA(), in, out, width, y0, y1, g, scratch);
+}
+
+
+void CPU_Kernels::RecursiveRowsPlane(
+    const unsigned char* in, unsigned char* out,
+    int width, int y0, int y1,
+    const RecursiveGaussian& g,
+    float* scratch)
+{
+    RecursiveRows<1>(ActiveISA(), in, out, width, y0, y1, g, scratch);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: RecursiveColumnsRGBA / RecursiveColumnsPlane
+// Description: Vertical recursive gaussian blur of the columns [x0, x1), the cost per pixel does not depend on sigma.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void CPU_Kernels::RecursiveColumnsRGBA(
+    const unsigned char* in, unsigned char* out,
+    int width, int height, int x0, int x1, int y0, int y1,
+    const RecursiveGaussian& g,
+    float* scratch)
+{
+    RecursiveColumns(ActiveISA(), in, out, width, height, x0, x1, y0, y1, g, scratch, 4);
+}
+
+
+void CPU_Kernels::RecursiveColumnsPlane(
+    const unsigned char* in, unsigned char* out,
+    int width, int height, int x0, int x1, int y0, int y1,
+    const RecursiveGaussian& g,
+    float* scratch)
+{
+    RecursiveColumns(ActiveISA(), in, out, width, height, x0, x1, y0, y1, g, scratch, 1);
+}
+
+
+size_t CPU_Kernels::RecursiveScratchSize(int length)
+{
+	// lines + first/last/virtual lanes + one converted row (RGBA) for the horizontal blocks
+    return static_cast<size_t>(length + 4) * kRecursiveLanes + static_cast<size_t>(length) * 4;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: BoxRadii
+// Description: Radii of the 3 box filters whose succession approximates a gaussian of standard deviation sigma
+//              (widths wl, wl, ..., wl + 2 chosen so that the summed variances match sigma^2).
+// Parameters:
+//   - sigma: Standard deviation of the gaussian.
+//   - radii: Radii of the 3 passes.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void CPU_Kernels::BoxRadii(float sigma, int radii[3])
+{
+    const int passes = 3;
+    double variance = 12.0 * sigma * sigma;
+    int lower = static_cast<int>(floor(sqrt(variance / passes + 1.0)));
+    if (lower % 2 == 0)
+    {
+        --lower;
+    }
+    int upper = lower + 2;
+    int lowerCount = static_cast<int>(floor((variance - passes * lower * lower - 4.0 * passes * lower - 3.0 * passes) / (-4.0 * lower - 4.0) + 0.5));
+
+    for (int i = 0; i < passes; ++i)
+    {
+        int radius = ((i < lowerCount ? lower : upper) - 1) / 2;
+        radii[i] = radius < 0 ? 0 : (radius > kBoxMaxRadius ? kBoxMaxRadius : radius);
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: BoxRowRGBA / BoxRowPlane
+// Description: Horizontal 3 pass box blur of a row (integer only, constant cost per pixel).
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void CPU_Kernels::BoxRowRGBA(
+    const unsigned char* in, unsigned char* out,
+    int width, const int radii[3],
+    unsigned short* scratch)
+{
+    BoxRow<4>(ActiveISA(), in, out, width, radii, scratch);
+}
+
+
+void CPU_Kernels::BoxRowPlane(
+    const unsigned char* in, unsigned char* out,
+    int width, const int radii[3],
+    unsigned short* scratch)
+{
+    BoxRow<1>(ActiveISA(), in, out, width, radii, scratch);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: BoxBandRGBA / BoxBandPlane
+// Description: Vertical 3 pass box blur of the rows [y0, y1) (integer only, constant cost per pixel).
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void CPU_Kernels::BoxBandRGBA(
+    const unsigned char* in, unsigned char* out,
+    int width, int height, int y0, int y1,
+    const int radii[3],
+    unsigned short* scratch)
+{
+    BoxBand(ActiveISA(), in, out, width, height, y0, y1, radii, scratch, 4);
+}
+
+
+void CPU_Kernels::BoxBandPlane(
+    const unsigned char* in, unsigned char* out,
+    int width, int height, int y0, int y1,
+    const int radii[3],
+    unsigned short* scratch)
+{
+    BoxBand(ActiveISA(), in, out, width, height, y0, y1, radii, scratch, 1);
+}
+
+
+size_t CPU_Kernels::BoxBandScratchSize(int rows, const int radii[3])
+{
+	// rows of the first pass (band + radii of the next 2 passes) and of the second pass (band + last radius)
+    return static_cast<size_t>(2 * rows + 2 * radii[1] + 4 * radii[2]) * kBoxLanes;
+}
+
+
+void CPU_Kernels::ToUnitRGBA(const unsigned char* in, float* out, int count)
+{
+    ToUnit(ActiveISA(), in, out, count * 4);
+}
+
+
+void CPU_Kernels::WeightedSumRGBA(
+    const float* const* src, int taps, const float* weights,
+    unsigned char* out, int count)
+{
+    WeightedSum(ActiveISA(), src, taps, weights, out, count * 4, kAlphaMask);
+}
+
+
+void CPU_Kernels::WeightedSumFixedRGBA(
+    const unsigned char* const* src, int taps, const unsigned short* weights,
+    unsigned char* out, int count)
+{
+    FixedSum(ActiveISA(), src, taps, weights, out, count * 4, kAlphaMask);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: SobelRow
+// Description: Sobel edge detection + binarization of one row (edges are black, the rest white).
+//              Separable [1 2 1] x [-1 0 1] form on padded luma rows (no bounds checks), the squared magnitude
+//              is compared to the squared threshold, the integer arithmetic is exact on every instruction set.
+// Parameters:
+//   - above, row, below: padded luma rows y - 1, y, y + 1 (width + 2 bytes, clamped by the caller)
+//   - out: output plane row (width bytes, 0 or 255)
+//   - width: number of pixels of the row
+//   - threshold: magnitude of the gradient (gray nuances in [0, 1]) from which a pixel is an edge
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void CPU_Kernels::SobelRow(
+    const unsigned char* above, const unsigned char* row, const unsigned char* below,
+    unsigned char* out, int width, float threshold)
+{
+    SobelBinary(ActiveISA(), above, row, below, out, width, SobelLimit(threshold));
+}
+
+
+void CPU_Kernels::SobelRowBits(
+    const unsigned char* above, const unsigned char* row, const unsigned char* below,
+    uint64_t* bits, int width, float threshold)
+{
+    const KernelISA isa = ActiveISA();
+    const int limit = SobelLimit(threshold);
+
+    // Chunks of kBitChunk bytes on the stack (a whole number of words), packed as soon as they are binarized
+    unsigned char chunk[kBitChunk];
+    for (int x = 0; x < width; x += kBitChunk)
+    {
+        const int n = (width - x) < kBitChunk ? (width - x) : kBitChunk;
+        SobelBinary(isa, above + x, row + x, below + x, chunk, n, limit);
+        AtLeastBits(isa, chunk, n, 128, bits + (x >> 6));
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: PadLumaRGBA / PadLumaFixedRGBA
+// Description: Builds a padded luma row (width + 2 bytes) from a RGBA8 row, the gray nuance rounded to the nearest
+//              byte (float or Q0.16 coefficients), the first and last pixels are replicated on both sides.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void CPU_Kernels::PadLumaRGBA(const unsigned char* in, unsigned char* padded, int width)
+{
+    for (int i = 0; i < width; ++i)
+    {
+        padded[i + 1] = static_cast<unsigned char>(GrayNuance(in + i * 4) * 255.0f + 0.5f);
+    }
+    padded[0] = padded[1];
+    padded[width + 1] = padded[width];
+}
+
+
+void CPU_Kernels::PadLumaFixedRGBA(const unsigned char* in, unsigned char* padded, int width)
+{
+    for (int i = 0; i < width; ++i)
+    {
+        padded[i + 1] = static_cast<unsigned char>((GrayFixed(in + i * 4) + 32768u) >> 16);
+    }
+    padded[0] = padded[1];
+    padded[width + 1] = padded[width];
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: HatchMaskRow
+// Description: Hatching lines of one row as packed bits (1 where a line is lit). The mask only depends on the
+//              size of the image and the hatch parameters, so it is computed once and reused by the masked
+//              hatching below, which then only tests the gray of the pixels (no sin() per pixel).
+// Parameters:
+//   - mask: row of BitWords(width) words
+//   - width, height, y: size of the image and index of the row (for the texture coordinates)
+//   - hatch: (a, b, c) parameters of the hatching lines
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void CPU_Kernels::HatchMaskRow(uint64_t* mask, int width, int height, int y, const float* hatch)
+{
+    float v = static_cast<float>(y) / height;
+
+    for (int x = 0; x < width; x += 64)
+    {
+        const int count = (width - x) < 64 ? (width - x) : 64;
+        uint64_t word = 0;
+        for (int j = 0; j < count; ++j)
+        {
+            float u = static_cast<float>(x + j) / width;
+            word |= static_cast<uint64_t>(HatchLine(u, v, hatch)) << j;
+        }
+        mask[x >> 6] = word;
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: HatchMaskedRowRGBA / HatchMaskedRowFixedRGBA / HatchBitsRGBA / HatchBitsFixedRGBA / HatchBitsPlane
+// Description: Hatching of one row from its line mask, a gray test and a select per pixel, branchless.
+//              A pixel is white when it passes the gray test (gray > threshold on the black background,
+//              gray < threshold on the white one) or when its line bit (inverted on the white background) is set.
+//              The Bits versions write packed bits, the plane one compares whole words of bytes against
+//              the level of the threshold.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void CPU_Kernels::HatchMaskedRowRGBA(
+    const unsigned char* in, const uint64_t* mask, unsigned char* out,
+    int width, float threshold, bool invertBackground)
+{
+    HatchRowBytes(in, mask, out, width, invertBackground, HatchGrayTest(threshold, invertBackground));
+}
+
+
+void CPU_Kernels::HatchMaskedRowFixedRGBA(
+    const unsigned char* in, const uint64_t* mask, unsigned char* out,
+    int width, float threshold, bool invertBackground)
+{
+    HatchRowBytes(in, mask, out, width, invertBackground, HatchGrayTestFixed(threshold, invertBackground));
+}
+
+
+void CPU_Kernels::HatchBitsRGBA(
+    const unsigned char* in, const uint64_t* mask, uint64_t* out,
+    int width, float threshold, bool invertBackground)
+{
+    HatchRowBits(in, mask, out, width, invertBackground, HatchGrayTest(threshold, invertBackground));
+}
+
+
+void CPU_Kernels::HatchBitsFixedRGBA(
+    const unsigned char* in, const uint64_t* mask, uint64_t* out,
+    int width, float threshold, bool invertBackground)
+{
+    HatchRowBits(in, mask, out, width, invertBackground, HatchGrayTestFixed(threshold, invertBackground));
+}
+
+
+void CPU_Kernels::HatchBitsPlane(
+    const unsigned char* in, const uint64_t* mask, uint64_t* out,
+    int width, float threshold, bool invertBackground)
+{
+    // lit = in >= level: the bright pixels (black background), the ones that are not dark (white background)
+    AtLeastBits(ActiveISA(), in, width, HatchLevel(threshold, invertBackground), out);
+
+    const int words = BitWords(width);
+    for (int w = 0; w < words; ++w)
+    {
+        out[w] = invertBackground ? ~(out[w] & mask[w]) : (out[w] | mask[w]);
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: BitWords / AndBits / ExpandBits
+// Description: Packed binary rows: 64 pixels per word, bit x & 63 of the word x >> 6, 1 for white (255).
+//              The minimum of binary images is the AND of their bits.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+int CPU_Kernels::BitWords(int width)
+{
+    return (width + 63) / 64;
+}
+
+
+void CPU_Kernels::AndBits(const uint64_t* in, uint64_t* inout, int words)
+{
+    for (int w = 0; w < words; ++w)
+    {
+        inout[w] &= in[w];
+    }
+}
+
+
+void CPU_Kernels::ExpandBits(const uint64_t* bits, unsigned char* out, int count)
+{
+    for (int x = 0; x < count; ++x)
+    {
+        const uint32_t pixel = Bit(bits, x) ? 0xFFFFFFFFu : kAlphaMask;
+        memcpy(out + x * 4, &pixel, sizeof(pixel));
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: MinRGBA
+// Description: Per channel minimum of two spans, (x / 255.0f) * 255.0f truncates back to x for every byte
+//              so this is the same as the minimum taken on normalized floats.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void CPU_Kernels::MinRGBA(const unsigned char* in, unsigned char* inout, int count)
+{
+    for (int i = 0; i < count * 4; i += 4)
+    {
+        inout[i + 0] = in[i + 0] < inout[i + 0] ? in[i + 0] : inout[i + 0];
+        inout[i + 1] = in[i + 1] < inout[i + 1] ? in[i + 1] : inout[i + 1];
+        inout[i + 2] = in[i + 2] < inout[i + 2] ? in[i + 2] : inout[i + 2];
+        inout[i + 3] = 255;
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: ExpandPlane
+// Description: Expands a single channel plane to gray RGBA8 pixels (upload / export only).
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void CPU_Kernels::ExpandPlane(const unsigned char* in, unsigned char* out, int count)
+{
+    for (int i = 0; i < count; ++i)
+    {
+        out[i * 4 + 0] = in[i];
+        out[i * 4 + 1] = in[i];
+        out[i * 4 + 2] = in[i];
+        out[i * 4 + 3] = 255;
+    }
+}
@@ -0,0 +1,226 @@
+#pragma once
+
+#ifndef CPU_KERNELS_H
+#define CPU_KERNELS_H
+
+#include <cstddef>
+#include <cstdint>
+
+/// Raw pixel kernels used by the CPU pipeline (no GL, only plain pixel buffers).
+/// Every kernel has a scalar reference version and SIMD versions (SSE4.1, AVX2, NEON),
+/// the best instruction set is selected once at runtime from CPUID.
+///
+/// Precision: the SIMD kernels execute exactly the same float operations as the scalar
+/// reference (u8 / 255.0f, multiply by the weight, add in tap order, truncate * 255.0f),
+/// without fused multiply-add, so the results are bit-identical on x86. On AArch64 the
+/// compiler may contract the scalar multiply-add into an FMA, results then differ by at
+/// most 1 (out of 255) on a channel.
+///
+/// The *Fixed* kernels are integer only (Q0.16 weights and luma coefficients, u16 accumulators,
+/// rounded saturating stores), their results are the same on every compiler and instruction set.
+
+// Instruction sets the CPU kernels can be dispatched to
+enum class KernelISA
+{
+    Scalar,
+    SSE41,
+    AVX2,
+    NEON
+};
+
+
+namespace CPU_Kernels
+{
+	// Best instruction set supported by the running CPU (and OS, for the AVX state).
+    KernelISA DetectISA();
+	// Instruction set used by the kernels (DetectISA() or the SKETCH_ISA environment variable).
+    KernelISA ActiveISA();
+	// Force an instruction set, unsupported ones fall back to the detected one.
+    void SetISA(KernelISA isa);
+	// Human readable name of the instruction set.
+    const char* ISAName(KernelISA isa);
+
+	// Horizontal gaussian blur of a single RGBA8 row, borders are clamped.
+	// - in/out: row of width pixels (width * 4 bytes)
+	// - weights: 2 * radius + 1 normalized weights
+	// - scratch: at least BlurRowScratchSize(width, radius) floats (tap pointers and padded row, malloc aligned)
+    void BlurRowRGBA(
+        const unsigned char* in, unsigned char* out,
+        int width, const float* weights, int radius,
+        float* scratch);
+	// Vertical gaussian blur of the rows [y0, y1) of a RGBA8 image (borders are clamped).
+	// - in/out: full images of width * height pixels
+	// - scratch: at least BlurBandScratchSize(width, radius) floats
+    void BlurBandRGBA(
+        const unsigned char* in, unsigned char* out,
+        int width, int height, int y0, int y1,
+        const float* weights, int radius,
+        float* scratch);
+	// Number of floats of scratch needed by the horizontal / vertical blur of channels bytes per pixel.
+    size_t BlurRowScratchSize(int width, int radius, int channels = 4);
+    size_t BlurBandScratchSize(int width, int radius, int channels = 4);
+
+	// Same blurs on a single channel plane (one byte per pixel),
+	// scratch: BlurRowScratchSize(width, radius, 1) floats for a row, BlurBandScratchSize(width, radius, 1) for a band.
+    void BlurRowPlane(
+        const unsigned char* in, unsigned char* out,
+        int width, const float* weights, int radius,
+        float* scratch);
+    void BlurBandPlane(
+        const unsigned char* in, unsigned char* out,
+        int width, int height, int y0, int y1,
+        const float* weights, int radius,
+        float* scratch);
+
+	// Fixed point blurs: Q0.16 weights (FixedWeights of the float kernel) on the bytes, 8.8 u16 accumulators.
+	// Q0.16 weights of a normalized kernel of taps weights, they sum exactly to 65536 (65535 for a single tap: the
+	// fixed blurs copy their input for radius 0).
+    void FixedWeights(const float* weights, int taps, unsigned short* fixed);
+	// Horizontal blur of a RGBA8 row / a plane row, scratch: BlurRowFixedScratchSize(width, radius, 4 / 1) bytes.
+    void BlurRowFixedRGBA(
+        const unsigned char* in, unsigned char* out,
+        int width, const unsigned short* weights, int radius,
+        unsigned char* scratch);
+    void BlurRowFixedPlane(
+        const unsigned char* in, unsigned char* out,
+        int width, const unsigned short* weights, int radius,
+        unsigned char* scratch);
+	// Vertical blur of the rows [y0, y1) of a RGBA8 image / a plane (reads the input rows in place),
+	// scratch: BlurBandFixedScratchSize(radius) bytes (the tap pointers).
+    void BlurBandFixedRGBA(
+        const unsigned char* in, unsigned char* out,
+        int width, int height, int y0, int y1,
+        const unsigned short* weights, int radius,
+        unsigned char* scratch);
+    void BlurBandFixedPlane(
+        const unsigned char* in, unsigned char* out,
+        int width, int height, int y0, int y1,
+        const unsigned short* weights, int radius,
+        unsigned char* scratch);
+	// Bytes of scratch of the fixed point horizontal / vertical blurs.
+    size_t BlurRowFixedScratchSize(int width, int radius, int channels = 4);
+    size_t BlurBandFixedScratchSize(int radius);
+
+	// Recursive (IIR) gaussian of Young - van Vliet, the cost per pixel does not depend on sigma.
+    struct RecursiveGaussian
+    {
+        float B;    // gain of the input
+        float a[3]; // feedback of the 3 previous outputs
+        float M[9]; // anticausal initialisation for clamped borders (Triggs - Sdika)
+    };
+	// Coefficients of the recursive gaussian of standard deviation sigma.
+    RecursiveGaussian RecursiveCoefficients(float sigma);
+	// Horizontal recursive blur of the rows [y0, y1) of a RGBA8 image / a plane,
+	// scratch: at least RecursiveScratchSize(width) floats.
+    void RecursiveRowsRGBA(
+        const unsigned char* in, unsigned char* out,
+        int width, int y0, int y1,
+        const RecursiveGaussian& g,
+        float* scratch);
+    void RecursiveRowsPlane(
+        const unsigned char* in, unsigned char* out,
+        int width, int y0, int y1,
+        const RecursiveGaussian& g,
+        float* scratch);
+	// Vertical recursive blur of the columns [x0, x1) of a RGBA8 image / a plane, only the rows [y0, y1) are written.
+	// scratch: at least RecursiveScratchSize(height) floats.
+    void RecursiveColumnsRGBA(
+        const unsigned char* in, unsigned char* out,
+        int width, int height, int x0, int x1, int y0, int y1,
+        const RecursiveGaussian& g,
+        float* scratch);
+    void RecursiveColumnsPlane(
+        const unsigned char* in, unsigned char* out,
+        int width, int height, int x0, int x1, int y0, int y1,
+        const RecursiveGaussian& g,
+        float* scratch);
+	// Number of floats of scratch of the recursive blurs (length: width for the rows, height for the columns).
+    size_t RecursiveScratchSize(int length);
+
+	// Iterated box blur approximating a gaussian (3 running sum passes, integer only, 8.8 fixed point between passes).
+	// Radii of the 3 passes for a gaussian of standard deviation sigma.
+    void BoxRadii(float sigma, int radii[3]);
+	// Horizontal box blur of a RGBA8 row / a plane row, scratch: 2 * width * 4 / 2 * width u16.
+    void BoxRowRGBA(
+        const unsigned char* in, unsigned char* out,
+        int width, const int radii[3],
+        unsigned short* scratch);
+    void BoxRowPlane(
+        const unsigned char* in, unsigned char* out,
+        int width, const int radii[3],
+        unsigned short* scratch);
+	// Vertical box blur of the rows [y0, y1) of a RGBA8 image / a plane,
+	// scratch: at least BoxBandScratchSize(y1 - y0, radii) u16.
+    void BoxBandRGBA(
+        const unsigned char* in, unsigned char* out,
+        int width, int height, int y0, int y1,
+        const int radii[3],
+        unsigned short* scratch);
+    void BoxBandPlane(
+        const unsigned char* in, unsigned char* out,
+        int width, int height, int y0, int y1,
+        const int radii[3],
+        unsigned short* scratch);
+    size_t BoxBandScratchSize(int rows, const int radii[3]);
+
+	// Converts RGBA8 pixels to floats in [0, 1] (count pixels, count * 4 floats).
+    void ToUnitRGBA(const unsigned char* in, float* out, int count);
+	// Weighted sum of float RGBA streams: out pixel x = sum_k weights[k] * src[k][x] (alpha set to 255).
+    void WeightedSumRGBA(
+        const float* const* src, int taps, const float* weights,
+        unsigned char* out, int count);
+	// Fixed point version on RGBA8 streams with Q0.16 weights.
+    void WeightedSumFixedRGBA(
+        const unsigned char* const* src, int taps, const unsigned short* weights,
+        unsigned char* out, int count);
+
+	// Sobel edge detection + binarization of a row, on padded luma rows (width + 2 bytes, pixel x at index x + 1).
+	// above/below are the clamped neighbour rows, out gets width bytes (0 on edges, 255 elsewhere).
+    void SobelRow(
+        const unsigned char* above, const unsigned char* row, const unsigned char* below,
+        unsigned char* out, int width, float threshold);
+	// Padded luma row (width + 2 bytes) of a RGBA8 row (0.21 R + 0.71 G + 0.07 B, rounded), borders replicated.
+    void PadLumaRGBA(const unsigned char* in, unsigned char* padded, int width);
+	// Integer luma (Q0.16 coefficients, rounded).
+    void PadLumaFixedRGBA(const unsigned char* in, unsigned char* padded, int width);
+
+	// Packed binary rows (1 bit per pixel, 1 = white): BitWords(width) words per row, bit x & 63 of the word x >> 6.
+	// The unused bits of the last word are unspecified.
+    int BitWords(int width);
+	// Minimum of binary rows: inout &= in.
+    void AndBits(const uint64_t* in, uint64_t* inout, int words);
+	// Packed row -> gray RGBA8 (0 or 255, alpha 255).
+    void ExpandBits(const uint64_t* bits, unsigned char* out, int count);
+	// Sobel edge detection + binarization of a row (see SobelRow) to packed bits (0 on edges).
+    void SobelRowBits(
+        const unsigned char* above, const unsigned char* row, const unsigned char* below,
+        uint64_t* bits, int width, float threshold);
+
+	// Hatching line mask of the row y of a width x height image as packed bits, a line is lit (1) where
+	// sin(hatch[0] * u + hatch[1] * v) > hatch[2].
+    void HatchMaskRow(uint64_t* mask, int width, int height, int y, const float* hatch);
+	// Hatching of a row from its line mask (dark areas get the lines, or the inverse with invertBackground),
+	// to RGBA8 or to packed bits.
+    void HatchMaskedRowRGBA(
+        const unsigned char* in, const uint64_t* mask, unsigned char* out,
+        int width, float threshold, bool invertBackground);
+    void HatchMaskedRowFixedRGBA(
+        const unsigned char* in, const uint64_t* mask, unsigned char* out,
+        int width, float threshold, bool invertBackground);
+    void HatchBitsRGBA(
+        const unsigned char* in, const uint64_t* mask, uint64_t* out,
+        int width, float threshold, bool invertBackground);
+    void HatchBitsFixedRGBA(
+        const unsigned char* in, const uint64_t* mask, uint64_t* out,
+        int width, float threshold, bool invertBackground);
+    void HatchBitsPlane(
+        const unsigned char* in, const uint64_t* mask, uint64_t* out,
+        int width, float threshold, bool invertBackground);
+	// Per channel minimum of two RGBA8 spans, stored in inout (alpha set to 255).
+    void MinRGBA(const unsigned char* in, unsigned char* inout, int count);
+
+	// Luma plane -> gray RGBA8.
+    void ExpandPlane(const unsigned char* in, unsigned char* out, int count);
+}
+
+#endif // CPU_KERNELS_H
@@ -1,6 +1,5 @@
 ﻿#include "CPU_SketchEffect.h"
 
-#include <thread>
 #include <iostream>
 
 using namespace std;
@@ -12,15 +11,48 @@ CPU_SketchEffect::CPU_SketchEffect(
     unordered_map<string, GLuint>& texturesRef,
     unordered_map<string, Shader*>& shadersRef,
     unordered_map<string, Mesh*>& meshesRef,
-    size_t threadCount)
+    size_t threadCount,
+    Affinity affinity)
     : resolution(resolutionRef),
     framebuffers(framebuffersRef), textures(texturesRef),
     shaders(shadersRef), meshes(meshesRef),
-    pool(threadCount) {}
+    pipeline(threadCount, affinity) {}
 
 CPU_SketchEffect::~CPU_SketchEffect() {}
 
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: SetPrecision / GetPrecision
+// Description: Precision mode of the CPU stages (see SketchPipeline::SetPrecision).
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void CPU_SketchEffect::SetPrecision(Precision mode)
+{
+    pipeline.SetPrecision(mode);
+}
+
+
+Precision CPU_SketchEffect::GetPrecision() const
+{
+    return pipeline.GetPrecision();
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: SetIdlePolicy / GetIdlePolicy
+// Description: Idle phase of the CPU workers (see SketchPipeline::SetIdlePolicy).
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void CPU_SketchEffect::SetIdlePolicy(const IdlePolicy& policy)
+{
+    pipeline.SetIdlePolicy(policy);
+}
+
+
+IdlePolicy CPU_SketchEffect::GetIdlePolicy() const
+{
+    return pipeline.GetIdlePolicy();
+}
+
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Function: RenderOriginal
 // Description: Renders the original input texture without applying any processing.
@@ -66,330 +98,113 @@ void CPU_SketchEffect::RenderOriginal(
 
     RenderMesh(meshes["quad"], shader, modelMatrix);
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    // The framebuffer was rendered again, the next stage reading it fetches it again (the pipeline keeps the version,
+    // and every stage computed from it, if the pixels did not change)
+    rendered.insert(fboName);
 }
 
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-// Function: GrayNuance
-// Description: Computes the gray nuance of a pixel.
+// Function: Present
+// Description: Uploads the host image of a stage to a texture. The stages keep their results in host memory and
+//              pass them to each other without touching GL, only the displayed (or saved) stage has to be uploaded,
+//              and only once after it changed: the stages share one texture, the versions of the pipeline images
+//              are unique so the texture is uploaded again when another stage is displayed.
 // Parameters:
-//   - in: Input pixel data.
-//   - index: Index of the pixel data.
-// Returns:
-//   - The gray nuance of the pixel.
+//   - imageName: Name of the stage image.
+//   - textureName: Name of the texture showing it.
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-float CPU_SketchEffect::GrayNuance(const vector<unsigned char>& in, int index) const
+void CPU_SketchEffect::Present(const string& imageName, const string& textureName)
 {
-    float r = in[index + 0] / 255.0f;
-    float g = in[index + 1] / 255.0f;
-    float b = in[index + 2] / 255.0f;
-    return 0.21f * r + 0.71f * g + 0.07f * b;
+    const SketchPipeline::Image* image = pipeline.FindImage(imageName);
+    if (image == nullptr || uploaded[textureName] == image->version)
+    {
+        return;
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffers[textureName]);
+    glBindTexture(GL_TEXTURE_2D, textures[textureName]);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, image->resolution.x, image->resolution.y, 0, GL_RGBA, GL_UNSIGNED_BYTE, image->pixels.data());
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    uploaded[textureName] = image->version;
 }
 
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-// Function: EdgeBinarize
-// Description: Applies an edge binarization effect to the input texture.
+// Function: Fetch
+// Description: Makes a stage input available to the pipeline. Images produced by a CPU stage are already in host
+//              memory, the others (the rendered original) are read back from their framebuffer once per render.
 // Parameters:
-//   - inputTextureName: Name of the input texture.
-//   - outputTextureName: Name of the output texture.
+//   - textureName: Name of the input texture.
 //   - resolution: Resolution of the input texture.
-//   - threshold: Threshold for the edge binarization effect.
-//   - startRow: Start row for the processing.
-//   - endRow: End row for the processing.
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-void CPU_SketchEffect::EdgeBinarize(
-    const string& inputTextureName,
-    const string& outputTextureName,
-    glm::ivec2 resolution,
-    float threshold,
-    int startRow, int endRow)
+void CPU_SketchEffect::Fetch(const string& textureName, glm::ivec2 resolution)
 {
-    const int kernelSize = 3;
-    const float Gx[kernelSize][kernelSize] =
+    const SketchPipeline::Image* image = pipeline.FindImage(textureName);
+    if (image != nullptr && image->resolution == resolution && rendered.count(textureName) == 0)
     {
-        {-1,  0,  1},
-        {-2,  0,  2},
-        {-1,  0,  1},
-    };
-    const float Gy[kernelSize][kernelSize] =
-    {
-        {-1, -2, -1},
-        { 0,  0,  0},
-        { 1,  2,  1},
-    };
-
-    vector<unsigned char> in(resolution.x * resolution.y * 4);
-    glBindFramebuffer(GL_FRAMEBUFFER, framebuffers[inputTextureName]);
-    glReadPixels(0, 0, resolution.x, resolution.y, GL_RGBA, GL_UNSIGNED_BYTE, in.data());
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
-
-    vector<unsigned char> out(resolution.x * resolution.y * 4, 0);
-
-    auto SOBEL_BINARY_EDGE = [&](int start, int end)
-    {
-        for (int y = start; y < end; ++y)
-        {
-            for (int x = 0; x < resolution.x; ++x)
-            {
-                float gradX = 0.0f;
-                float gradY = 0.0f;
-
-                for (int j = -1; j <= 1; ++j)
-                {
-                    for (int i = -1; i <= 1; ++i)
-                    {
-                        int nx = glm::clamp(x + i, 0, resolution.x - 1);
-                        int ny = glm::clamp(y + j, 0, resolution.y - 1);
-                        int index = (ny * resolution.x + nx) * 4;
-
-						float gray = GrayNuance(in, index);
-
-                        gradX += gray * Gx[j + 1][i + 1];
-                        gradY += gray * Gy[j + 1][i + 1];
-                    }
-                }
-
-                float magnitude = sqrt(gradX * gradX + gradY * gradY);
-                unsigned char binary = (magnitude >= threshold) ? 0 : 255;
-
-                int idx = (y * resolution.x + x) * 4;
-                out[idx + 0] = binary;
-                out[idx + 1] = binary;
-                out[idx + 2] = binary;
-                out[idx + 3] = 255;
-            }
-        }
-    };
-
-	// Multithreaded applied on the rows !(better performance)
-    int rows = (endRow - startRow) / pool.workers.size();
-    for (int t = 0; t < pool.workers.size(); ++t)
-    {
-        int start = startRow + t * rows;
-        int end = (t == pool.workers.size() - 1) ? endRow : start + rows;
-        pool.Add_Task([=] { SOBEL_BINARY_EDGE(start, end); }, "SOBEL_BINARY_EDGE");
+        return;
     }
 
-    pool.Free_Resource();
-
-    glBindFramebuffer(GL_FRAMEBUFFER, framebuffers[outputTextureName]);
-    glBindTexture(GL_TEXTURE_2D, textures[outputTextureName]);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, resolution.x, resolution.y, 0, GL_RGBA, GL_UNSIGNED_BYTE, out.data());
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    PixelBuffer pixels = pipeline.NewImage(resolution);
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffers[textureName]);
+    glReadPixels(0, 0, resolution.x, resolution.y, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    pipeline.SetImage(textureName, resolution, std::move(pixels));
+    rendered.erase(textureName);
+
+    // The texture already holds these pixels
+    uploaded[textureName] = pipeline.FindImage(textureName)->version;
 }
 
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-// Function: Weight
-// Description: Computes the weight of a Gaussian kernel.
-// Parameters:
-//   - mu: Distance from the center of the kernel.
-//   - sigma: Standard deviation of the Gaussian kernel.
-// Returns:
-//   - The weight of the Gaussian kernel.
+// Function: EdgeBinarize / Horizontal / Vertical / Hatching / Combine / Streaming / Staged / Luma
+// Description: The stages run on the host images of the SketchPipeline (GL free), only the inputs that no CPU stage
+//              produced are read back (Fetch), the outputs stay in host memory until they are displayed (Present).
+//              The parameters are the ones of the SketchPipeline stages, the image names are the texture names.
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-float CPU_SketchEffect::Weight(int mu, float sigma) const
+void CPU_SketchEffect::EdgeBinarize(
+    const string& inputTextureName,
+    const string& outputTextureName,
+    glm::ivec2 resolution,
+    float threshold,
+    int startRow, int endRow)
 {
-    return exp(-float(mu * mu) / (2.0f * sigma * sigma)) / (sqrt(2.0f * glm::pi<float>()) * sigma);
+    Fetch(inputTextureName, resolution);
+    pipeline.EdgeBinarize(inputTextureName, outputTextureName, resolution, threshold, startRow, endRow);
 }
 
 
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-// Function: Horizontal
-// Description: Applies a horizontal blur effect to the input texture.
-// Parameters:
-//   - inputTextureName: Name of the input texture.
-//   - outputTextureName: Name of the output texture.
-//   - resolution: Resolution of the input texture.
-//   - radius: Radius of the Gaussian kernel.
-//   - sigma: Standard deviation of the Gaussian kernel.
-//   - startRow: Start row for the processing.
-//   - endRow: End row for the processing.
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 void CPU_SketchEffect::Horizontal(
     const string& inputTextureName,
     const string& outputTextureName,
     glm::ivec2 resolution,
     int radius, float sigma,
-    int startRow, int endRow)
+    int startRow, int endRow,
+    BlurEngine engine)
 {
-    vector<unsigned char> in(resolution.x * resolution.y * 4);
-    glBindFramebuffer(GL_FRAMEBUFFER, framebuffers[inputTextureName]);
-    glReadPixels(0, 0, resolution.x, resolution.y, GL_RGBA, GL_UNSIGNED_BYTE, in.data());
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
-
-    vector<unsigned char> out(resolution.x * resolution.y * 4, 0);
-    vector<float> weights(2 * radius + 1);
-    float sum = 0.0f;
-
-    for (int i = -radius; i <= radius; ++i)
-    {
-        weights[i + radius] = Weight(i, sigma);
-        sum += weights[i + radius];
-    }
-
-    for (int i = 0; i < weights.size(); ++i)
-    {
-        weights[i] /= sum;
-    }
-
-    auto HORIZONTAL_BLUR = [&](int start, int end)
-    {
-        for (int y = start; y < end; ++y)
-        {
-            for (int x = 0; x < resolution.x; ++x)
-            {
-                float sumR = 0.0f, sumG = 0.0f, sumB = 0.0f;
-
-                for (int i = -radius; i <= radius; ++i)
-                {
-                    int nx = glm::clamp(x + i, 0, resolution.x - 1);
-                    int index = (y * resolution.x + nx) * 4;
-
-                    float r = in[index] / 255.0f;
-                    float g = in[index + 1] / 255.0f;
-                    float b = in[index + 2] / 255.0f;
-
-                    float weight = weights[i + radius];
-                    sumR += r * weight;
-                    sumG += g * weight;
-                    sumB += b * weight;
-                }
-
-                int idx = (y * resolution.x + x) * 4;
-                out[idx + 0] = static_cast<unsigned char>(sumR * 255.0f);
-                out[idx + 1] = static_cast<unsigned char>(sumG * 255.0f);
-                out[idx + 2] = static_cast<unsigned char>(sumB * 255.0f);
-                out[idx + 3] = 255;
-            }
-        }
-    };
-
-	// Multithreaded applied on the rows
-    int rows = (endRow - startRow) / pool.workers.size();
-    for (int t = 0; t < pool.workers.size(); ++t)
-    {
-        int start = startRow + t * rows;
-        int end = (t == pool.workers.size() - 1) ? endRow : start + rows;
-        pool.Add_Task([=] { HORIZONTAL_BLUR(start, end); }, "HORIZONTAL_BLUR");
-    }
-
-    pool.Free_Resource();
-
-    glBindFramebuffer(GL_FRAMEBUFFER, framebuffers[outputTextureName]);
-    glBindTexture(GL_TEXTURE_2D, textures[outputTextureName]);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, resolution.x, resolution.y, 0, GL_RGBA, GL_UNSIGNED_BYTE, out.data());
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    Fetch(inputTextureName, resolution);
+    pipeline.Horizontal(inputTextureName, outputTextureName, resolution, radius, sigma, startRow, endRow, engine);
 }
 
 
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-// Function: Vertical
-// Description: Applies a vertical blur effect to the input texture.
-// Parameters:
-//   - inputTextureName: Name of the input texture.
-//   - outputTextureName: Name of the output texture.
-//   - resolution: Resolution of the input texture.
-//   - radius: Radius of the Gaussian kernel.
-//   - sigma: Standard deviation of the Gaussian kernel.
-//   - startRow: Start row for the processing.
-//   - endRow: End row for the processing.
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 void CPU_SketchEffect::Vertical(
     const string& inputTextureName,
     const string& outputTextureName,
     glm::ivec2 resolution,
     int radius, float sigma,
-    int startRow, int endRow)
+    int startRow, int endRow,
+    BlurEngine engine)
 {
-    vector<unsigned char> in(resolution.x * resolution.y * 4);
-    glBindFramebuffer(GL_FRAMEBUFFER, framebuffers[inputTextureName]);
-    glReadPixels(0, 0, resolution.x, resolution.y, GL_RGBA, GL_UNSIGNED_BYTE, in.data());
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
-
-    vector<unsigned char> out(resolution.x * resolution.y * 4, 0);
-    vector<float> weights(2 * radius + 1);
-    float sum = 0.0f;
-
-    for (int i = -radius; i <= radius; ++i)
-    {
-        weights[i + radius] = Weight(i, sigma);
-        sum += weights[i + radius];
-    }
-
-    for (int i = 0; i < weights.size(); ++i)
-    {
-        weights[i] /= sum;
-    }
-
-    auto VERTICAL_BLUR = [&](int start, int end)
-    {
-        for (int x = start; x < end; ++x)
-        {
-            for (int y = 0; y < resolution.y; ++y)
-            {
-                float sumR = 0.0f, sumG = 0.0f, sumB = 0.0f;
-
-                for (int i = -radius; i <= radius; ++i)
-                {
-                    int ny = glm::clamp(y + i, 0, resolution.y - 1);
-                    int index = (ny * resolution.x + x) * 4;
-
-                    float r = in[index] / 255.0f;
-                    float g = in[index + 1] / 255.0f;
-                    float b = in[index + 2] / 255.0f;
-
-                    float weight = weights[i + radius];
-                    sumR += r * weight;
-                    sumG += g * weight;
-                    sumB += b * weight;
-                }
-
-                int idx = (y * resolution.x + x) * 4;
-                out[idx + 0] = static_cast<unsigned char>(sumR * 255.0f);
-                out[idx + 1] = static_cast<unsigned char>(sumG * 255.0f);
-                out[idx + 2] = static_cast<unsigned char>(sumB * 255.0f);
-                out[idx + 3] = 255;
-            }
-        }
-    };
-
-	// Multithreaded applied on the columns
-    int columns = resolution.x / pool.workers.size();
-    for (int t = 0; t < pool.workers.size(); ++t)
-    {
-        int start = t * columns;
-        int end = (t == pool.workers.size() - 1) ? resolution.x : start + columns;
-        pool.Add_Task([=] { VERTICAL_BLUR(start, end); }, "VERTICAL_BLUR");
-    }
-
-    pool.Free_Resource();
-
-    glBindFramebuffer(GL_FRAMEBUFFER, framebuffers[outputTextureName]);
-    glBindTexture(GL_TEXTURE_2D, textures[outputTextureName]);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, resolution.x, resolution.y, 0, GL_RGBA, GL_UNSIGNED_BYTE, out.data());
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    Fetch(inputTextureName, resolution);
+    pipeline.Vertical(inputTextureName, outputTextureName, resolution, radius, sigma, startRow, endRow, engine);
 }
 
 
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-// Function: Hatching
-// Description: Applies a hatching effect to the input texture.
-// Parameters:
-//   - inputTextureName: Name of the input texture.
-//   - outputTextureName: Name of the output texture.
-//   - resolution: Resolution of the input texture.
-//   - hatchParams: Parameters of the hatching effect (a, b, c).
-//   - threshold: Threshold for the hatching effect (black/white).
-//   - invertBackground: Flag to invert the background.
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 void CPU_SketchEffect::Hatching(
     const string& inputTextureName,
     const string& outputTextureName,
@@ -398,136 +213,65 @@ void CPU_SketchEffect::Hatching(
     float threshold,
     bool invertBackground)
 {
-    vector<unsigned char> in(resolution.x * resolution.y * 4);
-    glBindFramebuffer(GL_FRAMEBUFFER, framebuffers[inputTextureName]);
-    glReadPixels(0, 0, resolution.x, resolution.y, GL_RGBA, GL_UNSIGNED_BYTE, in.data());
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
-
-    vector<unsigned char> out(resolution.x * resolution.y * 4);
-
-    auto HATCHING = [&](int start, int end)
-    {
-        for (int i = start; i < end; ++i)
-        {
-            int y = i / resolution.x;
-            int x = i % resolution.x;
-            int index = (y * resolution.x + x) * 4;
-
-            float u = static_cast<float>(x) / resolution.x;
-            float v = static_cast<float>(y) / resolution.y;
-
-			float gray = GrayNuance(in, index);
-
-            float hatchLine = sin(hatchParams.x * u + hatchParams.y * v);
-            float hatchBackground;
-
-            if (!invertBackground)
-            {
-                // Black background with white hatching lines
-				hatchBackground = (gray > threshold) ? 1.0f : ((hatchLine > hatchParams.z) ? 1.0f : 0.0f);
-            }
-            else
-            {
-                // White background with black hatching lines
-				hatchBackground = (gray < threshold) ? 1.0f : ((hatchLine > hatchParams.z) ? 0.0f : 1.0f);
-            }
-
-            unsigned char value = static_cast<unsigned char>(hatchBackground * 255.0f);
-            out[index + 0] = value;
-            out[index + 1] = value;
-            out[index + 2] = value;
-            out[index + 3] = 255;
-        }
-    };
-
-	// Multithreaded applied on the pixels (rows * columns)
-    int nr_pixels = resolution.x * resolution.y;
-    int pixels = nr_pixels / pool.workers.size();
-    for (int t = 0; t < pool.workers.size(); ++t)
-    {
-        int start = t * pixels;
-        int end = (t == pool.workers.size() - 1) ? nr_pixels : start + pixels;
-        pool.Add_Task([=] { HATCHING(start, end); }, "HATCHING");
-    }
-
-    pool.Free_Resource();
-
-    glBindFramebuffer(GL_FRAMEBUFFER, framebuffers[outputTextureName]);
-    glBindTexture(GL_TEXTURE_2D, textures[outputTextureName]);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, resolution.x, resolution.y, 0, GL_RGBA, GL_UNSIGNED_BYTE, out.data());
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    Fetch(inputTextureName, resolution);
+    pipeline.Hatching(inputTextureName, outputTextureName, resolution, hatchParams, threshold, invertBackground);
 }
 
 
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-// Function: Combine
-// Description: Combines multiple textures into a single texture.
-// Parameters:
-//   - inputTextureNames: Names of the input textures.
-//   - outputTextureName: Name of the output texture.
-//   - resolution: Resolution of the input textures.
-//   - weights: Weights for the input textures.
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 void CPU_SketchEffect::Combine(
     const vector<string>& inputTextureNames,
     const string& outputTextureName,
     glm::ivec2 resolution)
 {
-    vector<vector<unsigned char>> in(inputTextureNames.size());
-    vector<unsigned char> combined(resolution.x * resolution.y * 4, 0);
-
-    for (size_t t = 0; t < inputTextureNames.size(); ++t)
+    for (const string& name : inputTextureNames)
     {
-        in[t].resize(resolution.x * resolution.y * 4);
-        glBindFramebuffer(GL_FRAMEBUFFER, framebuffers[inputTextureNames[t]]);
-        glReadPixels(0, 0, resolution.x, resolution.y, GL_RGBA, GL_UNSIGNED_BYTE, in[t].data());
-        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        Fetch(name, resolution);
     }
+    pipeline.Combine(inputTextureNames, outputTextureName, resolution);
+}
 
-    auto COMBINE_IMAGES = [&](int start, int end)
-    {
-        for (int i = start * 4; i < end * 4; i += 4)
-        {
-            float finalR = 1.0f;
-            float finalG = 1.0f;
-            float finalB = 1.0f;
-
-            for (size_t t = 0; t < inputTextureNames.size(); ++t)
-            {
-                float r = in[t][i] / 255.0f;
-                float g = in[t][i + 1] / 255.0f;
-                float b = in[t][i + 2] / 255.0f;
-
-                finalR = min(finalR, r);
-                finalG = min(finalG, g);
-                finalB = min(finalB, b);
-            }
-
-            combined[i + 0] = static_cast<unsigned char>(finalR * 255.0f);
-            combined[i + 1] = static_cast<unsigned char>(finalG * 255.0f);
-            combined[i + 2] = static_cast<unsigned char>(finalB * 255.0f);
-            combined[i + 3] = 255;
-        }
-    };
-
-	// Multithreaded applied on the pixels (rows * columns)
-    int nr_pixels = resolution.x * resolution.y;
-    int pixels = nr_pixels / pool.workers.size();
-    for (int t = 0; t < pool.workers.size(); ++t)
-    {
-        int start = t * pixels;
-        int end = (t == pool.workers.size() - 1) ? nr_pixels : start + pixels;
-        pool.Add_Task([=] { COMBINE_IMAGES(start, end); }, "COMBINE_IMAGES");
-    }
 
-    pool.Free_Resource();
+void CPU_SketchEffect::Streaming(
+    const string& inputTextureName,
+    const string& outputTextureName,
+    glm::ivec2 resolution,
+    int radius, float sigma,
+    float thresholdSobel,
+    const vector<HatchLayer>& layers,
+    BlurEngine engine)
+{
+    Fetch(inputTextureName, resolution);
+    pipeline.Streaming(inputTextureName, outputTextureName, resolution, radius, sigma, thresholdSobel, layers, engine);
+}
 
-    glBindFramebuffer(GL_FRAMEBUFFER, framebuffers[outputTextureName]);
-    glBindTexture(GL_TEXTURE_2D, textures[outputTextureName]);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, resolution.x, resolution.y, 0, GL_RGBA, GL_UNSIGNED_BYTE, combined.data());
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+void CPU_SketchEffect::Staged(
+    const string& inputTextureName,
+    const vector<string>& outputTextureNames,
+    glm::ivec2 resolution,
+    int radius, float sigma,
+    float thresholdSobel,
+    const vector<HatchLayer>& layers,
+    BlurEngine engine,
+    const vector<string>& requestedTextureNames)
+{
+    Fetch(inputTextureName, resolution);
+    pipeline.Staged(inputTextureName, outputTextureNames, resolution, radius, sigma, thresholdSobel, layers, engine,
+        requestedTextureNames);
+}
+
+
+void CPU_SketchEffect::Luma(
+    const string& inputTextureName,
+    const vector<string>& outputTextureNames,
+    glm::ivec2 resolution,
+    int radius, float sigma,
+    float thresholdSobel,
+    const vector<HatchLayer>& layers,
+    BlurEngine engine,
+    const vector<string>& requestedTextureNames)
+{
+    Fetch(inputTextureName, resolution);
+    pipeline.Luma(inputTextureName, outputTextureNames, resolution, radius, sigma, thresholdSobel, layers, engine,
+        requestedTextureNames);
 }
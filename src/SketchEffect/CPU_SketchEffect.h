@@ -3,12 +3,13 @@
 #ifndef CPU_SKETCHEFFECT_H
 #define CPU_SKETCHEFFECT_H
 
-#include "ThreadPool.h"
+#include "SketchPipeline.h"
 #include "components/simple_scene.h"
 
 #include <string>
 #include <vector>
 #include <unordered_map>
+#include <unordered_set>
 #include <thread>
 
 #include <glm/glm.hpp>
@@ -17,6 +18,7 @@
 #define max(a, b) ((a) > (b) ? (a) : (b))
 
 
+// GL viewer side of the CPU pipeline: the SketchPipeline stages on the framebuffers / textures of the app
 class CPU_SketchEffect : public gfxc::SimpleScene
 {
 public:
@@ -26,9 +28,17 @@ public:
         std::unordered_map<std::string, GLuint>& texturesRef,
         std::unordered_map<std::string, Shader*>& shadersRef,
         std::unordered_map<std::string, Mesh*>& meshesRef,
-        size_t threadCount = std::thread::hardware_concurrency());
+        size_t threadCount = std::thread::hardware_concurrency(),
+        Affinity affinity = Affinity::None);
     ~CPU_SketchEffect();
 
+	// Select the arithmetic of the blur, luma and hatching stages (the recursive blur stays in float).
+    void SetPrecision(Precision mode);
+    Precision GetPrecision() const;
+	// Select how long the idle workers stay hot before they sleep.
+    void SetIdlePolicy(const IdlePolicy& policy);
+    IdlePolicy GetIdlePolicy() const;
+
 	// Render the original image to the screen using the specified shader.
     void RenderOriginal(
         const std::string& fboName,
@@ -37,6 +47,8 @@ public:
         const glm::mat4& modelMatrix,
         int flipVertical,
         glm::ivec2 resolution);
+	// Upload the host image of a stage to a texture if it holds another one (the stages never touch GL otherwise).
+    void Present(const std::string& imageName, const std::string& textureName);
 	// Apply edge detection and binarization to the original texture.
     void EdgeBinarize(
         const std::string& inputTextureName,
@@ -50,14 +62,16 @@ public:
         const std::string& outputTextureName,
         glm::ivec2 resolution,
         int radius, float sigma,
-        int startRow, int endRow);
+        int startRow, int endRow,
+        BlurEngine engine = BlurEngine::Auto);
 	// Apply vertical gaussian blur to the input texture.
     void Vertical(
         const std::string& inputTextureName,
         const std::string& outputTextureName,
         glm::ivec2 resolution,
         int radius, float sigma,
-        int startRow, int endRow);
+        int startRow, int endRow,
+        BlurEngine engine = BlurEngine::Auto);
 	// Apply hatching to the input texture using the specified parameters.
     void Hatching(
         const std::string& inputTextureName,
@@ -70,12 +84,39 @@ public:
         const std::vector<std::string>& inputTextureNames,
         const std::string& outputTextureName,
         glm::ivec2 resolution);
+	// Run the whole pipeline fused on bands of rows, only the final sketch is produced.
+    void Streaming(
+        const std::string& inputTextureName,
+        const std::string& outputTextureName,
+        glm::ivec2 resolution,
+        int radius, float sigma,
+        float thresholdSobel,
+        const std::vector<HatchLayer>& layers,
+        BlurEngine engine = BlurEngine::Auto);
+	// Run the stages the requested textures depend on (all if empty) as a dependency graph.
+    void Staged(
+        const std::string& inputTextureName,
+        const std::vector<std::string>& outputTextureNames,
+        glm::ivec2 resolution,
+        int radius, float sigma,
+        float thresholdSobel,
+        const std::vector<HatchLayer>& layers,
+        BlurEngine engine = BlurEngine::Auto,
+        const std::vector<std::string>& requestedTextureNames = std::vector<std::string>());
+	// Run the whole pipeline on single channel luma planes, the requested textures are produced (all if empty).
+    void Luma(
+        const std::string& inputTextureName,
+        const std::vector<std::string>& outputTextureNames,
+        glm::ivec2 resolution,
+        int radius, float sigma,
+        float thresholdSobel,
+        const std::vector<HatchLayer>& layers,
+        BlurEngine engine = BlurEngine::Auto,
+        const std::vector<std::string>& requestedTextureNames = std::vector<std::string>());
 
 private:
-	// Compute the weight of the pixel at the specified position.
-    float Weight(int mu, float sigma) const;
-	// Compute the gray nuance of the pixel at the specified index.
-    float GrayNuance(const std::vector<unsigned char>& in, int index) const;
+	// Make a texture available to the pipeline, read back from its framebuffer only if no CPU stage produced it.
+    void Fetch(const std::string& textureName, glm::ivec2 resolution);
 
 private:
     glm::ivec2& resolution;
@@ -83,7 +124,12 @@ private:
     std::unordered_map<std::string, GLuint>& textures;
     std::unordered_map<std::string, Mesh*>& meshes;
     std::unordered_map<std::string, Shader*>& shaders;
-    ThreadPool pool;
+	// GL free pipeline holding the stage images in host memory
+    SketchPipeline pipeline;
+	// Version of the pipeline image each texture holds
+    std::unordered_map<std::string, uint64_t> uploaded;
+	// Framebuffers rendered on the GPU since they were last read back
+    std::unordered_set<std::string> rendered;
 };
 
 #endif // CPU_SKETCHEFFECT_H
@@ -18,16 +18,9 @@ SketchEffect::SketchEffect() :
 {
     vector<string> textureNames = 
     {
-		/// CPU
+		/// CPU (the stage images stay in host memory, the displayed one is uploaded to the stage texture)
 		"originalCPU",     // STAGE 0 - Original image
-        "gaussianCPU",     // STAGE 1 - Gaussian Edge Binarization
-        "horizontalCPU",   // STAGE 2 - Horizontal Blur Gaussian
-		"verticalCPU",     // STAGE 3 - Vertical Blur Gaussian
-		"hatch1CPU",       // STAGE 4 - Hatch 1
-		"hatch2CPU",       // STAGE 5 - Hatch 2
-		"hatch3CPU",       // STAGE 6 - Hatch 3
-		"combinedHatchCPU",// STAGE 7 - Combined Hatch
-		"finalCPU",        // STAGE 8 - Final Image
+		"stageCPU",        // STAGES 1 - 8 - Displayed stage
 		/// GPU
         "originalGPU",     // STAGE 0 - Original image
         "gaussianGPU",     // STAGE 1 - Gaussian Edge Binarization
@@ -49,6 +42,9 @@ SketchEffect::SketchEffect() :
 	gpuProcessing = false;   /// true - GPU / false - CPU Multi-Threading
 	onlyExecuteOnce = true;  /// true - Execute only once / false - Execute every frame
 	gaussian2Steps = false;  /// true - Gaussian 2 steps / false - Gaussian 1 step
+	streamingPipeline = false; /// true - CPU fused row bands (final image only) / false - CPU stage by stage
+	lumaPipeline = false;      /// true - CPU stages on luma planes (1 byte per pixel) / false - CPU stages on RGBA
+	boxPreview = false;        /// true - CPU gaussian approximated by 3 box blurs / false - exact (or recursive) gaussian
 
     outputMode = 0;
     saveScreenToImage = false;
@@ -129,14 +125,8 @@ void SketchEffect::InitTexBuffers()
     CreateTexBuffer("originalCPU");
     textures["originalCPU"] = originalImage->GetTextureID();
 
-    CreateTexBuffer("horizontalCPU");
-    CreateTexBuffer("verticalCPU");
-    CreateTexBuffer("gaussianCPU");
-    CreateTexBuffer("hatch1CPU");
-    CreateTexBuffer("hatch2CPU");
-    CreateTexBuffer("hatch3CPU");
-    CreateTexBuffer("combinedHatchCPU");
-    CreateTexBuffer("finalCPU");
+    /// The CPU stages are only read back / uploaded by the pipeline: one texture for the displayed stage
+    CreateTexBuffer("stageCPU");
 
     /// GPU
 	CreateTexBuffer("originalGPU");
@@ -202,6 +192,7 @@ void SketchEffect::Init()
 
     cout << endl;
     cout << "GPU Processing: " << (gpuProcessing ? "ON" : "OFF") << endl;
+    cout << "CPU Kernels: " << CPU_Kernels::ISAName(CPU_Kernels::ActiveISA()) << endl;
 }
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 void SketchEffect::Update(float deltaTimeSeconds)
@@ -222,26 +213,40 @@ void SketchEffect::Update(float deltaTimeSeconds)
 	//////////////////////////////////////////////////////////CPU MULTI-THREADING PIPELINE///////////////////////////////////////////////////////////
     if (onlyExecuteOnce)
     {
-        if (!gpuProcessing)
+        /// The streaming pipeline only produces the final image, the other stages are computed by the pipeline below
+        if (!gpuProcessing && streamingPipeline && CPUStage() == "finalCPU")
         {
             // Zero Pass: Backup original image
             cpuSketchEffect.RenderOriginal("originalCPU", "originalCPU", "ImageProcessing", modelMatrix, 0, resolution);
-            // First Pass: Horizontal Blur
-            cpuSketchEffect.Horizontal("originalCPU", "horizontalCPU", resolution, radiusSize, sigmaSize, 0, resolution.y);
-            // Second Pass: Vertical Blur
-            cpuSketchEffect.Vertical("horizontalCPU", "verticalCPU", resolution, radiusSize, sigmaSize, 0, resolution.y);
-            // Third Pass: Gaussian Blur
-            cpuSketchEffect.EdgeBinarize("originalCPU", "gaussianCPU", resolution, thresholdSobel, 0, resolution.y);
-            // Fourth Pass: Hatching 1
-            cpuSketchEffect.Hatching("verticalCPU", "hatch1CPU", resolution, glm::vec3(400.0f, 0.0f, 0.99f), thresholdHatch1, false);
-            // Fifth Pass: Hatching 2
-            cpuSketchEffect.Hatching("verticalCPU", "hatch2CPU", resolution, glm::vec3(200.0f, 200.0f, 0.95f), thresholdHatch2, true);
-            // Sixth Pass: Hatching 3
-            cpuSketchEffect.Hatching("verticalCPU", "hatch3CPU", resolution, glm::vec3(250.0f, -250.0f, 0.90f), thresholdHatch3, true);
-            // Seventh Pass: Combine Hatches
-            cpuSketchEffect.Combine({ "hatch1CPU", "hatch2CPU", "hatch3CPU" }, "combinedHatchCPU", resolution);
-            // Eight Pass: Sobel + Combined Hatches
-            cpuSketchEffect.Combine({ "gaussianCPU", "combinedHatchCPU" }, "finalCPU", resolution);
+            // Fused Passes: Blur + Sobel + Hatching + Combine streamed on bands of rows (final image only),
+            // same blur engine as the staged pipeline
+            const BlurEngine engine = boxPreview ? BlurEngine::Box : BlurEngine::Auto;
+            cpuSketchEffect.Streaming("originalCPU", "finalCPU", resolution, radiusSize, sigmaSize, thresholdSobel, HatchLayers(),
+                engine);
+        }
+        else if (!gpuProcessing && lumaPipeline)
+        {
+            // Zero Pass: Backup original image
+            cpuSketchEffect.RenderOriginal("originalCPU", "originalCPU", "ImageProcessing", modelMatrix, 0, resolution);
+            // Luma Passes: Blur + Sobel + Hatching + Combine on single channel planes (RGBA only at upload),
+            // only the passes the displayed stage needs
+            const BlurEngine engine = boxPreview ? BlurEngine::Box : BlurEngine::Auto;
+            cpuSketchEffect.Luma("originalCPU",
+                { "horizontalCPU", "verticalCPU", "gaussianCPU", "hatch1CPU", "hatch2CPU", "hatch3CPU", "combinedHatchCPU", "finalCPU" },
+                resolution, radiusSize, sigmaSize, thresholdSobel, HatchLayers(), engine, { CPUStage() });
+        }
+        else if (!gpuProcessing)
+        {
+            // Zero Pass: Backup original image
+            cpuSketchEffect.RenderOriginal("originalCPU", "originalCPU", "ImageProcessing", modelMatrix, 0, resolution);
+            // Stage graph (no barrier between the stages, independent ones run at the same time):
+            //   Horizontal Blur -> Vertical Blur -> Hatching 1, 2, 3 (concurrently) -> Combine Hatches -> Final
+            //   Sobel + binarization (concurrently with the blur chain) ---------------------------------> Final
+            // Pulled from the displayed stage: only the stages it depends on run (the others when displayed)
+            const BlurEngine engine = boxPreview ? BlurEngine::Box : BlurEngine::Auto;
+            cpuSketchEffect.Staged("originalCPU",
+                { "horizontalCPU", "verticalCPU", "gaussianCPU", "hatch1CPU", "hatch2CPU", "hatch3CPU", "combinedHatchCPU", "finalCPU" },
+                resolution, radiusSize, sigmaSize, thresholdSobel, HatchLayers(), engine, { CPUStage() });
         }
 		else /// 4 GPU IT DOESN'T APPLY THE HORIZONTAL AND VERTICAL BLUR CORRECT AND THE COMBINE FUNCTION SAME
         {
@@ -278,19 +283,9 @@ void SketchEffect::Update(float deltaTimeSeconds)
 
     if (!gpuProcessing)
     {
-        switch (outputMode)
-        {
-        case 0: glBindTexture(GL_TEXTURE_2D, textures["originalCPU"]); break;
-        case 1: glBindTexture(GL_TEXTURE_2D, textures["gaussianCPU"]); break;
-        case 2: glBindTexture(GL_TEXTURE_2D, textures["horizontalCPU"]); break;
-        case 3: glBindTexture(GL_TEXTURE_2D, textures["verticalCPU"]); break;
-        case 4: glBindTexture(GL_TEXTURE_2D, textures["hatch1CPU"]); break;
-        case 5: glBindTexture(GL_TEXTURE_2D, textures["hatch2CPU"]); break;
-        case 6: glBindTexture(GL_TEXTURE_2D, textures["hatch3CPU"]); break;
-        case 7: glBindTexture(GL_TEXTURE_2D, textures["combinedHatchCPU"]); break;
-        case 8: glBindTexture(GL_TEXTURE_2D, textures["finalCPU"]); break;
-        default: glBindTexture(GL_TEXTURE_2D, textures["originalCPU"]); break; /// Original image
-        }
+        /// The CPU stages stay in host memory, only the displayed one is uploaded (once per run)
+        cpuSketchEffect.Present(CPUStage(), CPUTexture());
+        glBindTexture(GL_TEXTURE_2D, textures[CPUTexture()]);
     }
     else
     {
@@ -319,6 +314,51 @@ void SketchEffect::Update(float deltaTimeSeconds)
     }
 }
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: CPUStage
+// Description: Name of the CPU stage texture shown in the current output mode, the stage the pipeline is pulled from
+//              (only the stages it depends on are computed).
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+string SketchEffect::CPUStage() const
+{
+    switch (outputMode)
+    {
+    case 0: return "originalCPU";
+    case 1: return "gaussianCPU";
+    case 2: return "horizontalCPU";
+    case 3: return "verticalCPU";
+    case 4: return "hatch1CPU";
+    case 5: return "hatch2CPU";
+    case 6: return "hatch3CPU";
+    case 7: return "combinedHatchCPU";
+    case 8: return "finalCPU";
+    default: return "originalCPU"; /// Original image
+    }
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: CPUTexture
+// Description: Texture showing the CPU stage of the current output mode. The original is rendered to its own texture
+//              (and read back by the pipeline), the other stages are uploaded to the stage texture when displayed.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+string SketchEffect::CPUTexture() const
+{
+    const string stage = CPUStage();
+    return stage == "originalCPU" ? stage : "stageCPU";
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: HatchLayers
+// Description: Hatching layers of the CPU pipelines, built from the thresholds at each call (same line parameters
+//              as the GPU hatching passes).
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+vector<HatchLayer> SketchEffect::HatchLayers() const
+{
+    return
+    {
+        { glm::vec3(400.0f, 0.0f, 0.99f), thresholdHatch1, false },
+        { glm::vec3(200.0f, 200.0f, 0.95f), thresholdHatch2, true },
+        { glm::vec3(250.0f, -250.0f, 0.90f), thresholdHatch3, true }
+    };
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Function: SaveImage
 // Description: Save the current image to a file depending on the output mode and the processing mode.
 // in this moment it saves the CPU image correctly but the GPU image is not saved correctly 
@@ -330,19 +370,13 @@ void SketchEffect::SaveImage(const string& fileName)
 
     if (!gpuProcessing)
     {
-        switch (outputMode)
+        if (outputMode > 8)
         {
-        case 0: outMode = "originalCPU"; break;
-        case 1: outMode = "horizontalCPU"; break;
-        case 2: outMode = "verticalCPU"; break;
-        case 3: outMode = "gaussianCPU"; break;
-        case 4: outMode = "hatch1CPU"; break;
-        case 5: outMode = "hatch2CPU"; break;
-        case 6: outMode = "hatch3CPU"; break;
-        case 7: outMode = "combinedHatchCPU"; break;
-        case 8: outMode = "finalCPU"; break;
-        default: cerr << "[Error]: Invalid outputMode. No texture to save." << endl; return;
+            cerr << "[Error]: Invalid outputMode. No texture to save." << endl;
+            return;
         }
+        /// The displayed stage, the only one computed for this output mode
+        outMode = CPUTexture();
     }
     else
     {
@@ -368,6 +402,11 @@ void SketchEffect::SaveImage(const string& fileName)
         return;
     }
 
+    if (!gpuProcessing)
+    {
+        cpuSketchEffect.Present(CPUStage(), outMode);
+    }
+
     GLuint tex_save = textures[outMode];
     GLuint framebuffer = framebuffers[outMode];
     GLenum format = GL_RGBA;
@@ -463,6 +502,8 @@ void SketchEffect::OnKeyPress(int key, int mods)
     if (key - GLFW_KEY_0 >= 0 && key <= GLFW_KEY_9)
     {
         outputMode = key - GLFW_KEY_0;
+        // The CPU pipeline is pulled from the displayed stage, the stages it needs may not be computed yet
+        onlyExecuteOnce = onlyExecuteOnce || !gpuProcessing;
         switch (outputMode)
         {
 		case 0: { cout << "Key 0 - Original image;" << endl; break;                                                                         }
@@ -484,6 +525,37 @@ void SketchEffect::OnKeyPress(int key, int mods)
         onlyExecuteOnce = true;
         cout << "GPU Processing: " << (gpuProcessing ? "ON" : "OFF") << endl;
     }
+    if (key == GLFW_KEY_B)
+    {
+        streamingPipeline = !streamingPipeline;
+        onlyExecuteOnce = true;
+        cout << "CPU Streaming Pipeline: " << (streamingPipeline ? "ON (final image, key 8)" : "OFF") << endl;
+    }
+    if (key == GLFW_KEY_L)
+    {
+        lumaPipeline = !lumaPipeline;
+        onlyExecuteOnce = true;
+        cout << "CPU Luma Pipeline: " << (lumaPipeline ? "ON" : "OFF") << endl;
+    }
+    if (key == GLFW_KEY_P)
+    {
+        boxPreview = !boxPreview;
+        onlyExecuteOnce = true;
+        cout << "CPU Box Blur Preview: " << (boxPreview ? "ON" : "OFF") << endl;
+    }
+    if (key == GLFW_KEY_I)
+    {
+        bool fixed = cpuSketchEffect.GetPrecision() != Precision::Fixed;
+        cpuSketchEffect.SetPrecision(fixed ? Precision::Fixed : Precision::Float);
+        onlyExecuteOnce = true;
+        cout << "CPU Fixed Point (integer) Precision: " << (fixed ? "ON" : "OFF") << endl;
+    }
+    if (key == GLFW_KEY_H)
+    {
+        bool hot = cpuSketchEffect.GetIdlePolicy().hot == kBatchIdle.hot;
+        cpuSketchEffect.SetIdlePolicy(hot ? kLatencyIdle : kBatchIdle);
+        cout << "CPU Low Latency (hot workers): " << (hot ? "ON" : "OFF") << endl;
+    }
 }
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Function: OpenDialog
@@ -70,6 +70,12 @@ private:
     void OnFileSelected(const std::string& fileName);
 	// Save the processed image to a file on disk (PNG/JPG/JPEG/BMP) format
     void SaveImage(const std::string& fileName);
+	// Name of the CPU stage image shown in the current output mode
+    std::string CPUStage() const;
+	// Texture showing the CPU stage (the original is rendered to its own, the stage images share one)
+    std::string CPUTexture() const;
+	// Hatching layers of the sketch (line parameters and the current thresholds)
+    std::vector<HatchLayer> HatchLayers() const;
     ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 	// Initialize the framebuffers and textures used for processing the image
     void InitTexBuffers();
@@ -84,6 +90,9 @@ private:
 	bool onlyExecuteOnce;
     bool saveScreenToImage;
 	bool gaussian2Steps;
+	bool streamingPipeline;
+	bool lumaPipeline;
+	bool boxPreview;
 
     int outputMode;
 
@@ -95,6 +104,7 @@ private:
 	float thresholdHatch2;
 	float thresholdHatch3;
 
+
     Texture2D* originalImage;
     Texture2D* processedImage;
 
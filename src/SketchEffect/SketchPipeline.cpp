@@ -0,0 +1,2233 @@
+#include "SketchPipeline.h"
+
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <utility>
+#include <iostream>
+#include <unordered_set>
+#include <set>
+#include <memory>
+#include <atomic>
+
+#include <glm/gtc/constants.hpp>
+
+using namespace std;
+
+
+namespace
+{
+    // Bytes per block of the content hash of an input (fixed: the hash does not depend on the thread count)
+    const size_t kHashBlock = size_t(1) << 20;
+
+    // Buffer of the planned slot of the graph stage running on the calling thread (see RunGraph), taken by the
+    // first stage buffer it allocates
+    thread_local PixelBuffer* stageSlot = nullptr;
+
+    // Key of a stage run: the stage, its parameters and the contents of its inputs, compared byte for byte
+    class Recipe
+    {
+    public:
+        explicit Recipe(const char* stage) : key(stage)
+        {
+            key.push_back('\0');
+        }
+
+        template <typename T>
+        Recipe& operator<<(const T& value)
+        {
+            key.append(reinterpret_cast<const char*>(&value), sizeof(value));
+            return *this;
+        }
+
+        Recipe& operator<<(const string& name)
+        {
+            key.append(name);
+            key.push_back('\0');
+            return *this;
+        }
+
+        Recipe& operator<<(const HatchLayer& layer)
+        {
+            return *this << layer.params << layer.threshold << layer.invertBackground;
+        }
+
+        Recipe& operator<<(const vector<HatchLayer>& layers)
+        {
+            for (const HatchLayer& layer : layers)
+            {
+                *this << layer;
+            }
+            return *this;
+        }
+
+        const string& Key() const
+        {
+            return key;
+        }
+
+    private:
+        string key;
+    };
+}
+
+
+SketchPipeline::SketchPipeline(size_t threadCount, Affinity affinity)
+    : pool(threadCount, affinity), precision(Precision::Float), versions(0), planBuffers(false), lastPlan()
+{
+    // The new blocks of the arena are spread on the NUMA nodes of the workers (see ThreadPool::Place)
+    arena.SetPlacement([this](void* block, size_t bytes) { pool.Place(block, bytes); });
+}
+
+SketchPipeline::~SketchPipeline() {}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: SetPrecision / GetPrecision
+// Description: Precision mode of the CPU stages. Fixed runs the direct blur, the luma conversion and the hatching
+//              gray test on integers (twice the SIMD lanes of float, no conversions, rounded instead of truncated,
+//              same results with every compiler). The recursive blur keeps its float recursion in both modes.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void SketchPipeline::SetPrecision(Precision mode)
+{
+    precision = mode;
+}
+
+
+Precision SketchPipeline::GetPrecision() const
+{
+    return precision;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: SetIdlePolicy / GetIdlePolicy
+// Description: Idle phase of the workers of the pipeline (see ThreadPool::Spin_Idle). kBatchIdle (default) sleeps
+//              soon after the last stage, kLatencyIdle keeps the workers hot between the runs of a preview so
+//              each one starts without waking them up.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void SketchPipeline::SetIdlePolicy(const IdlePolicy& policy)
+{
+    pool.Set_Idle_Policy(policy);
+}
+
+
+IdlePolicy SketchPipeline::GetIdlePolicy() const
+{
+    return pool.Get_Idle_Policy();
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: SetCache / GetCacheStats
+// Description: Cache of the stage outputs (see StageCache), disabled by default. A stage whose outputs are not up
+//              to date looks them up by content before computing them: an input processed again with the same
+//              settings (the next run of a batch, another name, another pipeline sharing the directory) costs the
+//              hash of its pixels and a copy of the cached outputs.
+// Parameters:
+//   - memoryBytes: Budget of the memory tier (least recently used outputs dropped first), 0 to disable it.
+//   - directory: Directory of the disk tier (memory mapped blobs), empty to disable it.
+//   - diskBytes: Budget of the disk tier.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void SketchPipeline::SetCache(size_t memoryBytes, const string& directory, size_t diskBytes)
+{
+    cache.SetMemoryBudget(memoryBytes);
+    cache.SetDisk(directory, diskBytes);
+}
+
+
+StageCache::Stats SketchPipeline::GetCacheStats() const
+{
+    return cache.GetStats();
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: SetBufferPlanning / GetBufferPlan
+// Description: Buffer planning of the graph runs (see PlanBuffers): the stage images nobody requested are released
+//              as soon as their consumers are done and the next image of their slot is written into their buffer,
+//              so a run only holds the images alive at once instead of every stage image (e.g. 5 full images
+//              instead of 8 for the final sketch of the staged pipeline). The plan of the run reports the planned
+//              footprint and the high-water mark of the arena measured during the run.
+//              Off by default: the viewer keeps every stage image to display it. A released image is no longer up
+//              to date for the next run: with the stage cache (SetCache, its disk tier for large images) it is
+//              restored from the cache and the stages after it stay up to date, without it the stages producing
+//              it run again.
+// Parameters:
+//   - enabled: Release the transient images of the next graph runs.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void SketchPipeline::SetBufferPlanning(bool enabled)
+{
+    planBuffers = enabled;
+}
+
+
+SketchPipeline::BufferPlan SketchPipeline::GetBufferPlan() const
+{
+    lock_guard<mutex> lock(planMutex);
+    return lastPlan;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: GetMemoryStats / TrimMemory
+// Description: Memory of the stage buffers and images (see BufferArena): the peak is the footprint of the largest
+//              run, the reserved bytes include the blocks kept for the next runs, which TrimMemory frees.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+BufferArena::Stats SketchPipeline::GetMemoryStats() const
+{
+    return arena.GetStats();
+}
+
+
+void SketchPipeline::TrimMemory()
+{
+    arena.Trim();
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: SetImage
+// Description: Stores an input image of the pipeline (e.g. the original picture) under a name, with the hash of its
+//              pixels as content. Storing the same pixels again changes nothing (the version is kept, so no stage
+//              computed from it is stale).
+// Parameters:
+//   - name: Name of the image, used by the stages.
+//   - resolution: Resolution of the image.
+//   - pixels: resolution.x * resolution.y RGBA8 pixels (copied, or moved for the buffer overload).
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void SketchPipeline::SetImage(const string& name, glm::ivec2 resolution, const unsigned char* pixels)
+{
+    PixelBuffer image = NewImage(resolution);
+    memcpy(image.data(), pixels, image.size());
+    SetImage(name, resolution, std::move(image));
+}
+
+
+void SketchPipeline::SetImage(const string& name, glm::ivec2 resolution, PixelBuffer&& pixels)
+{
+    if (pixels.size() != static_cast<size_t>(resolution.x) * resolution.y * 4)
+    {
+        cerr << "[Error]: Image '" << name << "' does not hold " << resolution.x << "x" << resolution.y << " RGBA pixels." << endl;
+        return;
+    }
+
+    const uint64_t content = Content(pixels, resolution);
+
+    // The same pixels again keep their version, the stages computed from them stay up to date
+    lock_guard<mutex> lock(imagesMutex);
+    auto image = images.find(name);
+    if (image != images.end() && image->second.recipe.empty() && image->second.resolution == resolution &&
+        image->second.content == content)
+    {
+        return;
+    }
+
+    Image& stored = images[name];
+    stored.pixels = std::move(pixels);
+    stored.resolution = resolution;
+    stored.version = ++versions;
+    stored.content = content;
+    stored.recipe.clear();
+}
+
+
+PixelBuffer SketchPipeline::NewImage(glm::ivec2 resolution)
+{
+    return StageBuffer(static_cast<size_t>(resolution.x) * resolution.y * 4);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: Content
+// Description: Content of an input: the hashes of fixed 1 MiB blocks, computed in parallel, hashed in block order
+//              with the resolution (a W x H and a H x W image of the same bytes differ).
+//              The recipes of the stages reading the input hold it instead of its name, so the outputs computed
+//              from the same pixels share their cache keys.
+// Parameters:
+//   - pixels: Pixels of the input.
+//   - resolution: Resolution of the input.
+// Returns:
+//   - The hash of the pixels.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+uint64_t SketchPipeline::Content(const PixelBuffer& pixels, glm::ivec2 resolution)
+{
+    const int blocks = static_cast<int>((pixels.size() + kHashBlock - 1) / kHashBlock);
+    vector<uint64_t> hashes(blocks + 2);
+    hashes[blocks] = static_cast<uint64_t>(resolution.x);
+    hashes[blocks + 1] = static_cast<uint64_t>(resolution.y);
+
+    auto HASH_IMAGE = [&](int start, int end)
+    {
+        for (int b = start; b < end; ++b)
+        {
+            const size_t offset = b * kHashBlock;
+            hashes[b] = HashBytes(&pixels[offset], min(kHashBlock, pixels.size() - offset), b);
+        }
+    };
+
+    TaskGroup group;
+    pool.Parallel_For(0, blocks, 1, HASH_IMAGE, TaskId::HashImage, group);
+    pool.Wait(group);
+
+    return HashBytes(hashes.data(), hashes.size() * sizeof(uint64_t), pixels.size());
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: FindImage / EraseImage
+// Description: Access to the images of the pipeline, the inputs as well as the outputs of the stages.
+//              The image stays valid while the stages run, until it is published again or erased.
+// Parameters:
+//   - name: Name of the image.
+// Returns:
+//   - The image, nullptr if no image has this name.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+const SketchPipeline::Image* SketchPipeline::FindImage(const string& name) const
+{
+    lock_guard<mutex> lock(imagesMutex);
+    auto image = images.find(name);
+    return image == images.end() ? nullptr : &image->second;
+}
+
+
+void SketchPipeline::EraseImage(const string& name)
+{
+    lock_guard<mutex> lock(imagesMutex);
+    images.erase(name);
+}
+
+
+PixelBuffer SketchPipeline::TakeImage(const string& name)
+{
+    const ArenaAllocator<unsigned char> allocator(&arena);
+    PixelBuffer pixels(allocator);
+    lock_guard<mutex> lock(imagesMutex);
+    auto image = images.find(name);
+    if (image != images.end())
+    {
+        pixels = std::move(image->second.pixels);
+        images.erase(image);
+    }
+    return pixels;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: Invalidate
+// Description: Drops the recipes of the stage outputs (see UpToDate) and of the kept luma planes: the images stay,
+//              but every stage run next recomputes its outputs (e.g. to time the stages, or after changing a kernel
+//              the recipes do not cover).
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void SketchPipeline::Invalidate()
+{
+    {
+        lock_guard<mutex> lock(lumaMutex);
+        lumaPlanes.horizontalRecipe.clear();
+        lumaPlanes.verticalRecipe.clear();
+        lumaPlanes.edgesRecipe.clear();
+        lumaPlanes.combinedRecipe.clear();
+        lumaPlanes.sketchRecipe.clear();
+        for (string& recipe : lumaPlanes.hatchRecipes)
+        {
+            recipe.clear();
+        }
+    }
+
+    lock_guard<mutex> lock(imagesMutex);
+    for (auto& image : images)
+    {
+        image.second.recipe.clear();
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: Input
+// Description: Input image of a stage, the stages only run on images of the resolution they are given.
+// Parameters:
+//   - name: Name of the input image.
+//   - resolution: Resolution expected by the stage.
+// Returns:
+//   - The image, nullptr if it is missing or of another resolution.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+const SketchPipeline::Image* SketchPipeline::Input(const string& name, glm::ivec2 resolution) const
+{
+    const Image* image = FindImage(name);
+    if (image == nullptr)
+    {
+        cerr << "[Error]: Image '" << name << "' not found." << endl;
+        return nullptr;
+    }
+    if (image->resolution != resolution)
+    {
+        cerr << "[Error]: Image '" << name << "' is " << image->resolution.x << "x" << image->resolution.y
+             << ", expected " << resolution.x << "x" << resolution.y << "." << endl;
+        return nullptr;
+    }
+    return image;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: StageBuffer / StageBits
+// Description: Allocates a stage buffer (bytes) or a bit plane (words) from the arena of the pipeline, a block
+//              released by an earlier buffer if one fits. The first stage buffer of a graph stage with buffer
+//              planning is the buffer of the image released in its slot (see RunGraph). It is not initialized: the
+//              stages write every byte they publish. The arena places the pages of a new block on the NUMA nodes
+//              of the workers before they are touched (see ThreadPool::Place), a block handed out again keeps them.
+// Parameters:
+//   - bytes / words: Size of the buffer.
+// Returns:
+//   - The buffer.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+PixelBuffer SketchPipeline::StageBuffer(size_t bytes)
+{
+    if (stageSlot != nullptr && stageSlot->capacity() >= bytes)
+    {
+        PixelBuffer buffer = std::move(*stageSlot);
+        stageSlot = nullptr;
+        buffer.resize(bytes);
+        return buffer;
+    }
+
+    const ArenaAllocator<unsigned char> allocator(&arena);
+    PixelBuffer buffer(allocator);
+    buffer.resize(bytes);
+    return buffer;
+}
+
+
+BitBuffer SketchPipeline::StageBits(size_t words)
+{
+    const ArenaAllocator<uint64_t> allocator(&arena);
+    BitBuffer buffer(allocator);
+    buffer.resize(words);
+    return buffer;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: ClearRows
+// Description: Clears the rows of an output a stage run on the rows [startRow, endRow) does not write.
+// Parameters:
+//   - pixels: RGBA8 pixels of the output.
+//   - resolution: Resolution of the output.
+//   - startRow: First row written by the stage.
+//   - endRow: End of the rows written by the stage.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void SketchPipeline::ClearRows(PixelBuffer& pixels, glm::ivec2 resolution, int startRow, int endRow) const
+{
+    const size_t rowBytes = static_cast<size_t>(resolution.x) * 4;
+    startRow = glm::clamp(startRow, 0, resolution.y);
+    endRow = glm::clamp(endRow, startRow, resolution.y);
+    memset(pixels.data(), 0, startRow * rowBytes);
+    memset(pixels.data() + endRow * rowBytes, 0, (resolution.y - endRow) * rowBytes);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: Restore
+// Description: Publishes the output of a stage from the cache, if it holds the content of this recipe.
+// Parameters:
+//   - name: Name of the output image.
+//   - resolution: Resolution of the output.
+//   - recipe: Recipe of the stage run.
+//   - role: Index of the output among the outputs of the stage.
+// Returns:
+//   - true on a hit, the output is published and the stage has nothing to compute.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool SketchPipeline::Restore(const string& name, glm::ivec2 resolution, const string& recipe, int role)
+{
+    if (!cache.Enabled())
+    {
+        return false;
+    }
+    PixelBuffer pixels = NewImage(resolution);
+    if (!cache.Find(HashBytes(recipe.data(), recipe.size(), role), pixels.size(), pixels.data()))
+    {
+        return false;
+    }
+    Publish(name, resolution, std::move(pixels), recipe, role);
+    return true;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: Publish
+// Description: Stores the output of a stage in host memory (the buffer is moved, not copied), with a new version
+//              so the users of the image (e.g. a viewer uploading it) know it changed. Its content is the hash of
+//              its recipe: the same recipe always computes the same pixels, which are kept in the cache if enabled.
+// Parameters:
+//   - name: Name of the output image.
+//   - resolution: Resolution of the output.
+//   - pixels: RGBA8 pixels of the output.
+//   - recipe: Recipe the output was computed from (see UpToDate).
+//   - role: Index of the output among the outputs of the stage.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void SketchPipeline::Publish(const string& name, glm::ivec2 resolution, PixelBuffer&& pixels, const string& recipe,
+    int role)
+{
+    const uint64_t content = HashBytes(recipe.data(), recipe.size(), role);
+    if (cache.Enabled())
+    {
+        cache.Store(content, pixels.data(), pixels.size());
+    }
+
+    lock_guard<mutex> lock(imagesMutex);
+    Image& image = images[name];
+    image.pixels = std::move(pixels);
+    image.resolution = resolution;
+    image.version = ++versions;
+    image.content = content;
+    image.recipe = recipe;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: UpToDate
+// Description: Dirty tracking of the stages: every output keeps the recipe it was computed from (the stage, its
+//              parameters, the precision and the contents of its inputs). A stage whose outputs all hold its current
+//              recipe is skipped and keeps their versions, so the stages reading them are skipped as well: changing
+//              the threshold of a hatching layer only recomputes that layer and the combines after it.
+// Parameters:
+//   - outputNames: Names of the outputs of the stage.
+//   - recipe: Recipe of the stage run.
+// Returns:
+//   - true if the outputs are up to date.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool SketchPipeline::UpToDate(const vector<string>& outputNames, const string& recipe) const
+{
+    lock_guard<mutex> lock(imagesMutex);
+    for (const string& name : outputNames)
+    {
+        auto image = images.find(name);
+        if (image == images.end() || image->second.recipe != recipe)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: EdgeBinarize
+// Description: Applies an edge binarization effect to the input image.
+// Parameters:
+//   - inputName: Name of the input image.
+//   - outputName: Name of the output image.
+//   - resolution: Resolution of the input image.
+//   - threshold: Threshold for the edge binarization effect.
+//   - startRow: Start row for the processing.
+//   - endRow: End row for the processing.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void SketchPipeline::EdgeBinarize(
+    const string& inputName,
+    const string& outputName,
+    glm::ivec2 resolution,
+    float threshold,
+    int startRow, int endRow)
+{
+    const Image* input = Input(inputName, resolution);
+    if (input == nullptr)
+    {
+        return;
+    }
+
+    const string recipe = (Recipe("EDGE_BINARIZE") << input->content << precision << threshold << startRow << endRow).Key();
+    if (UpToDate({ outputName }, recipe) || Restore(outputName, resolution, recipe))
+    {
+        return;
+    }
+    const PixelBuffer& in = input->pixels;
+
+    PixelBuffer out = StageBuffer(resolution.x * resolution.y * 4);
+    ClearRows(out, resolution, startRow, endRow);
+
+    auto SOBEL_BINARY_EDGE = [&](int start, int end)
+    {
+        const int width = resolution.x;
+        const int stride = width + 2;
+
+        // Padded luma rows start - 1 .. end of the slice (clamped), converted once for the 3 rows that read them
+        vector<unsigned char> luma((end - start + 2) * stride);
+        vector<unsigned char> edge(width);
+
+        for (int y = start - 1; y <= end; ++y)
+        {
+            int ny = glm::clamp(y, 0, resolution.y - 1);
+            if (precision == Precision::Fixed)
+            {
+                CPU_Kernels::PadLumaFixedRGBA(&in[ny * width * 4], &luma[(y - start + 1) * stride], width);
+            }
+            else
+            {
+                CPU_Kernels::PadLumaRGBA(&in[ny * width * 4], &luma[(y - start + 1) * stride], width);
+            }
+        }
+
+        for (int y = start; y < end; ++y)
+        {
+            const unsigned char* row = &luma[(y - start + 1) * stride];
+            CPU_Kernels::SobelRow(row - stride, row, row + stride, edge.data(), width, threshold);
+            CPU_Kernels::ExpandPlane(edge.data(), &out[y * width * 4], width);
+        }
+    };
+
+	// Multithreaded applied on the rows !(better performance)
+    TaskGroup group;
+    const int grain = BandGrain(TaskId::SobelBinaryEdge, endRow - startRow, 2);
+    pool.Parallel_For(startRow, endRow, grain, SOBEL_BINARY_EDGE, TaskId::SobelBinaryEdge, group);
+    pool.Wait(group);
+
+    Publish(outputName, resolution, std::move(out), recipe);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: Weight
+// Description: Computes the weight of a Gaussian kernel.
+// Parameters:
+//   - mu: Distance from the center of the kernel.
+//   - sigma: Standard deviation of the Gaussian kernel.
+// Returns:
+//   - The weight of the Gaussian kernel.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+float SketchPipeline::Weight(int mu, float sigma) const
+{
+    return exp(-float(mu * mu) / (2.0f * sigma * sigma)) / (sqrt(2.0f * glm::pi<float>()) * sigma);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: GaussianKernel
+// Description: Computes the normalized weights of a 1D Gaussian kernel.
+// Parameters:
+//   - radius: Radius of the Gaussian kernel.
+//   - sigma: Standard deviation of the Gaussian kernel.
+// Returns:
+//   - The 2 * radius + 1 weights, summing to 1.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+vector<float> SketchPipeline::GaussianKernel(int radius, float sigma) const
+{
+    vector<float> weights(2 * radius + 1);
+    float sum = 0.0f;
+
+    for (int i = -radius; i <= radius; ++i)
+    {
+        weights[i + radius] = Weight(i, sigma);
+        sum += weights[i + radius];
+    }
+
+    for (int i = 0; i < weights.size(); ++i)
+    {
+        weights[i] /= sum;
+    }
+
+    return weights;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: SelectEngine
+// Description: Resolves the blur engine of a pass, Auto keeps the exact direct convolution for small radii
+//              and switches to the recursive blur (cost independent of the radius) from kRecursiveBlurRadius.
+// Parameters:
+//   - engine: Requested engine.
+//   - radius: Radius of the Gaussian kernel.
+// Returns:
+//   - BlurEngine::Direct or BlurEngine::Recursive.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+BlurEngine SketchPipeline::SelectEngine(BlurEngine engine, int radius) const
+{
+    if (engine != BlurEngine::Auto)
+    {
+        return engine;
+    }
+    return radius >= kRecursiveBlurRadius ? BlurEngine::Recursive : BlurEngine::Direct;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: BandGrain
+// Description: Chunk size of a stage whose chunks first read halo extra rows (the ring of a vertical blur, the
+//              rows around a Sobel row): the auto tuned grain, but at least 4 halos per chunk so the warm up stays
+//              small next to the rows produced (unless that leaves workers without chunk).
+// Parameters:
+//   - id: Id of the stage task.
+//   - count: Number of rows of the stage.
+//   - halo: Extra rows read by every chunk (0: none, the auto tuned grain).
+// Returns:
+//   - The number of rows per chunk.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+int SketchPipeline::BandGrain(TaskId id, int count, int halo) const
+{
+    const int workers = static_cast<int>(pool.workers.size());
+    const int shortest = min(4 * halo, (count + workers - 1) / workers);
+    return max(pool.Auto_Grain(id, count), shortest);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: HatchMasks
+// Description: Returns the hatch line masks of the layers. A mask only depends on the resolution and the hatch
+//              parameters, not on the image, so it is computed once (multithreaded on the rows) and reused by
+//              the next runs on images of the same size. Masks of other resolutions are dropped, and the ones
+//              not used by the layers when new masks would make the cache hold more than kHatchMaskCacheSize.
+//              The masks are shared: a concurrent call (another hatching stage of a graph, another resolution)
+//              may drop a mask from the cache while a stage still reads it, the stage keeps it alive.
+// Parameters:
+//   - resolution: Resolution of the image.
+//   - layers: Hatching layers (only the parameters are used).
+// Returns:
+//   - One packed mask of BitWords(resolution.x) * resolution.y words per layer, to hold while it is read.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+vector<shared_ptr<const BitBuffer>> SketchPipeline::HatchMasks(glm::ivec2 resolution, const vector<HatchLayer>& layers)
+{
+    const int words = CPU_Kernels::BitWords(resolution.x);
+
+    typedef tuple<int, int, float, float, float> HatchKey;
+
+    vector<HatchKey> keys;
+    for (const HatchLayer& layer : layers)
+    {
+        keys.push_back(HatchKey(resolution.x, resolution.y, layer.params.x, layer.params.y, layer.params.z));
+    }
+
+    // Layers whose mask is missing from the cache
+    vector<size_t> missing;
+    {
+        lock_guard<mutex> lock(masksMutex);
+        for (size_t l = 0; l < keys.size(); ++l)
+        {
+            if (hatchMasks.find(keys[l]) == hatchMasks.end())
+            {
+                missing.push_back(l);
+            }
+        }
+    }
+
+    // Computed without holding the lock: the thread waiting for the rows runs other tasks meanwhile,
+    // possibly a concurrent hatching stage asking for its masks
+    vector<BitBuffer> computed;
+    for (size_t m = 0; m < missing.size(); ++m)
+    {
+        computed.push_back(StageBits(words * resolution.y));
+    }
+    if (!missing.empty())
+    {
+        auto HATCH_MASK = [&](int start, int end)
+        {
+            for (size_t m = 0; m < missing.size(); ++m)
+            {
+                const glm::vec3& params = layers[missing[m]].params;
+                const float hatch[3] = { params.x, params.y, params.z };
+                for (int y = start; y < end; ++y)
+                {
+                    CPU_Kernels::HatchMaskRow(&computed[m][y * words], resolution.x, resolution.y, y, hatch);
+                }
+            }
+        };
+
+	    // Multithreaded applied on the rows
+        TaskGroup group;
+        pool.Parallel_For(0, resolution.y, kAutoGrain, HATCH_MASK, TaskId::HatchMask, group);
+        pool.Wait(group);
+    }
+
+    // Concurrent hatching stages of a graph share the cache
+    lock_guard<mutex> lock(masksMutex);
+
+    auto Used = [&](const HatchKey& key)
+    {
+        for (const HatchKey& k : keys)
+        {
+            if (k == key) return true;
+        }
+        return false;
+    };
+
+    // Only the masks to add can make room (the dropped ones live on in the stages holding them)
+    size_t added = 0;
+    for (const HatchKey& key : keys)
+    {
+        added += hatchMasks.find(key) == hatchMasks.end() ? 1 : 0;
+    }
+
+    for (auto it = hatchMasks.begin(); it != hatchMasks.end();)
+    {
+        bool otherSize = get<0>(it->first) != resolution.x || get<1>(it->first) != resolution.y;
+        bool full = added > 0 && hatchMasks.size() + added > kHatchMaskCacheSize;
+        if (otherSize || (full && !Used(it->first)))
+        {
+            it = hatchMasks.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+
+    // A concurrent call may have added the same mask meanwhile, the first one is kept
+    for (size_t m = 0; m < missing.size(); ++m)
+    {
+        hatchMasks.insert(make_pair(keys[missing[m]], make_shared<const BitBuffer>(std::move(computed[m]))));
+    }
+
+    vector<shared_ptr<const BitBuffer>> masks;
+    for (const HatchKey& key : keys)
+    {
+        masks.push_back(hatchMasks[key]);
+    }
+    return masks;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: Horizontal
+// Description: Applies a horizontal blur effect to the input image.
+// Parameters:
+//   - inputName: Name of the input image.
+//   - outputName: Name of the output image.
+//   - resolution: Resolution of the input image.
+//   - radius: Radius of the Gaussian kernel.
+//   - sigma: Standard deviation of the Gaussian kernel.
+//   - startRow: Start row for the processing.
+//   - endRow: End row for the processing.
+//   - engine: Direct convolution, recursive or box blur (Auto: direct or recursive from the radius).
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void SketchPipeline::Horizontal(
+    const string& inputName,
+    const string& outputName,
+    glm::ivec2 resolution,
+    int radius, float sigma,
+    int startRow, int endRow,
+    BlurEngine engine)
+{
+    const Image* input = Input(inputName, resolution);
+    if (input == nullptr)
+    {
+        return;
+    }
+
+    const string recipe = (Recipe("HORIZONTAL_BLUR") << input->content << precision << radius << sigma << startRow << endRow << engine).Key();
+    if (UpToDate({ outputName }, recipe) || Restore(outputName, resolution, recipe))
+    {
+        return;
+    }
+    const PixelBuffer& in = input->pixels;
+
+    PixelBuffer out = StageBuffer(resolution.x * resolution.y * 4);
+    ClearRows(out, resolution, startRow, endRow);
+    vector<float> weights = GaussianKernel(radius, sigma);
+    vector<unsigned short> fixedWeights(weights.size());
+    CPU_Kernels::FixedWeights(weights.data(), static_cast<int>(weights.size()), fixedWeights.data());
+
+    const BlurEngine selected = SelectEngine(engine, radius);
+    const CPU_Kernels::RecursiveGaussian recursiveGaussian = CPU_Kernels::RecursiveCoefficients(sigma);
+    int boxRadii[3];
+    CPU_Kernels::BoxRadii(sigma, boxRadii);
+
+    auto HORIZONTAL_BLUR = [&](int start, int end)
+    {
+        if (selected == BlurEngine::Recursive)
+        {
+            vector<float> scratch(CPU_Kernels::RecursiveScratchSize(resolution.x));
+            CPU_Kernels::RecursiveRowsRGBA(in.data(), out.data(), resolution.x, start, end, recursiveGaussian, scratch.data());
+            return;
+        }
+        if (selected == BlurEngine::Box)
+        {
+            // Intermediate 8.8 fixed point rows of the 3 passes
+            vector<unsigned short> scratch(2 * resolution.x * 4);
+            for (int y = start; y < end; ++y)
+            {
+                int idx = y * resolution.x * 4;
+                CPU_Kernels::BoxRowRGBA(&in[idx], &out[idx], resolution.x, boxRadii, scratch.data());
+            }
+            return;
+        }
+        if (precision == Precision::Fixed)
+        {
+            // Padded byte row, reused for every row of the slice
+            vector<unsigned char> scratch(CPU_Kernels::BlurRowFixedScratchSize(resolution.x, radius));
+            for (int y = start; y < end; ++y)
+            {
+                int idx = y * resolution.x * 4;
+                CPU_Kernels::BlurRowFixedRGBA(&in[idx], &out[idx], resolution.x, fixedWeights.data(), radius, scratch.data());
+            }
+            return;
+        }
+
+        // Padded float row, reused for every row of the slice
+        vector<float> scratch(CPU_Kernels::BlurRowScratchSize(resolution.x, radius));
+
+        for (int y = start; y < end; ++y)
+        {
+            int idx = y * resolution.x * 4;
+            CPU_Kernels::BlurRowRGBA(&in[idx], &out[idx], resolution.x, weights.data(), radius, scratch.data());
+        }
+    };
+
+	// Multithreaded applied on the rows
+    TaskGroup group;
+    pool.Parallel_For(startRow, endRow, kAutoGrain, HORIZONTAL_BLUR, TaskId::HorizontalBlur, group);
+    pool.Wait(group);
+
+    Publish(outputName, resolution, std::move(out), recipe);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: Vertical
+// Description: Applies a vertical blur effect to the input image.
+// Parameters:
+//   - inputName: Name of the input image.
+//   - outputName: Name of the output image.
+//   - resolution: Resolution of the input image.
+//   - radius: Radius of the Gaussian kernel.
+//   - sigma: Standard deviation of the Gaussian kernel.
+//   - startRow: Start row for the processing.
+//   - endRow: End row for the processing.
+//   - engine: Direct convolution, recursive or box blur (Auto: direct or recursive from the radius).
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void SketchPipeline::Vertical(
+    const string& inputName,
+    const string& outputName,
+    glm::ivec2 resolution,
+    int radius, float sigma,
+    int startRow, int endRow,
+    BlurEngine engine)
+{
+    const Image* input = Input(inputName, resolution);
+    if (input == nullptr)
+    {
+        return;
+    }
+
+    const string recipe = (Recipe("VERTICAL_BLUR") << input->content << precision << radius << sigma << startRow << endRow << engine).Key();
+    if (UpToDate({ outputName }, recipe) || Restore(outputName, resolution, recipe))
+    {
+        return;
+    }
+    const PixelBuffer& in = input->pixels;
+
+    PixelBuffer out = StageBuffer(resolution.x * resolution.y * 4);
+    ClearRows(out, resolution, startRow, endRow);
+    vector<float> weights = GaussianKernel(radius, sigma);
+    vector<unsigned short> fixedWeights(weights.size());
+    CPU_Kernels::FixedWeights(weights.data(), static_cast<int>(weights.size()), fixedWeights.data());
+
+    auto VERTICAL_BLUR = [&](int start, int end)
+    {
+        if (precision == Precision::Fixed)
+        {
+            vector<unsigned char> scratch(CPU_Kernels::BlurBandFixedScratchSize(radius));
+            CPU_Kernels::BlurBandFixedRGBA(in.data(), out.data(), resolution.x, resolution.y,
+                start, end, fixedWeights.data(), radius, scratch.data());
+            return;
+        }
+
+        // Ring of converted rows for one column strip, reused for the whole slice
+        vector<float> scratch(CPU_Kernels::BlurBandScratchSize(resolution.x, radius));
+        CPU_Kernels::BlurBandRGBA(in.data(), out.data(), resolution.x, resolution.y,
+            start, end, weights.data(), radius, scratch.data());
+    };
+
+    int boxRadii[3];
+    CPU_Kernels::BoxRadii(sigma, boxRadii);
+
+    auto VERTICAL_BOX_BLUR = [&](int start, int end)
+    {
+        vector<unsigned short> scratch(CPU_Kernels::BoxBandScratchSize(end - start, boxRadii));
+        CPU_Kernels::BoxBandRGBA(in.data(), out.data(), resolution.x, resolution.y,
+            start, end, boxRadii, scratch.data());
+    };
+
+    // The recursive blur runs down whole columns, it is split on the columns (rows [startRow, endRow) are written)
+    const CPU_Kernels::RecursiveGaussian recursiveGaussian = CPU_Kernels::RecursiveCoefficients(sigma);
+    auto VERTICAL_RECURSIVE_BLUR = [&](int start, int end)
+    {
+        vector<float> scratch(CPU_Kernels::RecursiveScratchSize(resolution.y));
+        CPU_Kernels::RecursiveColumnsRGBA(in.data(), out.data(), resolution.x, resolution.y,
+            start, end, startRow, endRow, recursiveGaussian, scratch.data());
+    };
+
+    TaskGroup group;
+    const BlurEngine selected = SelectEngine(engine, radius);
+    if (selected == BlurEngine::Recursive)
+    {
+        pool.Parallel_For(0, resolution.x, kAutoGrain, VERTICAL_RECURSIVE_BLUR, TaskId::VerticalRecursiveBlur, group);
+    }
+    else if (selected == BlurEngine::Box)
+    {
+	    // Multithreaded applied on the rows (no shared output lines)
+        const int grain = BandGrain(TaskId::VerticalBlur, endRow - startRow, 2 * (boxRadii[0] + boxRadii[1] + boxRadii[2]));
+        pool.Parallel_For(startRow, endRow, grain, VERTICAL_BOX_BLUR, TaskId::VerticalBlur, group);
+    }
+    else
+    {
+        const int grain = BandGrain(TaskId::VerticalBlur, endRow - startRow, 2 * radius + 1);
+        pool.Parallel_For(startRow, endRow, grain, VERTICAL_BLUR, TaskId::VerticalBlur, group);
+    }
+
+    pool.Wait(group);
+
+    Publish(outputName, resolution, std::move(out), recipe);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: Hatching
+// Description: Applies a hatching effect to the input image (lines from the cached mask, see HatchMasks).
+// Parameters:
+//   - inputName: Name of the input image.
+//   - outputName: Name of the output image.
+//   - resolution: Resolution of the input image.
+//   - hatchParams: Parameters of the hatching effect (a, b, c).
+//   - threshold: Threshold for the hatching effect (black/white).
+//   - invertBackground: Flag to invert the background.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void SketchPipeline::Hatching(
+    const string& inputName,
+    const string& outputName,
+    glm::ivec2 resolution,
+    glm::vec3 hatchParams,
+    float threshold,
+    bool invertBackground)
+{
+    const Image* input = Input(inputName, resolution);
+    if (input == nullptr)
+    {
+        return;
+    }
+
+    const string recipe = (Recipe("HATCHING") << input->content << precision << hatchParams << threshold << invertBackground).Key();
+    if (UpToDate({ outputName }, recipe) || Restore(outputName, resolution, recipe))
+    {
+        return;
+    }
+    const PixelBuffer& in = input->pixels;
+
+    PixelBuffer out = StageBuffer(resolution.x * resolution.y * 4);
+
+    // Cached line mask, the hatching is only a threshold compare and a select per pixel
+    const HatchLayer layer = { hatchParams, threshold, invertBackground };
+    const shared_ptr<const BitBuffer> maskPlane = HatchMasks(resolution, vector<HatchLayer>(1, layer))[0];
+    const uint64_t* mask = maskPlane->data();
+    const int words = CPU_Kernels::BitWords(resolution.x);
+
+    auto HATCHING = [&](int start, int end)
+    {
+        for (int y = start; y < end; ++y)
+        {
+            int idx = y * resolution.x;
+            if (precision == Precision::Fixed)
+            {
+                CPU_Kernels::HatchMaskedRowFixedRGBA(&in[idx * 4], mask + y * words, &out[idx * 4], resolution.x, threshold, invertBackground);
+            }
+            else
+            {
+                CPU_Kernels::HatchMaskedRowRGBA(&in[idx * 4], mask + y * words, &out[idx * 4], resolution.x, threshold, invertBackground);
+            }
+        }
+    };
+
+	// Multithreaded applied on the rows
+    TaskGroup group;
+    pool.Parallel_For(0, resolution.y, kAutoGrain, HATCHING, TaskId::Hatching, group);
+    pool.Wait(group);
+
+    Publish(outputName, resolution, std::move(out), recipe);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: Combine
+// Description: Combines multiple images into a single image (per channel minimum).
+// Parameters:
+//   - inputNames: Names of the input images.
+//   - outputName: Name of the output image.
+//   - resolution: Resolution of the input images.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void SketchPipeline::Combine(
+    const vector<string>& inputNames,
+    const string& outputName,
+    glm::ivec2 resolution)
+{
+    vector<const unsigned char*> in(inputNames.size());
+    Recipe recipe("COMBINE_IMAGES");
+
+    for (size_t t = 0; t < inputNames.size(); ++t)
+    {
+        const Image* input = Input(inputNames[t], resolution);
+        if (input == nullptr)
+        {
+            return;
+        }
+        in[t] = input->pixels.data();
+        recipe << input->content;
+    }
+    if (UpToDate({ outputName }, recipe.Key()) || Restore(outputName, resolution, recipe.Key()))
+    {
+        return;
+    }
+
+    PixelBuffer combined = StageBuffer(resolution.x * resolution.y * 4);
+
+    // The first input is copied (white without inputs), the others are folded in with a minimum
+    auto COMBINE_IMAGES = [&](int start, int end)
+    {
+        if (in.empty())
+        {
+            memset(&combined[start * 4], 255, (end - start) * 4);
+            return;
+        }
+        memcpy(&combined[start * 4], in[0] + start * 4, (end - start) * 4);
+        for (size_t t = 1; t < inputNames.size(); ++t)
+        {
+            CPU_Kernels::MinRGBA(in[t] + start * 4, &combined[start * 4], end - start);
+        }
+    };
+
+	// Multithreaded applied on the pixels (rows * columns)
+    int nr_pixels = resolution.x * resolution.y;
+    TaskGroup group;
+    pool.Parallel_For(0, nr_pixels, kAutoGrain, COMBINE_IMAGES, TaskId::CombineImages, group);
+    pool.Wait(group);
+
+    Publish(outputName, resolution, std::move(combined), recipe.Key());
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: Streaming
+// Description: Runs the whole CPU pipeline (blur H -> blur V -> Sobel -> hatching -> combine) fused per row.
+//              Every worker streams a band of rows and only keeps the lines each stage needs:
+//              a ring of 2 * radius + 1 horizontally blurred rows, the vertically blurred row and a hatch row.
+//              No full frame intermediate is allocated, the final sketch is the same as the staged pipeline.
+//              The recursive and box blurs do not stream on rows (the recursion runs down whole columns): with
+//              these engines both blur passes run on the whole frame first, as in the staged pipeline, and the
+//              bands stream Sobel, hatching and combine from the blurred rows.
+//              Nothing is kept between two runs either, so its dirty tracking is all or nothing: any parameter
+//              change recomputes the whole band pass (Staged and Luma only recompute the stale stages).
+// Parameters:
+//   - inputName: Name of the input image.
+//   - outputName: Name of the output image (final sketch).
+//   - resolution: Resolution of the input image.
+//   - radius: Radius of the Gaussian kernel.
+//   - sigma: Standard deviation of the Gaussian kernel.
+//   - thresholdSobel: Threshold for the edge binarization.
+//   - layers: Hatching layers combined with the edges.
+//   - engine: Blur engine (Auto: direct or recursive from the radius, as the staged pipeline).
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void SketchPipeline::Streaming(
+    const string& inputName,
+    const string& outputName,
+    glm::ivec2 resolution,
+    int radius, float sigma,
+    float thresholdSobel,
+    const vector<HatchLayer>& layers,
+    BlurEngine engine)
+{
+    const Image* input = Input(inputName, resolution);
+    if (input == nullptr)
+    {
+        return;
+    }
+
+    const string recipe = (Recipe("STREAMING") << input->content << precision << radius << sigma << thresholdSobel << layers
+        << engine).Key();
+    if (UpToDate({ outputName }, recipe) || Restore(outputName, resolution, recipe))
+    {
+        return;
+    }
+    const PixelBuffer& in = input->pixels;
+
+    PixelBuffer out = StageBuffer(resolution.x * resolution.y * 4);
+    vector<float> weights = GaussianKernel(radius, sigma);
+    vector<unsigned short> fixedWeights(weights.size());
+    CPU_Kernels::FixedWeights(weights.data(), static_cast<int>(weights.size()), fixedWeights.data());
+    const vector<shared_ptr<const BitBuffer>> masks = HatchMasks(resolution, layers);
+    const int words = CPU_Kernels::BitWords(resolution.x);
+    const bool fixed = precision == Precision::Fixed;
+
+    // Whole frame blur of the engines that do not stream (same passes as Horizontal and Vertical)
+    const BlurEngine selected = SelectEngine(engine, radius);
+    const bool streamed = selected == BlurEngine::Direct;
+    PixelBuffer frame = streamed ? PixelBuffer() : StageBuffer(resolution.x * resolution.y * 4);
+    if (!streamed)
+    {
+        PixelBuffer horizontal = StageBuffer(resolution.x * resolution.y * 4);
+        const CPU_Kernels::RecursiveGaussian recursiveGaussian = CPU_Kernels::RecursiveCoefficients(sigma);
+        int boxRadii[3];
+        CPU_Kernels::BoxRadii(sigma, boxRadii);
+
+        auto HORIZONTAL_BLUR = [&](int start, int end)
+        {
+            if (selected == BlurEngine::Recursive)
+            {
+                vector<float> scratch(CPU_Kernels::RecursiveScratchSize(resolution.x));
+                CPU_Kernels::RecursiveRowsRGBA(in.data(), horizontal.data(), resolution.x, start, end,
+                    recursiveGaussian, scratch.data());
+                return;
+            }
+            vector<unsigned short> scratch(2 * resolution.x * 4);
+            for (int y = start; y < end; ++y)
+            {
+                int idx = y * resolution.x * 4;
+                CPU_Kernels::BoxRowRGBA(&in[idx], &horizontal[idx], resolution.x, boxRadii, scratch.data());
+            }
+        };
+        auto VERTICAL_RECURSIVE_BLUR = [&](int start, int end)
+        {
+            vector<float> scratch(CPU_Kernels::RecursiveScratchSize(resolution.y));
+            CPU_Kernels::RecursiveColumnsRGBA(horizontal.data(), frame.data(), resolution.x, resolution.y,
+                start, end, 0, resolution.y, recursiveGaussian, scratch.data());
+        };
+        auto VERTICAL_BOX_BLUR = [&](int start, int end)
+        {
+            vector<unsigned short> scratch(CPU_Kernels::BoxBandScratchSize(end - start, boxRadii));
+            CPU_Kernels::BoxBandRGBA(horizontal.data(), frame.data(), resolution.x, resolution.y,
+                start, end, boxRadii, scratch.data());
+        };
+
+        TaskGroup blur;
+        pool.Parallel_For(0, resolution.y, kAutoGrain, HORIZONTAL_BLUR, TaskId::HorizontalBlur, blur);
+        pool.Wait(blur);
+        if (selected == BlurEngine::Recursive)
+        {
+            pool.Parallel_For(0, resolution.x, kAutoGrain, VERTICAL_RECURSIVE_BLUR, TaskId::VerticalRecursiveBlur, blur);
+        }
+        else
+        {
+            const int grain = BandGrain(TaskId::VerticalBlur, resolution.y, 2 * (boxRadii[0] + boxRadii[1] + boxRadii[2]));
+            pool.Parallel_For(0, resolution.y, grain, VERTICAL_BOX_BLUR, TaskId::VerticalBlur, blur);
+        }
+        pool.Wait(blur);
+    }
+
+    auto SKETCH_BAND = [&](int start, int end)
+    {
+        const int width = resolution.x;
+        const int taps = streamed ? 2 * radius + 1 : 0;
+
+        // Only the luma and bit rows when the blur is not streamed (taps = 0)
+        vector<float> scratch(streamed ? CPU_Kernels::BlurRowScratchSize(width, radius) : 0); // horizontal blur row
+        vector<unsigned char> blurred(streamed ? width * 4 : 0);        // horizontal blur of one row
+        vector<float> ring(fixed ? 0 : taps * width * 4); // last 2 * radius + 1 horizontal rows (floats)
+        vector<const float*> src(taps);
+        vector<unsigned char> fixedScratch(fixed && streamed ? CPU_Kernels::BlurRowFixedScratchSize(width, radius) : 0);
+        vector<unsigned char> fixedRing(fixed ? taps * width * 4 : 0); // same rows as bytes (fixed point)
+        vector<const unsigned char*> fixedSrc(taps);
+        vector<unsigned char> smooth(streamed ? width * 4 : 0); // vertical blur of the current row
+        vector<unsigned char> luma(3 * (width + 2));      // padded luma rows y - 1, y, y + 1 (ring)
+        vector<uint64_t> edge(words), hatch(words);       // binary rows as packed bits
+
+        auto LumaRow = [&](int y) -> unsigned char*
+        {
+            return &luma[((y - start + 1) % 3) * (width + 2)];
+        };
+
+        auto PushLuma = [&](int y)
+        {
+            int ny = glm::clamp(y, 0, resolution.y - 1);
+            if (fixed)
+            {
+                CPU_Kernels::PadLumaFixedRGBA(&in[ny * width * 4], LumaRow(y), width);
+            }
+            else
+            {
+                CPU_Kernels::PadLumaRGBA(&in[ny * width * 4], LumaRow(y), width);
+            }
+        };
+
+        auto PushRow = [&](int y, int slot)
+        {
+            int ny = glm::clamp(y, 0, resolution.y - 1);
+            if (fixed)
+            {
+                CPU_Kernels::BlurRowFixedRGBA(&in[ny * width * 4], &fixedRing[slot * width * 4], width,
+                    fixedWeights.data(), radius, fixedScratch.data());
+                return;
+            }
+            CPU_Kernels::BlurRowRGBA(&in[ny * width * 4], blurred.data(), width, weights.data(), radius, scratch.data());
+            CPU_Kernels::ToUnitRGBA(blurred.data(), &ring[slot * width * 4], width);
+        };
+
+        // Ring slot k holds the horizontal blur of row start - radius + k
+        for (int k = 0; k < taps - 1; ++k)
+        {
+            PushRow(start - radius + k, k);
+        }
+        PushLuma(start - 1);
+        PushLuma(start);
+
+        for (int y = start; y < end; ++y)
+        {
+            // Vertical blur of the row from the ring (the row of the whole frame blur if not streamed)
+            const unsigned char* smoothed = streamed ? smooth.data() : &frame[y * width * 4];
+            if (streamed)
+            {
+                const int base = y - start;
+                PushRow(y + radius, (base + taps - 1) % taps);
+
+                if (fixed)
+                {
+                    for (int k = 0; k < taps; ++k)
+                    {
+                        fixedSrc[k] = &fixedRing[((base + k) % taps) * width * 4];
+                    }
+                    CPU_Kernels::WeightedSumFixedRGBA(fixedSrc.data(), taps, fixedWeights.data(), smooth.data(), width);
+                }
+                else
+                {
+                    for (int k = 0; k < taps; ++k)
+                    {
+                        src[k] = &ring[((base + k) % taps) * width * 4];
+                    }
+                    CPU_Kernels::WeightedSumRGBA(src.data(), taps, weights.data(), smooth.data(), width);
+                }
+            }
+
+            // Edges of the original image, then every hatch layer of the smoothed row on top (minimum = AND of the bits)
+            PushLuma(y + 1);
+            CPU_Kernels::SobelRowBits(LumaRow(y - 1), LumaRow(y), LumaRow(y + 1), edge.data(), width, thresholdSobel);
+
+            for (size_t l = 0; l < layers.size(); ++l)
+            {
+                if (fixed)
+                {
+                    CPU_Kernels::HatchBitsFixedRGBA(smoothed, masks[l]->data() + y * words, hatch.data(), width,
+                        layers[l].threshold, layers[l].invertBackground);
+                }
+                else
+                {
+                    CPU_Kernels::HatchBitsRGBA(smoothed, masks[l]->data() + y * words, hatch.data(), width,
+                        layers[l].threshold, layers[l].invertBackground);
+                }
+                CPU_Kernels::AndBits(hatch.data(), edge.data(), words);
+            }
+
+            CPU_Kernels::ExpandBits(edge.data(), &out[y * width * 4], width);
+        }
+    };
+
+	// Multithreaded applied on bands of rows (each band warms its own ring, or the luma rows around its first row)
+    TaskGroup group;
+    const int grain = BandGrain(TaskId::SketchBand, resolution.y, streamed ? 2 * radius + 1 : 2);
+    pool.Parallel_For(0, resolution.y, grain, SKETCH_BAND, TaskId::SketchBand, group);
+    pool.Wait(group);
+
+    Publish(outputName, resolution, std::move(out), recipe);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: Luma
+// Description: Runs the whole CPU pipeline on single channel luma planes (1 byte per pixel).
+//              The original image is converted once to its gray nuance, then the blur (one channel instead
+//              of three) works on byte planes, Sobel and hatching write packed bit planes (1 bit per pixel)
+//              and the combine is an AND of their words. The planes are only expanded to RGBA at the end,
+//              into the host images of the stages, so every stage can still be displayed.
+//              The blur is applied to the gray image instead of each RGB channel, the result can differ
+//              by a few levels from the staged RGBA pipeline (the hatching thresholds see the same nuances).
+//              The stages run as the steps of one parallel region of the pool: the workers stay in it for
+//              the whole run and pass from a stage to the next on a spinning barrier, no stage waits for
+//              sleeping workers to be woken up (most of a stage on small images).
+//              Only the steps the requested images need run (no blur planes for the edges alone, no vertical
+//              pass for the horizontal image, no hatching or masks for the blur images, no Sobel without the
+//              edges or the sketch), and only the requested images are expanded.
+//              Every step has its own recipe, and its plane is kept with it for the next run: a new Sobel
+//              threshold only recomputes the edges and the sketch, a new threshold of a hatching layer only
+//              that layer and the two combines, the other planes are reused as they are.
+// Parameters:
+//   - inputName: Name of the input image.
+//   - outputNames: Names of the stage images, in order: horizontal blur, vertical blur, edges,
+//                         one per hatching layer, combined hatches, final sketch.
+//   - resolution: Resolution of the input image.
+//   - radius: Radius of the Gaussian kernel.
+//   - sigma: Standard deviation of the Gaussian kernel.
+//   - thresholdSobel: Threshold for the edge binarization.
+//   - layers: Hatching layers combined with the edges.
+//   - engine: Blur engine of both passes.
+//   - requested: Images to produce, among outputNames (empty: all of them).
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void SketchPipeline::Luma(
+    const string& inputName,
+    const vector<string>& outputNames,
+    glm::ivec2 resolution,
+    int radius, float sigma,
+    float thresholdSobel,
+    const vector<HatchLayer>& layers,
+    BlurEngine engine,
+    const vector<string>& requested)
+{
+    if (outputNames.size() != layers.size() + 5)
+    {
+        cerr << "[Error]: Luma pipeline expects " << layers.size() + 5 << " output images." << endl;
+        return;
+    }
+
+    const int width = resolution.x;
+    const int pixels = resolution.x * resolution.y;
+
+    const Image* input = Input(inputName, resolution);
+    if (input == nullptr)
+    {
+        return;
+    }
+
+    // Recipe of every step (its parameters and the recipes of the steps it reads), each image is keyed by the
+    // recipe of the step producing it: a new Sobel threshold leaves the blur and the hatches up to date
+    const size_t combinedOutput = outputNames.size() - 2;
+    const size_t sketchOutput = outputNames.size() - 1;
+    auto Hash = [](const string& recipe) { return HashBytes(recipe.data(), recipe.size(), 0); };
+
+    const string blurRecipe = (Recipe("LUMA_BLUR") << input->content << precision << radius << sigma << engine).Key();
+    const string edgesRecipe = (Recipe("LUMA_EDGES") << input->content << precision << thresholdSobel).Key();
+    Recipe combined("LUMA_COMBINED");
+    vector<string> hatchRecipes;
+    for (const HatchLayer& layer : layers)
+    {
+        hatchRecipes.push_back((Recipe("LUMA_HATCHING") << Hash(blurRecipe) << precision << layer).Key());
+        combined << Hash(hatchRecipes.back());
+    }
+    const string combinedRecipe = combined.Key();
+    const string sketchRecipe = (Recipe("LUMA_SKETCH") << Hash(edgesRecipe) << Hash(combinedRecipe)).Key();
+
+    vector<const string*> recipes = { &blurRecipe, &blurRecipe, &edgesRecipe };
+    for (const string& recipe : hatchRecipes)
+    {
+        recipes.push_back(&recipe);
+    }
+    recipes.push_back(&combinedRecipe);
+    recipes.push_back(&sketchRecipe);
+
+    // Images to produce: requested and not up to date (nor found in the cache)
+    vector<bool> stale(outputNames.size(), false);
+    bool anyStale = false;
+    for (size_t p = 0; p < outputNames.size(); ++p)
+    {
+        const bool wanted = requested.empty() || find(requested.begin(), requested.end(), outputNames[p]) != requested.end();
+        const int role = p == 1 ? 1 : 0;
+        stale[p] = wanted && !UpToDate({ outputNames[p] }, *recipes[p]) &&
+            !Restore(outputNames[p], resolution, *recipes[p], role);
+        anyStale = anyStale || stale[p];
+    }
+    if (!anyStale)
+    {
+        return;
+    }
+
+    // The planes of the last run are kept with their recipes, the steps whose plane still holds its recipe are
+    // skipped (the steps read the planes of the steps before them, which stay valid or are recomputed first)
+    lock_guard<mutex> planesLock(lumaMutex);
+    LumaPlanes& kept = lumaPlanes;
+    const int words = CPU_Kernels::BitWords(width);
+    const size_t planeWords = static_cast<size_t>(words) * resolution.y;
+    if (kept.resolution != resolution || kept.hatches.size() != layers.size())
+    {
+        kept = LumaPlanes();
+        kept.resolution = resolution;
+        kept.hatches.resize(layers.size());
+        kept.hatchRecipes.resize(layers.size());
+    }
+    auto Valid = [](const string& keptRecipe, const string& recipe) { return keptRecipe == recipe; };
+
+    const BlurEngine selected = SelectEngine(engine, radius);
+    const bool recursive = selected == BlurEngine::Recursive;
+    const bool box = selected == BlurEngine::Box;
+
+    const bool computeSketch = stale[sketchOutput] && !Valid(kept.sketchRecipe, sketchRecipe);
+    const bool needCombined = stale[combinedOutput] || computeSketch;
+    const bool computeCombined = needCombined && !Valid(kept.combinedRecipe, combinedRecipe);
+    vector<bool> computeHatch(layers.size());
+    bool computeHatching = false;
+    for (size_t l = 0; l < layers.size(); ++l)
+    {
+        computeHatch[l] = (stale[l + 3] || computeCombined) && !Valid(kept.hatchRecipes[l], hatchRecipes[l]);
+        computeHatching = computeHatching || computeHatch[l];
+    }
+    const bool computeEdges = (stale[2] || computeSketch) && !Valid(kept.edgesRecipe, edgesRecipe);
+    const bool needVertical = stale[1] || computeHatching;
+    bool computeVertical = needVertical && !Valid(kept.verticalRecipe, blurRecipe);
+    const bool computeHorizontal = (stale[0] || computeVertical) && !Valid(kept.horizontalRecipe, blurRecipe);
+    if (recursive && computeHorizontal)
+    {
+        // The recursive rows read an unpadded copy of the luma from the vertical plane
+        computeVertical = needVertical;
+        kept.verticalRecipe.clear();
+    }
+    const bool computeLuma = computeHorizontal || computeEdges;
+
+    const PixelBuffer& in = input->pixels;
+
+    vector<float> weights = GaussianKernel(radius, sigma);
+    vector<unsigned short> fixedWeights(weights.size());
+    CPU_Kernels::FixedWeights(weights.data(), static_cast<int>(weights.size()), fixedWeights.data());
+    const bool fixed = precision == Precision::Fixed;
+
+    // Luma plane padded by one replicated pixel on each side (Sobel without bounds checks), only for this run
+    const int stride = width + 2;
+    PixelBuffer luma = computeLuma ? StageBuffer(stride * (resolution.y + 2)) : PixelBuffer();
+
+    // Planes kept for the next runs, allocated from the arena the first time a step computes them
+    auto KeepBytes = [&](PixelBuffer& plane) { if (plane.empty()) plane = StageBuffer(pixels); };
+    auto KeepBits = [&](BitBuffer& plane) { if (plane.empty()) plane = StageBits(planeWords); };
+    if (computeHorizontal || computeVertical)
+    {
+        KeepBytes(kept.horizontal);
+        KeepBytes(kept.vertical);
+    }
+    if (computeEdges)
+    {
+        KeepBits(kept.edges);
+    }
+    for (size_t l = 0; l < layers.size(); ++l)
+    {
+        if (computeHatch[l])
+        {
+            KeepBits(kept.hatches[l]);
+        }
+    }
+    if (computeCombined)
+    {
+        KeepBits(kept.combinedHatch);
+    }
+    if (computeSketch)
+    {
+        KeepBits(kept.sketch);
+    }
+    PixelBuffer& horizontal = kept.horizontal;
+    PixelBuffer& vertical = kept.vertical;
+    BitBuffer& edges = kept.edges;
+    vector<BitBuffer>& hatches = kept.hatches;
+    BitBuffer& combinedHatch = kept.combinedHatch;
+    BitBuffer& sketch = kept.sketch;
+    const vector<shared_ptr<const BitBuffer>> masks = computeHatching ? HatchMasks(resolution, layers)
+        : vector<shared_ptr<const BitBuffer>>();
+
+    // Host images of the stages, expanded in the region and published after it
+    vector<PixelBuffer> outputs;
+    for (size_t p = 0; p < outputNames.size(); ++p)
+    {
+        outputs.push_back(stale[p] ? StageBuffer(pixels * 4) : PixelBuffer());
+    }
+
+	// Steps of the region applied on the rows, every step waits for the previous one
+    vector<RegionStep> steps;
+    auto Rows = [&](const function<void(int, int)>& stage, TaskId id, int halo)
+    {
+        RegionStep step = { 0, resolution.y, BandGrain(id, resolution.y, halo), stage, id };
+        steps.push_back(step);
+    };
+
+    const CPU_Kernels::RecursiveGaussian recursiveGaussian = CPU_Kernels::RecursiveCoefficients(sigma);
+    int boxRadii[3];
+    CPU_Kernels::BoxRadii(sigma, boxRadii);
+
+    auto LUMA_PLANE = [&](int start, int end)
+    {
+        vector<float> scratch(CPU_Kernels::BlurRowScratchSize(width, radius, 1)); // padded row of the horizontal blur
+        vector<unsigned char> fixedScratch(fixed ? CPU_Kernels::BlurRowFixedScratchSize(width, radius, 1) : 0);
+        vector<unsigned short> boxScratch(box ? 2 * width : 0); // 8.8 fixed point rows of the 3 box passes
+
+        for (int y = start; y < end; ++y)
+        {
+            unsigned char* row = &luma[(y + 1) * stride];
+            if (fixed)
+            {
+                CPU_Kernels::PadLumaFixedRGBA(&in[y * width * 4], row, width);
+            }
+            else
+            {
+                CPU_Kernels::PadLumaRGBA(&in[y * width * 4], row, width);
+            }
+
+            if (!computeHorizontal)
+            {
+                continue;
+            }
+            if (recursive)
+            {
+                // Unpadded copy for the recursive blur (the vertical plane is only written by the vertical pass)
+                memcpy(&vertical[y * width], row + 1, width);
+            }
+            else if (box)
+            {
+                CPU_Kernels::BoxRowPlane(row + 1, &horizontal[y * width], width, boxRadii, boxScratch.data());
+            }
+            else if (fixed)
+            {
+                CPU_Kernels::BlurRowFixedPlane(row + 1, &horizontal[y * width], width, fixedWeights.data(), radius, fixedScratch.data());
+            }
+            else
+            {
+                CPU_Kernels::BlurRowPlane(row + 1, &horizontal[y * width], width, weights.data(), radius, scratch.data());
+            }
+        }
+
+        // Replicated rows above and below the plane, written by the chunks of the first and last rows
+        if (start == 0)
+        {
+            memcpy(&luma[0], &luma[stride], stride);
+        }
+        if (end == resolution.y)
+        {
+            memcpy(&luma[(resolution.y + 1) * stride], &luma[resolution.y * stride], stride);
+        }
+    };
+
+    auto HORIZONTAL_BLUR = [&](int start, int end)
+    {
+        vector<float> scratch(CPU_Kernels::RecursiveScratchSize(width));
+        CPU_Kernels::RecursiveRowsPlane(vertical.data(), horizontal.data(), width, start, end, recursiveGaussian, scratch.data());
+    };
+
+    auto VERTICAL_BLUR = [&](int start, int end)
+    {
+        if (fixed)
+        {
+            vector<unsigned char> scratch(CPU_Kernels::BlurBandFixedScratchSize(radius));
+            CPU_Kernels::BlurBandFixedPlane(horizontal.data(), vertical.data(), width, resolution.y,
+                start, end, fixedWeights.data(), radius, scratch.data());
+            return;
+        }
+
+        vector<float> scratch(CPU_Kernels::BlurBandScratchSize(width, radius, 1));
+        CPU_Kernels::BlurBandPlane(horizontal.data(), vertical.data(), width, resolution.y,
+            start, end, weights.data(), radius, scratch.data());
+    };
+
+    auto VERTICAL_BOX_BLUR = [&](int start, int end)
+    {
+        vector<unsigned short> scratch(CPU_Kernels::BoxBandScratchSize(end - start, boxRadii));
+        CPU_Kernels::BoxBandPlane(horizontal.data(), vertical.data(), width, resolution.y,
+            start, end, boxRadii, scratch.data());
+    };
+
+    auto VERTICAL_RECURSIVE_BLUR = [&](int start, int end)
+    {
+        vector<float> scratch(CPU_Kernels::RecursiveScratchSize(resolution.y));
+        CPU_Kernels::RecursiveColumnsPlane(horizontal.data(), vertical.data(), width, resolution.y,
+            start, end, 0, resolution.y, recursiveGaussian, scratch.data());
+    };
+
+    auto SOBEL_BINARY_EDGE = [&](int start, int end)
+    {
+        for (int y = start; y < end; ++y)
+        {
+            const unsigned char* row = &luma[(y + 1) * stride];
+            CPU_Kernels::SobelRowBits(row - stride, row, row + stride, &edges[y * words], width, thresholdSobel);
+        }
+    };
+
+    auto HATCHING = [&](int start, int end)
+    {
+        for (int y = start; y < end; ++y)
+        {
+            int idx = y * words;
+            for (size_t l = 0; l < layers.size(); ++l)
+            {
+                if (computeHatch[l])
+                {
+                    CPU_Kernels::HatchBitsPlane(&vertical[y * width], masks[l]->data() + idx, &hatches[l][idx], width,
+                        layers[l].threshold, layers[l].invertBackground);
+                }
+            }
+
+            if (computeCombined)
+            {
+                memset(&combinedHatch[idx], 0xFF, words * sizeof(uint64_t));
+                for (size_t l = 0; l < layers.size(); ++l)
+                {
+                    CPU_Kernels::AndBits(&hatches[l][idx], &combinedHatch[idx], words);
+                }
+            }
+
+            if (computeSketch)
+            {
+                memcpy(&sketch[idx], &edges[idx], words * sizeof(uint64_t));
+                CPU_Kernels::AndBits(&combinedHatch[idx], &sketch[idx], words);
+            }
+        }
+    };
+
+    if (computeLuma)
+    {
+        Rows(LUMA_PLANE, TaskId::LumaPlane, 0);
+    }
+    if (computeHorizontal && recursive)
+    {
+        Rows(HORIZONTAL_BLUR, TaskId::HorizontalBlur, 0);
+    }
+    if (computeVertical && recursive)
+    {
+        // Split on the columns, the recursion runs down whole columns
+        RegionStep columns = { 0, width, kAutoGrain, VERTICAL_RECURSIVE_BLUR, TaskId::VerticalRecursiveBlur };
+        steps.push_back(columns);
+    }
+    else if (computeVertical && box)
+    {
+        Rows(VERTICAL_BOX_BLUR, TaskId::VerticalBlur, 2 * (boxRadii[0] + boxRadii[1] + boxRadii[2]));
+    }
+    else if (computeVertical)
+    {
+        Rows(VERTICAL_BLUR, TaskId::VerticalBlur, 2 * radius + 1);
+    }
+    if (computeEdges)
+    {
+        Rows(SOBEL_BINARY_EDGE, TaskId::SobelBinaryEdge, 0);
+    }
+    if (computeHatching || computeCombined || computeSketch)
+    {
+        Rows(HATCHING, TaskId::Hatching, 0);
+    }
+
+    const PixelBuffer* bytePlanes[2] = { &horizontal, &vertical };
+    for (size_t p = 0; p < 2; ++p)
+    {
+        if (!stale[p])
+        {
+            continue;
+        }
+        const unsigned char* plane = bytePlanes[p]->data();
+        unsigned char* rgba = outputs[p].data();
+
+        auto EXPAND_PLANE = [=](int start, int end)
+        {
+            CPU_Kernels::ExpandPlane(&plane[start * width], &rgba[start * width * 4], (end - start) * width);
+        };
+        Rows(EXPAND_PLANE, TaskId::ExpandPlane, 0);
+    }
+
+    vector<const BitBuffer*> bitPlanes = { &edges };
+    for (size_t l = 0; l < layers.size(); ++l)
+    {
+        bitPlanes.push_back(&hatches[l]);
+    }
+    bitPlanes.push_back(&combinedHatch);
+    bitPlanes.push_back(&sketch);
+
+    for (size_t p = 0; p < bitPlanes.size(); ++p)
+    {
+        if (!stale[p + 2])
+        {
+            continue;
+        }
+        const uint64_t* plane = bitPlanes[p]->data();
+        unsigned char* rgba = outputs[p + 2].data();
+
+        auto EXPAND_PLANE = [=](int start, int end)
+        {
+            for (int y = start; y < end; ++y)
+            {
+                CPU_Kernels::ExpandBits(&plane[y * words], &rgba[y * width * 4], width);
+            }
+        };
+        Rows(EXPAND_PLANE, TaskId::ExpandPlane, 0);
+    }
+
+    pool.Run_Region(steps);
+
+    // Recipes of the planes computed by this run
+    if (computeHorizontal)
+    {
+        kept.horizontalRecipe = blurRecipe;
+    }
+    if (computeVertical)
+    {
+        kept.verticalRecipe = blurRecipe;
+    }
+    if (computeEdges)
+    {
+        kept.edgesRecipe = edgesRecipe;
+    }
+    for (size_t l = 0; l < layers.size(); ++l)
+    {
+        if (computeHatch[l])
+        {
+            kept.hatchRecipes[l] = hatchRecipes[l];
+        }
+    }
+    if (computeCombined)
+    {
+        kept.combinedRecipe = combinedRecipe;
+    }
+    if (computeSketch)
+    {
+        kept.sketchRecipe = sketchRecipe;
+    }
+
+    for (size_t p = 0; p < outputNames.size(); ++p)
+    {
+        if (stale[p])
+        {
+            Publish(outputNames[p], resolution, std::move(outputs[p]), *recipes[p], p == 1 ? 1 : 0);
+        }
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: PlanBuffers
+// Description: Liveness planning of the images produced by a graph. The stages are ordered (Kahn's order, the
+//              ready stage listed first runs first), an image lives from its producer to its last consumer, or to the
+//              end of the run if requested. The images are then given slots in this order, an image taking the slot
+//              of an image dead before its producer (greedy interval coloring, optimal for the interval graph of
+//              equally sized images): the slots are the images alive at once, the planned peak footprint of the
+//              run (RunGraph measures the actual one). An image is as large as the largest input of its stage (the
+//              stages keep the resolution).
+// Parameters:
+//   - stages: Stages of the run (pulled), every image produced by one stage at most.
+//   - requested: Images kept after the run (empty: all of them, nothing is transient).
+// Returns:
+//   - The plan, its order is shorter than the stages if the graph has a cycle (RunGraph rejects it).
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+SketchPipeline::BufferPlan SketchPipeline::PlanBuffers(const vector<Stage>& stages, const vector<string>& requested) const
+{
+    const size_t count = stages.size();
+    BufferPlan plan = BufferPlan();
+    plan.after.resize(count);
+    plan.releases.resize(count);
+
+    unordered_map<string, size_t> producers;
+    for (size_t s = 0; s < count; ++s)
+    {
+        for (const string& output : stages[s].outputs)
+        {
+            producers[output] = s;
+        }
+    }
+
+    // Order of the stages
+    vector<vector<size_t>> dependents(count);
+    vector<size_t> waiting(count, 0);
+    for (size_t s = 0; s < count; ++s)
+    {
+        unordered_set<size_t> producersOfStage;
+        for (const string& input : stages[s].inputs)
+        {
+            auto producer = producers.find(input);
+            if (producer != producers.end() && producer->second != s && producersOfStage.insert(producer->second).second)
+            {
+                dependents[producer->second].push_back(s);
+                ++waiting[s];
+            }
+        }
+    }
+    set<size_t> ready;
+    for (size_t s = 0; s < count; ++s)
+    {
+        if (waiting[s] == 0) ready.insert(s);
+    }
+    while (!ready.empty())
+    {
+        const size_t s = *ready.begin();
+        ready.erase(ready.begin());
+        plan.order.push_back(s);
+        for (size_t d : dependents[s])
+        {
+            if (--waiting[d] == 0) ready.insert(d);
+        }
+    }
+    if (plan.order.size() != count)
+    {
+        return plan;
+    }
+
+    // Lifetimes: position of the producer, of the last consumer, and the stages using the image
+    struct Lifetime
+    {
+        size_t start;
+        size_t end;
+        size_t bytes;
+        bool kept;
+        vector<size_t> users;
+    };
+    unordered_map<string, Lifetime> lifetimes;
+    for (size_t t = 0; t < count; ++t)
+    {
+        const Stage& stage = stages[plan.order[t]];
+        size_t bytes = 0;
+        for (const string& input : stage.inputs)
+        {
+            auto produced = lifetimes.find(input);
+            if (produced != lifetimes.end())
+            {
+                Lifetime& lifetime = produced->second;
+                lifetime.end = t;
+                if (lifetime.users.empty() || lifetime.users.back() != plan.order[t])
+                {
+                    lifetime.users.push_back(plan.order[t]);
+                }
+                bytes = max(bytes, lifetime.bytes);
+            }
+            else if (const Image* image = FindImage(input))
+            {
+                bytes = max(bytes, image->pixels.size());
+            }
+        }
+        for (const string& output : stage.outputs)
+        {
+            const bool kept = requested.empty() || find(requested.begin(), requested.end(), output) != requested.end();
+            Lifetime lifetime = { t, t, bytes, kept, vector<size_t>() };
+            lifetimes[output] = lifetime;
+        }
+    }
+
+    // Slots, in the order of the producers: the free slot closest in size, else a new one
+    vector<string> occupants;
+    for (size_t t = 0; t < count; ++t)
+    {
+        const size_t s = plan.order[t];
+        for (const string& output : stages[s].outputs)
+        {
+            const Lifetime& lifetime = lifetimes[output];
+            size_t slot = occupants.size();
+            for (size_t k = 0; k < occupants.size(); ++k)
+            {
+                const Lifetime& previous = lifetimes[occupants[k]];
+                if (previous.kept || previous.end >= t)
+                {
+                    continue;
+                }
+                const bool fits = plan.slotBytes[k] >= lifetime.bytes;
+                if (slot == occupants.size() || (fits && (plan.slotBytes[slot] < lifetime.bytes ||
+                    plan.slotBytes[k] < plan.slotBytes[slot])) || (!fits && plan.slotBytes[k] > plan.slotBytes[slot]))
+                {
+                    slot = k;
+                }
+            }
+
+            if (slot == occupants.size())
+            {
+                occupants.push_back(output);
+                plan.slotBytes.push_back(lifetime.bytes);
+            }
+            else
+            {
+                // The image takes over the buffer once the users of the previous one are done
+                const Lifetime& previous = lifetimes[occupants[slot]];
+                plan.after[s].insert(plan.after[s].end(), previous.users.begin(), previous.users.end());
+                plan.after[s].push_back(plan.order[previous.start]);
+                occupants[slot] = output;
+                plan.slotBytes[slot] = max(plan.slotBytes[slot], lifetime.bytes);
+            }
+            plan.slots[output] = slot;
+            plan.unplannedBytes += lifetime.bytes;
+        }
+    }
+
+    // Transient images, released by their last user (their producer if nothing reads them)
+    for (const auto& image : plan.slots)
+    {
+        const Lifetime& lifetime = lifetimes[image.first];
+        if (lifetime.kept)
+        {
+            continue;
+        }
+        const vector<size_t> users = lifetime.users.empty() ? vector<size_t>(1, plan.order[lifetime.start]) : lifetime.users;
+        for (size_t user : users)
+        {
+            plan.releases[user].push_back(plan.transient.size());
+        }
+        plan.transient.push_back(image.first);
+    }
+
+    for (size_t bytes : plan.slotBytes)
+    {
+        plan.peakBytes += bytes;
+    }
+    return plan;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: RunGraph
+// Description: Runs stages as a dependency graph. A stage depends on the stages producing its inputs and starts as
+//              soon as they are done, independent stages run at the same time (each one is a task of the pool that
+//              submits its chunks and runs them while it waits for its own task group, the last producer of a stage
+//              submits it). The pool is never drained between stages: the chunks of concurrent stages share the
+//              workers and fill the tail of each other.
+//              Every image must be produced by one stage at most, the inputs not produced by a stage must be stored.
+//              With requested images the graph is pulled from them: only the stages they depend on (transitively)
+//              run, e.g. the blur chain alone when the blur is displayed.
+//              With buffer planning the images not requested are released by their last consumer, and a stage
+//              whose output reuses the slot of a released image also waits for the users of that image and is
+//              given its buffer (taken by its first StageBuffer): the stages run concurrently within the footprint
+//              of the plan (see PlanBuffers), the high-water mark of the arena during the run is kept in the plan.
+// Parameters:
+//   - graph: Stages of the graph, in any order.
+//   - requested: Images needed (empty: every stage runs).
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void SketchPipeline::RunGraph(const vector<Stage>& graph, const vector<string>& requested)
+{
+    unordered_map<string, size_t> producers;
+    for (size_t s = 0; s < graph.size(); ++s)
+    {
+        for (const string& output : graph[s].outputs)
+        {
+            if (!producers.insert(make_pair(output, s)).second)
+            {
+                cerr << "[Error]: Image '" << output << "' is produced by several stages." << endl;
+                return;
+            }
+        }
+    }
+
+    // Pull: the producers of the requested images, then the producers of their inputs
+    vector<bool> needed(graph.size(), requested.empty());
+    vector<string> pulling = requested;
+    while (!pulling.empty())
+    {
+        auto producer = producers.find(pulling.back());
+        pulling.pop_back();
+        if (producer != producers.end() && !needed[producer->second])
+        {
+            needed[producer->second] = true;
+            pulling.insert(pulling.end(), graph[producer->second].inputs.begin(), graph[producer->second].inputs.end());
+        }
+    }
+
+    vector<Stage> stages;
+    producers.clear();
+    for (size_t s = 0; s < graph.size(); ++s)
+    {
+        if (needed[s])
+        {
+            for (const string& output : graph[s].outputs)
+            {
+                producers[output] = stages.size();
+            }
+            stages.push_back(graph[s]);
+        }
+    }
+    const size_t count = stages.size();
+
+    // Buffers of the produced images (see PlanBuffers), no release nor extra edge without planning
+    BufferPlan plan = BufferPlan();
+    plan.after.resize(count);
+    plan.releases.resize(count);
+    if (planBuffers)
+    {
+        plan = PlanBuffers(stages, requested);
+    }
+
+    // Slot of the first output of each stage, and the buffers released in the slots until their next image takes them
+    const size_t noSlot = plan.slotBytes.size();
+    vector<size_t> stageSlots(count, noSlot);
+    for (size_t s = 0; s < count; ++s)
+    {
+        auto slot = stages[s].outputs.empty() ? plan.slots.end() : plan.slots.find(stages[s].outputs[0]);
+        if (slot != plan.slots.end()) stageSlots[s] = slot->second;
+    }
+    vector<size_t> transientSlots;
+    for (const string& image : plan.transient)
+    {
+        transientSlots.push_back(plan.slots[image]);
+    }
+    const ArenaAllocator<unsigned char> allocator(&arena);
+    vector<PixelBuffer> slotBuffers(plan.slotBytes.size(), PixelBuffer(allocator));
+    atomic<size_t> slotReuses(0);
+
+    // Edges producer -> consumer (and previous users of a slot -> its next producer), the stages each one waits for
+    vector<vector<size_t>> dependents(count);
+    vector<size_t> waiting(count, 0);
+    for (size_t s = 0; s < count; ++s)
+    {
+        unordered_set<size_t> producersOfStage;
+        for (const string& input : stages[s].inputs)
+        {
+            auto producer = producers.find(input);
+            if (producer != producers.end() && producer->second != s && producersOfStage.insert(producer->second).second)
+            {
+                dependents[producer->second].push_back(s);
+                ++waiting[s];
+            }
+        }
+        for (size_t user : plan.after[s])
+        {
+            if (user != s && producersOfStage.insert(user).second)
+            {
+                dependents[user].push_back(s);
+                ++waiting[s];
+            }
+        }
+    }
+
+    // Reject cycles before starting anything (Kahn's order on a copy of the counters)
+    {
+        vector<size_t> pending = waiting;
+        vector<size_t> ready;
+        for (size_t s = 0; s < count; ++s)
+        {
+            if (pending[s] == 0) ready.push_back(s);
+        }
+        size_t ordered = 0;
+        while (!ready.empty())
+        {
+            size_t s = ready.back();
+            ready.pop_back();
+            ++ordered;
+            for (size_t d : dependents[s])
+            {
+                if (--pending[d] == 0) ready.push_back(d);
+            }
+        }
+        if (ordered != count)
+        {
+            cerr << "[Error]: The pipeline graph has a cycle." << endl;
+            return;
+        }
+    }
+
+    // Producers still running, per stage
+    unique_ptr<atomic<size_t>[]> remaining(new atomic<size_t>[count]);
+    for (size_t s = 0; s < count; ++s)
+    {
+        remaining[s] = waiting[s];
+    }
+
+    // Users left of each transient image, the last one releases it (before its dependents start)
+    unique_ptr<atomic<size_t>[]> users(new atomic<size_t>[plan.transient.size()]);
+    for (size_t i = 0; i < plan.transient.size(); ++i)
+    {
+        users[i] = 0;
+    }
+    for (const vector<size_t>& released : plan.releases)
+    {
+        for (size_t i : released)
+        {
+            ++users[i];
+        }
+    }
+
+    TaskGroup group;
+    function<void(size_t)> Launch = [&](size_t s)
+    {
+        pool.Add_Task([&, s] {
+            // The buffer of the slot is written by this stage only (its previous users are done, its next image
+            // waits for this stage), a stage running nested in its Wait sets its own
+            PixelBuffer* const slot = stageSlots[s] != noSlot && slotBuffers[stageSlots[s]].capacity() > 0 ?
+                &slotBuffers[stageSlots[s]] : nullptr;
+            PixelBuffer* const outer = stageSlot;
+            stageSlot = slot;
+            stages[s].run();
+            stageSlot = outer;
+            if (slot != nullptr && slot->capacity() == 0) ++slotReuses;
+
+            for (size_t i : plan.releases[s])
+            {
+                if (--users[i] == 0) slotBuffers[transientSlots[i]] = TakeImage(plan.transient[i]);
+            }
+            for (size_t d : dependents[s])
+            {
+                if (--remaining[d] == 0) Launch(d);
+            }
+        }, TaskId::PipelineStage, group);
+    };
+
+    if (planBuffers)
+    {
+        arena.ResetPeak();
+    }
+    for (size_t s = 0; s < count; ++s)
+    {
+        if (waiting[s] == 0) Launch(s);
+    }
+
+    pool.Wait(group);
+
+    if (planBuffers)
+    {
+        plan.measuredPeakBytes = arena.GetStats().peakBytes;
+        plan.slotReuses = slotReuses;
+        lock_guard<mutex> lock(planMutex);
+        lastPlan = plan;
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: Staged
+// Description: Runs the staged pipeline as a graph: the Sobel edges only need the input and run next to the blur
+//              chain, the hatching layers only need the vertical blur and run next to each other, then the hatches
+//              and the sketch are combined. Same images as calling the stages one after the other. Only the stages
+//              the requested images depend on run (every stage image is produced by default).
+// Parameters:
+//   - inputName: Name of the input image.
+//   - outputNames: Names of the stage images, in order: horizontal blur, vertical blur, edges,
+//                  one per hatching layer, combined hatches, final sketch.
+//   - resolution: Resolution of the input image.
+//   - radius: Radius of the Gaussian kernel.
+//   - sigma: Standard deviation of the Gaussian kernel.
+//   - thresholdSobel: Threshold for the edge binarization.
+//   - layers: Hatching layers combined with the edges.
+//   - engine: Blur engine of both passes.
+//   - requested: Images to produce, among outputNames (empty: all of them).
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void SketchPipeline::Staged(
+    const string& inputName,
+    const vector<string>& outputNames,
+    glm::ivec2 resolution,
+    int radius, float sigma,
+    float thresholdSobel,
+    const vector<HatchLayer>& layers,
+    BlurEngine engine,
+    const vector<string>& requested)
+{
+    if (outputNames.size() != layers.size() + 5)
+    {
+        cerr << "[Error]: Staged pipeline expects " << layers.size() + 5 << " output images." << endl;
+        return;
+    }
+    if (Input(inputName, resolution) == nullptr)
+    {
+        return;
+    }
+
+    const string& horizontal = outputNames[0];
+    const string& vertical = outputNames[1];
+    const string& edges = outputNames[2];
+    const string& combinedHatch = outputNames[layers.size() + 3];
+    const string& sketch = outputNames[layers.size() + 4];
+
+    // The masks are built once here, the concurrent hatching stages only read them (unless no hatch is pulled)
+    if (requested.empty() || find_first_of(requested.begin(), requested.end(), outputNames.begin() + 3, outputNames.end())
+        != requested.end())
+    {
+        HatchMasks(resolution, layers);
+    }
+
+    vector<Stage> stages;
+    stages.push_back({ { inputName }, { horizontal }, [&] {
+        Horizontal(inputName, horizontal, resolution, radius, sigma, 0, resolution.y, engine);
+    } });
+    stages.push_back({ { horizontal }, { vertical }, [&] {
+        Vertical(horizontal, vertical, resolution, radius, sigma, 0, resolution.y, engine);
+    } });
+    stages.push_back({ { inputName }, { edges }, [&] {
+        EdgeBinarize(inputName, edges, resolution, thresholdSobel, 0, resolution.y);
+    } });
+
+    vector<string> hatches;
+    for (size_t l = 0; l < layers.size(); ++l)
+    {
+        hatches.push_back(outputNames[l + 3]);
+        stages.push_back({ { vertical }, { outputNames[l + 3] }, [&, l] {
+            Hatching(vertical, outputNames[l + 3], resolution, layers[l].params, layers[l].threshold, layers[l].invertBackground);
+        } });
+    }
+
+    stages.push_back({ hatches, { combinedHatch }, [&] {
+        Combine(hatches, combinedHatch, resolution);
+    } });
+    stages.push_back({ { edges, combinedHatch }, { sketch }, [&] {
+        Combine({ edges, combinedHatch }, sketch, resolution);
+    } });
+
+    RunGraph(stages, requested);
+}
@@ -0,0 +1,271 @@
+#pragma once
+
+#ifndef SKETCH_PIPELINE_H
+#define SKETCH_PIPELINE_H
+
+#include "ThreadPool.h"
+#include "CPU_Kernels.h"
+#include "StageCache.h"
+#include "BufferArena.h"
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <map>
+#include <tuple>
+#include <mutex>
+#include <thread>
+#include <functional>
+
+#include <glm/glm.hpp>
+
+/// CPU sketch pipeline over plain RGBA8 pixel buffers (no GL, no window): the images are kept in host memory
+/// under a name, every stage reads its inputs and publishes its output by name. It only depends on the
+/// kernels, the thread pool and the header only glm, so it runs headless (SketchCPU library target).
+
+
+// Hatching layer of the sketch (lines where sin(params.x * u + params.y * v) > params.z)
+struct HatchLayer
+{
+    glm::vec3 params;       // frequency on u, frequency on v, line threshold
+    float threshold;        // gray threshold (black/white)
+    bool invertBackground;  // white background with black lines
+};
+
+
+// Radius from which the Auto engine switches to the recursive blur (the direct one is faster below)
+const int kRecursiveBlurRadius = 16;
+
+// Hatch line masks kept between the runs (once over, the masks of the other layers are dropped)
+const size_t kHatchMaskCacheSize = 8;
+
+// Blur engine of the CPU gaussian (Auto: direct convolution, recursive from kRecursiveBlurRadius)
+enum class BlurEngine
+{
+    Auto,
+    Direct,     // exact truncated kernel, cost grows with the radius
+    Recursive,  // IIR approximation (Young - van Vliet), constant cost per pixel
+    Box         // 3 integer box passes, coarsest and fastest (previews), never chosen by Auto
+};
+
+// Arithmetic of the CPU stages
+enum class Precision
+{
+    Float,  // u8 -> float -> u8 at every stage (truncated stores)
+    Fixed   // integer only: Q0.16 weights and luma, u16 accumulators, rounded saturating stores
+};
+
+
+class SketchPipeline
+{
+public:
+	// Image kept in host memory (resolution.x * resolution.y RGBA8 pixels, row after row)
+    struct Image
+    {
+        PixelBuffer pixels;
+        glm::ivec2 resolution;
+        uint64_t version;   // changes every time the image is written
+        uint64_t content;   // hash of the pixels (inputs) or of the recipe (outputs): same content, same pixels
+        std::string recipe; // stage, parameters and input contents it was computed from (empty for the inputs)
+    };
+
+	// Stage of a pipeline graph, it runs once the stages producing its inputs are done
+    struct Stage
+    {
+        std::vector<std::string> inputs;    // images read (stored, or produced by other stages)
+        std::vector<std::string> outputs;   // images written (by this stage only)
+        std::function<void()> run;          // the stage call(s)
+    };
+
+	// Buffers of the images produced by a graph run: the images whose lifetimes (from their producer to their last
+	// consumer) do not overlap share a slot, the images not requested are released after their last consumer and
+	// their buffer is written by the next image of their slot
+    struct BufferPlan
+    {
+        std::vector<size_t> order;                      // stages in the order of the plan (topological)
+        std::vector<std::vector<size_t>> after;         // stages each stage waits for, previous users of its slots
+        std::vector<std::string> transient;             // images released once used
+        std::vector<std::vector<size_t>> releases;      // transient images (indices) each stage is a user of
+        std::map<std::string, size_t> slots;            // slot of each produced image
+        std::vector<size_t> slotBytes;                  // bytes of each slot
+        size_t peakBytes;                               // bytes of the slots: produced images alive at once (planned)
+        size_t unplannedBytes;                          // bytes of every produced image (all kept alive)
+        size_t measuredPeakBytes;                       // high-water mark of the arena during the run (measured)
+        size_t slotReuses;                              // images written into the buffer released in their slot
+    };
+
+    SketchPipeline(size_t threadCount = std::thread::hardware_concurrency(), Affinity affinity = Affinity::None);
+    ~SketchPipeline();
+
+	// Select the arithmetic of the blur, luma and hatching stages (the recursive blur stays in float).
+    void SetPrecision(Precision mode);
+    Precision GetPrecision() const;
+	// Select how long the idle workers stay hot before they sleep (kLatencyIdle for interactive previews).
+    void SetIdlePolicy(const IdlePolicy& policy);
+    IdlePolicy GetIdlePolicy() const;
+	// Keep the stage outputs across the runs in memory and optionally on disk (0 bytes / no directory: disabled).
+    void SetCache(size_t memoryBytes, const std::string& directory = std::string(), size_t diskBytes = 0);
+    StageCache::Stats GetCacheStats() const;
+	// Release the graph images that are not requested once used, their buffers written by the next images of
+	// their slots (memory bound batch runs of large images; see SetBufferPlanning for the next runs).
+    void SetBufferPlanning(bool enabled);
+	// Plan of the last graph run with buffer planning (planned and measured peak footprint).
+    BufferPlan GetBufferPlan() const;
+	// Usage of the arena of the stage buffers, and release of the buffers it keeps for the next runs.
+    BufferArena::Stats GetMemoryStats() const;
+    void TrimMemory();
+
+	// Store an input image (width * height RGBA8 pixels, copied / moved).
+    void SetImage(const std::string& name, glm::ivec2 resolution, const unsigned char* pixels);
+    void SetImage(const std::string& name, glm::ivec2 resolution, PixelBuffer&& pixels);
+	// Uninitialized buffer of an image from the arena of the pipeline (e.g. read back into, then given to SetImage).
+    PixelBuffer NewImage(glm::ivec2 resolution);
+	// Image stored under a name (nullptr if none).
+    const Image* FindImage(const std::string& name) const;
+	// Drop an image (its source changed).
+    void EraseImage(const std::string& name);
+	// Forget what every image was computed from, the next run of each stage recomputes it.
+    void Invalidate();
+
+	// Apply edge detection and binarization to the input image.
+    void EdgeBinarize(
+        const std::string& inputName,
+        const std::string& outputName,
+        glm::ivec2 resolution,
+        float threshold,
+        int startRow, int endRow);
+	// Apply horizontal gaussian blur to the input image.
+    void Horizontal(
+        const std::string& inputName,
+        const std::string& outputName,
+        glm::ivec2 resolution,
+        int radius, float sigma,
+        int startRow, int endRow,
+        BlurEngine engine = BlurEngine::Auto);
+	// Apply vertical gaussian blur to the input image.
+    void Vertical(
+        const std::string& inputName,
+        const std::string& outputName,
+        glm::ivec2 resolution,
+        int radius, float sigma,
+        int startRow, int endRow,
+        BlurEngine engine = BlurEngine::Auto);
+	// Apply hatching to the input image using the specified parameters.
+    void Hatching(
+        const std::string& inputName,
+        const std::string& outputName,
+        glm::ivec2 resolution,
+        glm::vec3 hatchParams,
+        float threshold, bool invertBackground);
+	// Combine the input images (per channel minimum).
+    void Combine(
+        const std::vector<std::string>& inputNames,
+        const std::string& outputName,
+        glm::ivec2 resolution);
+	// Run the whole pipeline fused on bands of rows, only the final sketch is produced (same as the staged one).
+    void Streaming(
+        const std::string& inputName,
+        const std::string& outputName,
+        glm::ivec2 resolution,
+        int radius, float sigma,
+        float thresholdSobel,
+        const std::vector<HatchLayer>& layers,
+        BlurEngine engine = BlurEngine::Auto);
+	// Run the whole pipeline on single channel luma planes, the requested stage images are produced (all if empty).
+    void Luma(
+        const std::string& inputName,
+        const std::vector<std::string>& outputNames,
+        glm::ivec2 resolution,
+        int radius, float sigma,
+        float thresholdSobel,
+        const std::vector<HatchLayer>& layers,
+        BlurEngine engine = BlurEngine::Auto,
+        const std::vector<std::string>& requested = std::vector<std::string>());
+	// Run the stages of the staged pipeline the requested images depend on (all if empty) as a graph.
+    void Staged(
+        const std::string& inputName,
+        const std::vector<std::string>& outputNames,
+        glm::ivec2 resolution,
+        int radius, float sigma,
+        float thresholdSobel,
+        const std::vector<HatchLayer>& layers,
+        BlurEngine engine = BlurEngine::Auto,
+        const std::vector<std::string>& requested = std::vector<std::string>());
+	// Run stages as a dependency graph (no barrier between the stages, only the whole graph is awaited),
+	// only the ones the requested images depend on if any is given (the others are released if planned).
+    void RunGraph(const std::vector<Stage>& stages,
+        const std::vector<std::string>& requested = std::vector<std::string>());
+
+private:
+	// Compute the weight of the pixel at the specified position.
+    float Weight(int mu, float sigma) const;
+	// Compute the normalized weights of the gaussian kernel.
+    std::vector<float> GaussianKernel(int radius, float sigma) const;
+	// Lifetimes and shared slots of the images produced by stages (pulled), the ones not requested are transient.
+    BufferPlan PlanBuffers(const std::vector<Stage>& stages, const std::vector<std::string>& requested) const;
+	// Resolve the Auto blur engine from the radius.
+    BlurEngine SelectEngine(BlurEngine engine, int radius) const;
+	// Rows per chunk of a stage reading halo extra rows per chunk (auto tuned, large enough to amortize the halo).
+    int BandGrain(TaskId id, int count, int halo) const;
+	// Line masks of the hatching layers, computed in parallel the first time a (resolution, params) is seen
+	// (shared: a mask dropped from the cache stays valid for the stages still holding it).
+    std::vector<std::shared_ptr<const BitBuffer>> HatchMasks(glm::ivec2 resolution, const std::vector<HatchLayer>& layers);
+	// Input image of a stage, nullptr (and an error) if it is missing or of another resolution.
+    const Image* Input(const std::string& name, glm::ivec2 resolution) const;
+	// Remove an image and hand its buffer over (empty if none).
+    PixelBuffer TakeImage(const std::string& name);
+	// Uninitialized stage buffer, the planned slot of the graph stage running (see RunGraph) or a block of the arena,
+	// its pages placed on the NUMA nodes of the workers (see ThreadPool::Place).
+    PixelBuffer StageBuffer(size_t bytes);
+    BitBuffer StageBits(size_t words);
+	// Clear the rows of an output outside of the rows [startRow, endRow) a stage writes.
+    void ClearRows(PixelBuffer& pixels, glm::ivec2 resolution, int startRow, int endRow) const;
+	// Hash of the pixels and the resolution of an input, computed in parallel on fixed blocks (same hash whatever
+	// the thread count).
+    uint64_t Content(const PixelBuffer& pixels, glm::ivec2 resolution);
+	// true if every output was computed from this recipe, the stage has nothing to recompute.
+    bool UpToDate(const std::vector<std::string>& outputNames, const std::string& recipe) const;
+	// Publish the output of a stage found in the cache, false on a miss (role: index of the output of the stage).
+    bool Restore(const std::string& name, glm::ivec2 resolution, const std::string& recipe, int role = 0);
+	// Keep the output of a stage (the buffer is moved, not copied) with the recipe it was computed from.
+    void Publish(const std::string& name, glm::ivec2 resolution, PixelBuffer&& pixels,
+        const std::string& recipe, int role = 0);
+
+private:
+	// Planes of the last Luma run, each with the recipe of the step that computed it (empty: not valid)
+    struct LumaPlanes
+    {
+        glm::ivec2 resolution;
+        PixelBuffer horizontal, vertical;           // blur planes, 1 byte per pixel
+        BitBuffer edges, combinedHatch, sketch;     // packed bit planes
+        std::vector<BitBuffer> hatches;             // one per hatching layer
+        std::string horizontalRecipe, verticalRecipe, edgesRecipe, combinedRecipe, sketchRecipe;
+        std::vector<std::string> hatchRecipes;
+
+        LumaPlanes() : resolution(0, 0) {}
+    };
+
+    ThreadPool pool;
+    Precision precision;
+	// Blocks of the stage buffers, bit planes and images, kept for the next ones (declared before the masks and
+	// the images: released after them)
+    BufferArena arena;
+	// Hatch line masks (packed bits, CPU_Kernels::BitWords per row) keyed by (width, height, hatch parameters)
+    std::map<std::tuple<int, int, float, float, float>, std::shared_ptr<const BitBuffer>> hatchMasks;
+    std::mutex masksMutex;
+	// Planes of the last Luma run, its steps whose recipe did not change are skipped by the next one
+    LumaPlanes lumaPlanes;
+    std::mutex lumaMutex;
+	// Host images keyed by name (the map is guarded, the pixels are owned by the stage writing them)
+    std::unordered_map<std::string, Image> images;
+    uint64_t versions;
+    mutable std::mutex imagesMutex;
+	// Stage outputs keyed by their content (disabled until SetCache)
+    StageCache cache;
+	// Buffer planning of the graph runs (disabled by default) and the plan of the last one
+    bool planBuffers;
+    BufferPlan lastPlan;
+    mutable std::mutex planMutex;
+};
+
+#endif // SKETCH_PIPELINE_H
@@ -0,0 +1,485 @@
+#include "StageCache.h"
+
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <atomic>
+#include <iostream>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <utime.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+using namespace std;
+
+
+namespace
+{
+    // Odd 64 bit constants of the hash rounds (from xxHash64)
+    const uint64_t kPrime1 = 11400714785074694791ULL;
+    const uint64_t kPrime2 = 14029467366897019727ULL;
+    const uint64_t kPrime3 = 1609587929392839161ULL;
+    const uint64_t kPrime4 = 9650029242287828579ULL;
+    const uint64_t kPrime5 = 2870177450012600261ULL;
+
+    inline uint64_t Rotate(uint64_t x, int r)
+    {
+        return (x << r) | (x >> (64 - r));
+    }
+
+    inline uint64_t Read64(const unsigned char* p)
+    {
+        uint64_t value;
+        memcpy(&value, p, sizeof(value));
+        return value;
+    }
+
+    inline uint64_t Round(uint64_t lane, uint64_t input)
+    {
+        return Rotate(lane + input * kPrime2, 31) * kPrime1;
+    }
+
+    inline uint64_t Merge(uint64_t hash, uint64_t lane)
+    {
+        return (hash ^ Round(0, lane)) * kPrime1 + kPrime4;
+    }
+
+    // Header of a blob file, followed by the pixels
+    struct BlobHeader
+    {
+        char magic[4];
+        uint32_t reserved;
+        uint64_t key;
+        uint64_t size;
+    };
+    const char kBlobMagic[4] = { 'S', 'K', 'C', '1' };
+
+    int64_t Now()
+    {
+        return static_cast<int64_t>(time(nullptr));
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: HashBytes
+// Description: 64 bit hash of a buffer (the xxHash64 scheme: 4 independent lanes of multiply / rotate rounds over
+//              32 bytes per step, so the loop runs at memory speed, then the tail and an avalanche). Words are read
+//              in the byte order of the machine: the keys of a disk cache are only shared by machines of the same
+//              endianness.
+// Parameters:
+//   - data: Bytes to hash.
+//   - size: Number of bytes.
+//   - seed: Seed, a previous hash to chain buffers.
+// Returns:
+//   - The hash.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+uint64_t HashBytes(const void* data, size_t size, uint64_t seed)
+{
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    const unsigned char* end = p + size;
+    uint64_t hash;
+
+    if (size >= 32)
+    {
+        uint64_t v1 = seed + kPrime1 + kPrime2;
+        uint64_t v2 = seed + kPrime2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - kPrime1;
+        for (; p + 32 <= end; p += 32)
+        {
+            v1 = Round(v1, Read64(p));
+            v2 = Round(v2, Read64(p + 8));
+            v3 = Round(v3, Read64(p + 16));
+            v4 = Round(v4, Read64(p + 24));
+        }
+        hash = Rotate(v1, 1) + Rotate(v2, 7) + Rotate(v3, 12) + Rotate(v4, 18);
+        hash = Merge(Merge(Merge(Merge(hash, v1), v2), v3), v4);
+    }
+    else
+    {
+        hash = seed + kPrime5;
+    }
+    hash += size;
+
+    for (; p + 8 <= end; p += 8)
+    {
+        hash = Rotate(hash ^ Round(0, Read64(p)), 27) * kPrime1 + kPrime4;
+    }
+    if (p + 4 <= end)
+    {
+        uint32_t value;
+        memcpy(&value, p, sizeof(value));
+        hash = Rotate(hash ^ (value * kPrime1), 23) * kPrime2 + kPrime3;
+        p += 4;
+    }
+    for (; p < end; ++p)
+    {
+        hash = Rotate(hash ^ (*p * kPrime5), 11) * kPrime1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= kPrime2;
+    hash ^= hash >> 29;
+    hash *= kPrime3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+
+StageCache::StageCache()
+    : memoryBudget(0), memoryBytes(0), diskBudget(0), diskBytes(0), stats() {}
+
+StageCache::~StageCache() {}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: SetMemoryBudget
+// Description: Bytes of outputs the memory tier keeps, the least recently used outputs are dropped first.
+// Parameters:
+//   - bytes: Budget of the memory tier (0: disabled, every output dropped).
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void StageCache::SetMemoryBudget(size_t bytes)
+{
+    lock_guard<std::mutex> lock(cacheMutex);
+    memoryBudget = bytes;
+    Keep(0, nullptr);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: SetDisk
+// Description: Enables the disk tier: one blob file per output (a small header and the pixels) named by its key,
+//              mapped on a hit. The blobs already in the directory (earlier runs, other processes) are indexed and
+//              the least recently used ones (file modification time) are removed over the budget. POSIX only.
+// Parameters:
+//   - path: Directory of the blobs (created if missing), empty to disable the disk tier.
+//   - bytes: Budget of the disk tier.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void StageCache::SetDisk(const string& path, size_t bytes)
+{
+    lock_guard<std::mutex> lock(cacheMutex);
+    directory.clear();
+    blobs.clear();
+    diskBytes = 0;
+    diskBudget = bytes;
+    if (path.empty())
+    {
+        return;
+    }
+
+#if defined(_WIN32)
+    cerr << "[Error]: The disk stage cache needs POSIX memory maps, only the memory tier is enabled." << endl;
+#else
+    if (mkdir(path.c_str(), 0755) != 0 && errno != EEXIST)
+    {
+        cerr << "[Error]: Stage cache directory '" << path << "' cannot be created." << endl;
+        return;
+    }
+    DIR* listing = opendir(path.c_str());
+    if (listing == nullptr)
+    {
+        cerr << "[Error]: Stage cache directory '" << path << "' cannot be read." << endl;
+        return;
+    }
+    directory = path;
+
+    while (dirent* file = readdir(listing))
+    {
+        const string name = file->d_name;
+        unsigned long long key;
+        struct stat info;
+        if (name.size() != 21 || name.compare(16, 5, ".blob") != 0 || sscanf(name.c_str(), "%16llx", &key) != 1 ||
+            stat((directory + "/" + name).c_str(), &info) != 0)
+        {
+            continue;
+        }
+        Blob blob = { static_cast<size_t>(info.st_size), static_cast<int64_t>(info.st_mtime) };
+        blobs[key] = blob;
+        diskBytes += blob.bytes;
+    }
+    closedir(listing);
+    EvictDisk();
+#endif
+}
+
+
+bool StageCache::Enabled() const
+{
+    lock_guard<std::mutex> lock(cacheMutex);
+    return memoryBudget > 0 || !directory.empty();
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: Find
+// Description: Looks an output up, in memory then on disk. The pixels are copied out of the cache (outside of its
+//              lock), a disk hit maps the blob and is kept in the memory tier for the next lookups.
+// Parameters:
+//   - key: Key of the output.
+//   - size: Expected size of the pixels (a blob of another size is a miss).
+//   - pixels: Buffer of size bytes, the pixels of the output on a hit.
+// Returns:
+//   - true on a hit.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool StageCache::Find(uint64_t key, size_t size, unsigned char* pixels)
+{
+    shared_ptr<const vector<unsigned char>> cached;
+    bool onDisk = false;
+    size_t budget = 0;
+    {
+        lock_guard<std::mutex> lock(cacheMutex);
+        budget = memoryBudget;
+        auto entry = entries.find(key);
+        if (entry != entries.end() && entry->second->pixels->size() == size)
+        {
+            recent.splice(recent.begin(), recent, entry->second);
+            cached = entry->second->pixels;
+            ++stats.memoryHits;
+        }
+        else
+        {
+            onDisk = !directory.empty() && blobs.count(key) != 0;
+        }
+    }
+
+    if (cached)
+    {
+        memcpy(pixels, cached->data(), size);
+        return true;
+    }
+
+    if (onDisk && Load(key, size, pixels))
+    {
+        shared_ptr<const vector<unsigned char>> kept;
+        if (size <= budget)
+        {
+            kept = make_shared<const vector<unsigned char>>(pixels, pixels + size);
+        }
+
+        lock_guard<std::mutex> lock(cacheMutex);
+        ++stats.diskHits;
+        auto blob = blobs.find(key);
+        if (blob != blobs.end())
+        {
+            blob->second.lastUse = Now();
+#if !defined(_WIN32)
+            utime(BlobPath(key).c_str(), nullptr);
+#endif
+        }
+        if (kept && entries.find(key) == entries.end())
+        {
+            Keep(key, kept);
+        }
+        return true;
+    }
+
+    lock_guard<std::mutex> lock(cacheMutex);
+    ++stats.misses;
+    return false;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: Store
+// Description: Keeps the pixels of an output in the enabled tiers (copied and written outside of the lock, so the
+//              concurrent stages of a graph do not wait for each other). An output already cached is only marked
+//              as recently used.
+// Parameters:
+//   - key: Key of the output.
+//   - pixels: Pixels of the output.
+//   - size: Number of bytes.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void StageCache::Store(uint64_t key, const unsigned char* pixels, size_t size)
+{
+    bool keep = false;
+    bool save = false;
+    {
+        lock_guard<std::mutex> lock(cacheMutex);
+        auto entry = entries.find(key);
+        if (entry != entries.end())
+        {
+            recent.splice(recent.begin(), recent, entry->second);
+        }
+        else
+        {
+            keep = size <= memoryBudget;
+        }
+        save = !directory.empty() && blobs.count(key) == 0 && sizeof(BlobHeader) + size <= diskBudget;
+    }
+
+    shared_ptr<const vector<unsigned char>> kept;
+    if (keep)
+    {
+        kept = make_shared<const vector<unsigned char>>(pixels, pixels + size);
+    }
+    save = save && Save(key, pixels, size);
+
+    lock_guard<std::mutex> lock(cacheMutex);
+    if (kept && entries.find(key) == entries.end())
+    {
+        Keep(key, kept);
+    }
+    if (save && blobs.count(key) == 0)
+    {
+        Blob blob = { sizeof(BlobHeader) + size, Now() };
+        blobs[key] = blob;
+        diskBytes += blob.bytes;
+        EvictDisk();
+    }
+}
+
+
+StageCache::Stats StageCache::GetStats() const
+{
+    lock_guard<std::mutex> lock(cacheMutex);
+    Stats current = stats;
+    current.memoryBytes = memoryBytes;
+    current.diskBytes = diskBytes;
+    return current;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: Keep
+// Description: Inserts an output at the front of the memory tier (if any) and drops the least recently used ones
+//              until the tier fits its budget.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void StageCache::Keep(uint64_t key, const shared_ptr<const vector<unsigned char>>& pixels)
+{
+    if (pixels)
+    {
+        Entry entry = { key, pixels };
+        recent.push_front(entry);
+        entries[key] = recent.begin();
+        memoryBytes += pixels->size();
+    }
+
+    while (memoryBytes > memoryBudget && !recent.empty())
+    {
+        memoryBytes -= recent.back().pixels->size();
+        entries.erase(recent.back().key);
+        recent.pop_back();
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: Load / Save
+// Description: Blob files of the disk tier. A blob is written to a temporary file renamed once complete, so another
+//              process never maps a partial blob; it is read by mapping the file and copying its pixels.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool StageCache::Load(uint64_t key, size_t size, unsigned char* pixels) const
+{
+#if defined(_WIN32)
+    (void)key;
+    (void)size;
+    (void)pixels;
+    return false;
+#else
+    const int file = open(BlobPath(key).c_str(), O_RDONLY);
+    if (file < 0)
+    {
+        return false;
+    }
+
+    struct stat info;
+    const size_t bytes = sizeof(BlobHeader) + size;
+    void* mapped = MAP_FAILED;
+    if (fstat(file, &info) == 0 && static_cast<size_t>(info.st_size) == bytes)
+    {
+        mapped = mmap(nullptr, bytes, PROT_READ, MAP_PRIVATE, file, 0);
+    }
+    close(file);
+    if (mapped == MAP_FAILED)
+    {
+        return false;
+    }
+
+    const unsigned char* blob = static_cast<const unsigned char*>(mapped);
+    BlobHeader header;
+    memcpy(&header, blob, sizeof(header));
+    const bool valid = memcmp(header.magic, kBlobMagic, sizeof(kBlobMagic)) == 0 && header.key == key && header.size == size;
+    if (valid)
+    {
+        madvise(mapped, bytes, MADV_SEQUENTIAL);
+        memcpy(pixels, blob + sizeof(header), size);
+    }
+    munmap(mapped, bytes);
+    return valid;
+#endif
+}
+
+
+bool StageCache::Save(uint64_t key, const unsigned char* pixels, size_t size) const
+{
+#if defined(_WIN32)
+    (void)key;
+    (void)pixels;
+    (void)size;
+    return false;
+#else
+    static atomic<unsigned> saves(0);
+    const string path = BlobPath(key);
+    const string temporary = path + "." + to_string(getpid()) + "." + to_string(saves++) + ".tmp";
+
+    FILE* file = fopen(temporary.c_str(), "wb");
+    if (file == nullptr)
+    {
+        return false;
+    }
+
+    BlobHeader header = {};
+    memcpy(header.magic, kBlobMagic, sizeof(kBlobMagic));
+    header.key = key;
+    header.size = size;
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1 &&
+        (size == 0 || fwrite(pixels, size, 1, file) == 1);
+    written = fclose(file) == 0 && written;
+
+    if (!written || rename(temporary.c_str(), path.c_str()) != 0)
+    {
+        remove(temporary.c_str());
+        cerr << "[Error]: Stage cache blob '" << path << "' cannot be written." << endl;
+        return false;
+    }
+    return true;
+#endif
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Function: EvictDisk
+// Description: Removes the least recently used blobs until the disk tier fits its budget.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void StageCache::EvictDisk()
+{
+    while (diskBytes > diskBudget && !blobs.empty())
+    {
+        auto oldest = blobs.begin();
+        for (auto blob = blobs.begin(); blob != blobs.end(); ++blob)
+        {
+            if (blob->second.lastUse < oldest->second.lastUse)
+            {
+                oldest = blob;
+            }
+        }
+        remove(BlobPath(oldest->first).c_str());
+        diskBytes -= oldest->second.bytes;
+        blobs.erase(oldest);
+    }
+}
+
+
+string StageCache::BlobPath(uint64_t key) const
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.blob", static_cast<unsigned long long>(key));
+    return directory + "/" + name;
+}
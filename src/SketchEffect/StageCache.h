@@ -0,0 +1,96 @@
+#pragma once
+
+#ifndef STAGE_CACHE_H
+#define STAGE_CACHE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+/// Content addressed cache of the stage outputs, kept across the runs of a pipeline (and across the processes
+/// sharing a disk directory). An output is keyed by the hash of what it is computed from: the content of the
+/// input pixels and the stage parameters, never the image names, so the same asset processed again with the
+/// same settings finds its outputs whatever it is called.
+
+
+// 64 bit hash of a buffer (4 lanes of multiply / rotate rounds on 32 bytes per step), chained through seed
+uint64_t HashBytes(const void* data, size_t size, uint64_t seed = 0);
+
+
+class StageCache
+{
+public:
+	// Hits and misses since the cache was created, bytes held by each tier
+    struct Stats
+    {
+        size_t memoryHits;
+        size_t diskHits;
+        size_t misses;
+        size_t memoryBytes;
+        size_t diskBytes;
+    };
+
+    StageCache();
+    ~StageCache();
+
+	// Bytes of outputs kept in memory (the least recently used are dropped first), 0 disables the memory tier.
+    void SetMemoryBudget(size_t bytes);
+	// Directory of the disk tier (one memory mapped blob per output) and its bytes, an empty directory disables it.
+    void SetDisk(const std::string& path, size_t bytes);
+	// true if a tier is enabled (the stages then look their outputs up before computing them).
+    bool Enabled() const;
+
+	// Copy the size bytes of an output to pixels, false on a miss (or another size). A disk hit is kept in memory.
+    bool Find(uint64_t key, size_t size, unsigned char* pixels);
+	// Keep the pixels of an output under its key (copied), in memory and on disk.
+    void Store(uint64_t key, const unsigned char* pixels, size_t size);
+
+    Stats GetStats() const;
+
+private:
+	// Output in memory, the list is ordered from the most to the least recently used
+    struct Entry
+    {
+        uint64_t key;
+        std::shared_ptr<const std::vector<unsigned char>> pixels;
+    };
+
+	// Output on disk
+    struct Blob
+    {
+        size_t bytes;       // file size (header included)
+        int64_t lastUse;    // seconds, also the modification time of the file (LRU order across processes)
+    };
+
+	// Insert an output in the memory tier and drop the least recently used ones over the budget (lock held).
+    void Keep(uint64_t key, const std::shared_ptr<const std::vector<unsigned char>>& pixels);
+	// Map a blob and copy its pixels, false if it is missing or invalid.
+    bool Load(uint64_t key, size_t size, unsigned char* pixels) const;
+	// Write a blob (to a temporary file renamed once complete), false on failure.
+    bool Save(uint64_t key, const unsigned char* pixels, size_t size) const;
+	// Remove the least recently used blobs over the disk budget (lock held).
+    void EvictDisk();
+    std::string BlobPath(uint64_t key) const;
+
+private:
+    mutable std::mutex cacheMutex;
+
+    size_t memoryBudget;
+    size_t memoryBytes;
+    std::list<Entry> recent;
+    std::unordered_map<uint64_t, std::list<Entry>::iterator> entries;
+
+    std::string directory;
+    size_t diskBudget;
+    size_t diskBytes;
+    std::unordered_map<uint64_t, Blob> blobs;
+
+    Stats stats;
+};
+
+#endif // STAGE_CACHE_H
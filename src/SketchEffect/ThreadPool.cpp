@@ -1,23 +1,391 @@
 #include "ThreadPool.h"
 
 #include <iostream>
-#include <unordered_set>
+#include <unordered_map>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <cstdlib>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#if defined(__linux__)
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
 
 using namespace std;
 
 
+namespace
+{
+    // Names of the tasks of the set, indexed by TaskId
+    const char* const kTaskNames[] =
+    {
+        "COMBINE_IMAGES",
+        "SOBEL_BINARY_EDGE",
+        "HATCHING",
+        "HORIZONTAL_BLUR",
+        "VERTICAL_BLUR",
+        "VERTICAL_RECURSIVE_BLUR",
+        "SKETCH_BAND",
+        "LUMA_PLANE",
+        "EXPAND_PLANE",
+        "HATCH_MASK",
+        "PIPELINE_STAGE",
+        "PARALLEL_REGION",
+        "HASH_IMAGE"
+    };
+    static_assert(sizeof(kTaskNames) / sizeof(kTaskNames[0]) == static_cast<size_t>(TaskId::Count),
+        "One name per task id");
+
+    // Pool and deque of the calling thread when it is a worker (a task adding tasks pushes on its own deque)
+    thread_local ThreadPool* currentPool = nullptr;
+    thread_local size_t currentWorker = 0;
+    // Pool of the task running on the calling thread (a waiting thread, worker or not, runs tasks too)
+    thread_local ThreadPool* runningPool = nullptr;
+    // Checks of a spinning barrier before the thread yields its core (a member preempted in its last chunk)
+    const int kSpinsBeforeYield = 64;
+
+    // Single tasks kept for reuse by a pool (a burst of Async / Add_Task above it frees the extra ones)
+    const size_t kFreeTasks = 1024;
+
+    // Highest NUMA node handled (node masks of one word)
+    const int kMaxNodes = 64;
+
+    // Logical CPU and its place in the machine
+    struct CpuPlace
+    {
+        int cpu;
+        int node;
+        int package;
+        int core;
+        int sibling;    // rank among the SMT siblings of its core
+        int coreRank;   // rank of its core in its NUMA node
+    };
+
+    int ReadInt(const string& path, int fallback)
+    {
+        ifstream file(path);
+        int value;
+        return file >> value ? value : fallback;
+    }
+
+    // CPUs of a sysfs list ("0-3,8-11")
+    vector<int> ReadCpuList(const string& path)
+    {
+        vector<int> cpus;
+        ifstream file(path);
+        string list, range;
+        if (!getline(file, list))
+        {
+            return cpus;
+        }
+
+        stringstream ranges(list);
+        while (getline(ranges, range, ','))
+        {
+            if (range.empty())
+            {
+                continue;
+            }
+            const size_t dash = range.find('-');
+            const int first = atoi(range.c_str());
+            const int last = dash == string::npos ? first : atoi(range.c_str() + dash + 1);
+            for (int cpu = first; cpu <= last; ++cpu)
+            {
+                cpus.push_back(cpu);
+            }
+        }
+        return cpus;
+    }
+
+    // CPUs the workers are pinned to, in the order of the policy (worker t on the CPU t % size)
+    vector<CpuPlace> PlacementOrder(Affinity affinity)
+    {
+        vector<CpuPlace> places;
+#if defined(__linux__)
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        if (affinity == Affinity::None || sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+        {
+            return places;
+        }
+
+        // NUMA node of each CPU (node 0 without the sysfs nodes)
+        unordered_map<int, int> nodeOf;
+        for (int node = 0; node < kMaxNodes; ++node)
+        {
+            for (int cpu : ReadCpuList("/sys/devices/system/node/node" + to_string(node) + "/cpulist"))
+            {
+                nodeOf[cpu] = node;
+            }
+        }
+
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+        {
+            if (!CPU_ISSET(cpu, &allowed))
+            {
+                continue;
+            }
+            const string topology = "/sys/devices/system/cpu/cpu" + to_string(cpu) + "/topology/";
+            CpuPlace place = { cpu, nodeOf.count(cpu) ? nodeOf[cpu] : 0,
+                ReadInt(topology + "physical_package_id", 0), ReadInt(topology + "core_id", cpu), 0, 0 };
+            places.push_back(place);
+        }
+
+        // Compact order, then the ranks of the siblings in their core and of the cores in their node
+        sort(places.begin(), places.end(), [](const CpuPlace& a, const CpuPlace& b)
+        {
+            if (a.node != b.node) return a.node < b.node;
+            if (a.package != b.package) return a.package < b.package;
+            if (a.core != b.core) return a.core < b.core;
+            return a.cpu < b.cpu;
+        });
+        for (size_t i = 1; i < places.size(); ++i)
+        {
+            const CpuPlace& previous = places[i - 1];
+            CpuPlace& place = places[i];
+            if (place.node != previous.node)
+            {
+                continue;
+            }
+            const bool sameCore = place.package == previous.package && place.core == previous.core;
+            place.sibling = sameCore ? previous.sibling + 1 : 0;
+            place.coreRank = sameCore ? previous.coreRank : previous.coreRank + 1;
+        }
+
+        if (affinity == Affinity::Scatter)
+        {
+            stable_sort(places.begin(), places.end(), [](const CpuPlace& a, const CpuPlace& b)
+            {
+                if (a.sibling != b.sibling) return a.sibling < b.sibling;
+                if (a.coreRank != b.coreRank) return a.coreRank < b.coreRank;
+                return a.node < b.node;
+            });
+        }
+        else if (affinity == Affinity::NoSMT)
+        {
+            stable_sort(places.begin(), places.end(), [](const CpuPlace& a, const CpuPlace& b)
+            {
+                return a.sibling < b.sibling;
+            });
+        }
+#endif
+        return places;
+    }
+
+    void PinThread(int cpu)
+    {
+#if defined(__linux__)
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) != 0)
+        {
+            cerr << "[Error]: Worker could not be pinned to CPU " << cpu << "." << endl;
+        }
+#endif
+    }
+
+    // mbind without libnuma: prefer a node for the pages of a range, the pages not touched yet are placed when
+    // they are first touched, the ones already touched (a block recycled by malloc) are moved
+    void PreferNode(uintptr_t first, uintptr_t last, int node)
+    {
+#if defined(__linux__)
+        const int kPreferred = 1;   // MPOL_PREFERRED
+        const unsigned kMove = 2;   // MPOL_MF_MOVE (the pages of this process only)
+        unsigned long mask = 1UL << node;
+        // Best effort: the call fails without NUMA support
+        syscall(SYS_mbind, reinterpret_cast<void*>(first), last - first, kPreferred, &mask, kMaxNodes + 1, kMove);
+#endif
+    }
+
+    // Hint to the core that the thread spins (lets its SMT sibling run, saves power)
+    inline void CpuRelax()
+    {
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+        _mm_pause();
+#elif defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#elif defined(__aarch64__)
+        __asm__ __volatile__("yield");
+#endif
+    }
+
+    // Random state of the steals of the calling thread (0: not seeded yet)
+    thread_local uint32_t stealSeed = 0;
+
+    // xorshift32, victims of the steals
+    uint32_t NextRandom(uint32_t& seed)
+    {
+        if (seed == 0)
+        {
+            seed = static_cast<uint32_t>(hash<thread::id>()(this_thread::get_id())) | 1u;
+        }
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        return seed;
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////
+// Function: WorkDeque
+// Description: Empty deque with a small circular buffer (grown by the owner when full).
+////////////////////////////////////////////////////////////////////////////////////////
+WorkDeque::WorkDeque() : top(0), bottom(0), buffer(nullptr)
+{
+    buffers.emplace_back(new Buffer(64));
+    buffer.store(buffers.back().get(), memory_order_relaxed);
+}
+
+
+WorkDeque::~WorkDeque() {}
+
+
+////////////////////////////////////////////////////////////////////////////////////////
+// Function: Push
+// Description: Pushes a task at the bottom (owner only, no lock, no CAS).
+// Parameters:
+//   - task: Task to be queued.
+////////////////////////////////////////////////////////////////////////////////////////
+void WorkDeque::Push(Task* task)
+{
+    int64_t b = bottom.load(memory_order_relaxed);
+    int64_t t = top.load(memory_order_acquire);
+    Buffer* a = buffer.load(memory_order_relaxed);
+    if (b - t > a->capacity - 1)
+    {
+        a = Grow(a, b, t);
+    }
+    a->Put(b, task);
+    atomic_thread_fence(memory_order_release);
+    bottom.store(b + 1, memory_order_relaxed);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////
+// Function: Pop
+// Description: Pops the last pushed task (owner only), only the last task is raced with
+//              the thieves.
+// Returns:
+//   - The task, nullptr if the deque is empty.
+////////////////////////////////////////////////////////////////////////////////////////
+Task* WorkDeque::Pop()
+{
+    int64_t b = bottom.load(memory_order_relaxed) - 1;
+    Buffer* a = buffer.load(memory_order_relaxed);
+    bottom.store(b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t t = top.load(memory_order_relaxed);
+
+    if (t > b)
+    {
+        bottom.store(b + 1, memory_order_relaxed);
+        return nullptr;
+    }
+
+    Task* task = a->Get(b);
+    if (t == b)
+    {
+        if (!top.compare_exchange_strong(t, t + 1, memory_order_seq_cst, memory_order_relaxed))
+        {
+            task = nullptr; // a thief took it
+        }
+        bottom.store(b + 1, memory_order_relaxed);
+    }
+    return task;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////
+// Function: Steal
+// Description: Takes the oldest task (any thread).
+// Returns:
+//   - The task, nullptr if the deque is empty or another thread took it first.
+////////////////////////////////////////////////////////////////////////////////////////
+Task* WorkDeque::Steal()
+{
+    int64_t t = top.load(memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t b = bottom.load(memory_order_acquire);
+
+    if (t >= b)
+    {
+        return nullptr;
+    }
+
+    Buffer* a = buffer.load(memory_order_acquire);
+    Task* task = a->Get(t);
+    if (!top.compare_exchange_strong(t, t + 1, memory_order_seq_cst, memory_order_relaxed))
+    {
+        return nullptr;
+    }
+    return task;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////
+// Function: Grow
+// Description: Copies the tasks [top, bottom) to a buffer twice as large. The old buffer
+//              is kept until the deque is destroyed, a thief may still read it.
+////////////////////////////////////////////////////////////////////////////////////////
+WorkDeque::Buffer* WorkDeque::Grow(Buffer* a, int64_t b, int64_t t)
+{
+    Buffer* larger = new Buffer(a->capacity * 2);
+    for (int64_t i = t; i < b; ++i)
+    {
+        larger->Put(i, a->Get(i));
+    }
+    buffers.emplace_back(larger);
+    buffer.store(larger, memory_order_release);
+    return larger;
+}
+
+
 ////////////////////////////////////////////////////////////////////////////////////////
 // Function: ThreadPool
-// Description: Constructor that initializes the thread pool with P threads.
+// Description: Constructor that initializes the thread pool with P threads, pinned to
+//              the CPUs in the order of the affinity policy (read from the sysfs topology).
 // Parameters:
 //   - P: Number of threads in the pool.
+//   - affinity: Placement of the workers on the CPUs.
 ////////////////////////////////////////////////////////////////////////////////////////
-ThreadPool::ThreadPool(size_t P)
+ThreadPool::ThreadPool(size_t P, Affinity affinity) :
+    stop(false), injected(0), queued(0), unfinished(0), sleepers(0), helpers(0),
+    idleSpins(kBatchIdle.spins), idleYields(kBatchIdle.yields), idleHot(kBatchIdle.hot.count()),
+    cpus(P, -1), nodes(P, -1), multiNode(false)
 {
+    const vector<CpuPlace> order = PlacementOrder(affinity);
+    for (size_t t_idx = 0; t_idx < P && !order.empty(); ++t_idx)
+    {
+        const CpuPlace& place = order[t_idx % order.size()];
+        cpus[t_idx] = place.cpu;
+        nodes[t_idx] = place.node;
+        multiNode = multiNode || place.node != nodes[0];
+    }
+
+    for (size_t t_idx = 0; t_idx < P; ++t_idx)
+    {
+        deques.emplace_back(new WorkDeque());
+    }
+    for (std::atomic<float>& cost : costs)
+    {
+        cost.store(0.0f, memory_order_relaxed);
+    }
     for (size_t t_idx = 0; t_idx < P; ++t_idx)
     {
-        workers.emplace_back([this] {
-			Schedule_Workers(); // lambda function
+        workers.emplace_back([this, t_idx] {
+            if (cpus[t_idx] >= 0)
+            {
+                PinThread(cpus[t_idx]);
+            }
+			Schedule_Workers(t_idx); // lambda function
         });
     }
 }
@@ -25,12 +393,12 @@ ThreadPool::ThreadPool(size_t P)
 
 ////////////////////////////////////////////////////////////////////////////////////////
 // Function: ThreadPool
-// Description: Destructor that joins all threads in the pool.
+// Description: Destructor that joins all threads in the pool (the queued tasks still run).
 ////////////////////////////////////////////////////////////////////////////////////////
 ThreadPool::~ThreadPool()
 {
     {
-        unique_lock<mutex> lock(mutexT);
+        unique_lock<mutex> lock(sleepMutex);
         stop = true;
     }
     notify.notify_all();
@@ -38,6 +406,97 @@ ThreadPool::~ThreadPool()
     {
         worker.join();
     }
+    for (Task* task : freeTasks)
+    {
+        delete task;
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////
+// Function: Set_Idle_Policy / Get_Idle_Policy
+// Description: Idle phase of the workers and of the threads waiting for a group before
+//              they sleep (see Spin_Idle), applied from their next idle phase.
+// Parameters:
+//   - policy: Spins, yields and hot time of the idle phase.
+////////////////////////////////////////////////////////////////////////////////////////
+void ThreadPool::Set_Idle_Policy(const IdlePolicy& policy)
+{
+    idleSpins.store(policy.spins, memory_order_relaxed);
+    idleYields.store(policy.yields, memory_order_relaxed);
+    idleHot.store(policy.hot.count(), memory_order_relaxed);
+}
+
+
+IdlePolicy ThreadPool::Get_Idle_Policy() const
+{
+    IdlePolicy policy = { idleSpins.load(memory_order_relaxed), idleYields.load(memory_order_relaxed),
+        chrono::microseconds(idleHot.load(memory_order_relaxed)) };
+    return policy;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////
+// Function: Worker_Node
+// Description: NUMA node of the CPU a worker is pinned to.
+// Parameters:
+//   - index: Index of the worker.
+// Returns: Node of the worker, -1 if it is not pinned.
+////////////////////////////////////////////////////////////////////////////////////////
+int ThreadPool::Worker_Node(size_t index) const
+{
+    return index < nodes.size() ? nodes[index] : -1;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////
+// Function: Place
+// Description: Binds the pages of a new buffer to the NUMA nodes of the workers: the
+//              buffer is split in one band per worker and each band prefers the node of
+//              its worker (its pages moved there if already touched). The chunks are
+//              given out dynamically, so a band is not read by its worker only: the pages
+//              of every buffer are spread over the nodes in proportion to their workers,
+//              their memory controllers share the traffic of the stages instead of the
+//              node of the allocating thread serving all of it. Meant for new blocks only
+//              (BufferArena::SetPlacement), a recycled block keeps its placement. Nothing
+//              is done when the workers share a node.
+// Parameters:
+//   - data: Start of the buffer.
+//   - bytes: Size of the buffer.
+////////////////////////////////////////////////////////////////////////////////////////
+void ThreadPool::Place(void* data, size_t bytes) const
+{
+#if defined(__linux__)
+    if (!multiNode || data == nullptr || bytes == 0)
+    {
+        return;
+    }
+
+    const uintptr_t page = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+    const uintptr_t first = reinterpret_cast<uintptr_t>(data) / page * page;
+    const uintptr_t last = (reinterpret_cast<uintptr_t>(data) + bytes + page - 1) / page * page;
+    const uintptr_t band = ((last - first) / page + nodes.size() - 1) / nodes.size() * page;
+
+    // The bands of consecutive workers on the same node are bound at once
+    for (size_t t = 0; t < nodes.size();)
+    {
+        size_t u = t + 1;
+        while (u < nodes.size() && nodes[u] == nodes[t])
+        {
+            ++u;
+        }
+        const uintptr_t start = first + t * band;
+        const uintptr_t end = first + u * band < last ? first + u * band : last;
+        if (start < end)
+        {
+            PreferNode(start, end, nodes[t]);
+        }
+        t = u;
+    }
+#else
+    (void)data;
+    (void)bytes;
+#endif
 }
 
 
@@ -45,16 +504,353 @@ ThreadPool::~ThreadPool()
 // Function: Add_Task
 // Description: Adds a task to the thread pool.
 // Parameters:
-//   - task: Task to be added to the pool (function<void()>).
-//   - name: Optional name for the task to identify it.
+//   - task: Task to be added to the pool (function or lambda, moved).
+//   - name: Name of the task, from the set of tasks (looked up once, see Task_Id).
+////////////////////////////////////////////////////////////////////////////////////////
+void ThreadPool::Add_Task(TaskFunction task, const string& name)
+{
+    TaskId id;
+    if (!Task_Id(name, id))
+    {
+        cerr << "[Error]: Task '" << name << "' is not recognized." << endl;
+        return;
+    }
+    Add_Task(std::move(task), id);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////
+// Function: Add_Task
+// Description: Adds a task of a group to the thread pool, the group counts it until it completes.
+// Parameters:
+//   - task: Task to be added to the pool (function or lambda, moved).
+//   - name: Name of the task, from the set of tasks (looked up once, see Task_Id).
+//   - group: Group awaited with Wait (must stay alive until Wait returns).
+////////////////////////////////////////////////////////////////////////////////////////
+void ThreadPool::Add_Task(TaskFunction task, const string& name, TaskGroup& group)
+{
+    TaskId id;
+    if (!Task_Id(name, id))
+    {
+        cerr << "[Error]: Task '" << name << "' is not recognized." << endl;
+        return;
+    }
+    Add_Task(std::move(task), id, group);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////
+// Function: Add_Task
+// Description: Adds a task to the thread pool (by id: no name lookup, the task is taken
+//              from the free list of the pool, no allocation when its function fits in the
+//              TaskFunction storage).
+// Parameters:
+//   - task: Task to be added to the pool (function or lambda, moved).
+//   - id: Id of the task.
+//   - group: Group awaited with Wait (optional, must stay alive until Wait returns).
+////////////////////////////////////////////////////////////////////////////////////////
+void ThreadPool::Add_Task(TaskFunction task, TaskId id)
+{
+    ++unfinished;
+    Submit(New_Task(std::move(task), id, nullptr), 1);
+}
+
+
+void ThreadPool::Add_Task(TaskFunction task, TaskId id, TaskGroup& group)
+{
+    ++group.pending;
+    ++unfinished;
+    Submit(New_Task(std::move(task), id, &group), 1);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////
+// Function: New_Task / Recycle_Task
+// Description: Single tasks come from a free list of the pool: the tasks completed are
+//              kept (their function destroyed) and handed out again, so a steady flow of
+//              Add_Task / Async allocates nothing once the list is warm. At most
+//              kFreeTasks are kept, the others are deleted.
+// Parameters:
+//   - task: Function of the task (moved), id: id of the task, group: group (optional).
 ////////////////////////////////////////////////////////////////////////////////////////
-void ThreadPool::Add_Task(const function<void()>& task, const string& name)
+Task* ThreadPool::New_Task(TaskFunction task, TaskId id, TaskGroup* group)
+{
+    Task* recycled = nullptr;
+    {
+        lock_guard<mutex> lock(freeMutex);
+        if (!freeTasks.empty())
+        {
+            recycled = freeTasks.back();
+            freeTasks.pop_back();
+        }
+    }
+    if (recycled == nullptr)
+    {
+        return new Task(std::move(task), id, group); // initial state pending
+    }
+
+    recycled->func = std::move(task);
+    recycled->state = TaskState::Pending;
+    recycled->id = id;
+    recycled->group = group;
+    return recycled;
+}
+
+
+void ThreadPool::Recycle_Task(Task* task)
 {
+    // Destroyed here, as a delete would (the function may own the group of its handle, see Async)
+    task->func = TaskFunction();
+    {
+        lock_guard<mutex> lock(freeMutex);
+        if (freeTasks.size() < kFreeTasks)
+        {
+            freeTasks.push_back(task);
+            return;
+        }
+    }
+    delete task;
+}
+
+
+// Shared state of a parallel region: per step, the next chunk to claim and the chunks done
+struct ThreadPool::Region
+{
+    const vector<RegionStep>* steps;
+    vector<int> grains;
+    vector<int> chunks;
+    unique_ptr<atomic<int>[]> next;
+    unique_ptr<atomic<int>[]> done;
+};
+
+
+////////////////////////////////////////////////////////////////////////////////////////
+// Function: Run_Region
+// Description: Runs the steps of a pipeline in one parallel region. Instead of a fork /
+//              join per step (tasks queued, sleeping workers woken, the waiting thread put
+//              to sleep), every member claims the chunks of the current step from an atomic
+//              counter, then spins until all of them are done and goes on with the next step.
+//              The members are the caller and one task per other worker; a worker busy
+//              elsewhere joins the step in progress when it gets the task (a step never
+//              waits for a member, only for its chunks), so the region also completes when
+//              the caller is alone.
+// Parameters:
+//   - steps: Steps of the region, run in order.
+////////////////////////////////////////////////////////////////////////////////////////
+void ThreadPool::Run_Region(const vector<RegionStep>& steps)
+{
+    Region region;
+    region.steps = &steps;
+    region.next.reset(new atomic<int>[steps.size()]);
+    region.done.reset(new atomic<int>[steps.size()]);
+    for (size_t s = 0; s < steps.size(); ++s)
+    {
+        const RegionStep& step = steps[s];
+        const int count = step.end > step.begin ? step.end - step.begin : 0;
+        int grain = step.grain <= kAutoGrain ? Auto_Grain(step.id, count) : step.grain;
+        grain = grain < 1 ? 1 : grain;
+        region.grains.push_back(grain);
+        region.chunks.push_back((count + grain - 1) / grain);
+        region.next[s].store(0, memory_order_relaxed);
+        region.done[s].store(0, memory_order_relaxed);
+    }
+
+    // One member per other worker, queued at once (the members starting after the last step leave at once)
+    const int others = static_cast<int>(workers.size()) - (currentPool == this ? 1 : 0);
+    auto MEMBER = [this, &region](int, int) { Join_Region(region); };
+    TaskGroup members;
+    Parallel_For(0, others, 1, MEMBER, TaskId::ParallelRegion, members);
+
+    Join_Region(region);
+    Wait(members);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////
+// Function: Join_Region
+// Description: Takes part in a parallel region: claims the chunks of each step, then waits
+//              for the step on a spinning barrier (yielding after kSpinsBeforeYield checks).
+// Parameters:
+//   - region: Region joined.
+////////////////////////////////////////////////////////////////////////////////////////
+void ThreadPool::Join_Region(Region& region)
+{
+    const vector<RegionStep>& steps = *region.steps;
+    for (size_t s = 0; s < steps.size(); ++s)
+    {
+        const RegionStep& step = steps[s];
+        const int grain = region.grains[s];
+        const int chunks = region.chunks[s];
+
+        for (int c = region.next[s].fetch_add(1, memory_order_relaxed); c < chunks;
+            c = region.next[s].fetch_add(1, memory_order_relaxed))
+        {
+            const int start = step.begin + c * grain;
+            const int stop = step.end - start > grain ? start + grain : step.end;
+
+            const chrono::steady_clock::time_point begin = chrono::steady_clock::now();
+            step.fn(start, stop);
+            Record_Cost(step.id, stop - start, chrono::duration_cast<chrono::nanoseconds>(
+                chrono::steady_clock::now() - begin).count());
+
+            // Publishes the rows written by the chunk to the members reading them in the next steps
+            region.done[s].fetch_add(1, memory_order_release);
+        }
+
+        for (int spin = 0; region.done[s].load(memory_order_acquire) < chunks; ++spin)
+        {
+            if (spin >= kSpinsBeforeYield)
+            {
+                this_thread::yield();
+            }
+            else
+            {
+                CpuRelax();
+            }
+        }
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////
+// Function: Task_Id / Task_Name
+// Description: Interned task names: the id of a name of the set (false if it is not from
+//              the set), the name of an id.
+////////////////////////////////////////////////////////////////////////////////////////
+bool ThreadPool::Task_Id(const string& name, TaskId& id)
+{
+    static const unordered_map<string, TaskId> ids = [] {
+        unordered_map<string, TaskId> names;
+        for (size_t i = 0; i < static_cast<size_t>(TaskId::Count); ++i)
+        {
+            names[kTaskNames[i]] = static_cast<TaskId>(i);
+        }
+        return names;
+    }();
+
+    auto found = ids.find(name);
+    if (found == ids.end())
+    {
+        return false;
+    }
+    id = found->second;
+    return true;
+}
+
+
+const char* ThreadPool::Task_Name(TaskId id)
+{
+    return id < TaskId::Count ? kTaskNames[static_cast<size_t>(id)] : "";
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////
+// Function: Auto_Grain
+// Description: Chunk size of a Parallel_For: about kChunkNanoseconds of work per chunk at
+//              the cost per element measured on the previous chunks of the task, so cheap
+//              elements (pixels) get large chunks and costly ones (rows of a wide blur)
+//              small ones. At least kChunksPerWorker chunks per worker, the faster workers
+//              steal the chunks of the slower ones; before any measure, exactly that many.
+// Parameters:
+//   - id: Id of the task.
+//   - count: Number of elements of the range.
+// Returns:
+//   - The number of elements per chunk (>= 1).
+////////////////////////////////////////////////////////////////////////////////////////
+int ThreadPool::Auto_Grain(TaskId id, int count) const
+{
+    const int chunks = static_cast<int>(workers.size()) * kChunksPerWorker;
+    const int largest = count > chunks ? (count + chunks - 1) / chunks : 1;
+
+    const float cost = costs[static_cast<size_t>(id)].load(memory_order_relaxed);
+    if (cost <= 0.0f)
+    {
+        return largest;
+    }
+
+    const float grain = kChunkNanoseconds / cost;
+    if (grain < 1.0f)
+    {
+        return 1;
+    }
+    return grain < largest ? static_cast<int>(grain) : largest;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////
+// Function: Record_Cost
+// Description: Moving average of the cost per element of a task (a chunk slowed down by
+//              preemption or a slow core only moves it by 1/8). Concurrent updates may
+//              drop a sample, the estimate stays valid.
+// Parameters:
+//   - id: Id of the task.
+//   - elements: Number of elements of the chunk.
+//   - nanoseconds: Duration of the chunk.
+////////////////////////////////////////////////////////////////////////////////////////
+void ThreadPool::Record_Cost(TaskId id, int elements, int64_t nanoseconds)
+{
+    if (elements <= 0)
+    {
+        return;
+    }
+
+    const float sample = static_cast<float>(nanoseconds) / elements;
+    atomic<float>& cost = costs[static_cast<size_t>(id)];
+    const float previous = cost.load(memory_order_relaxed);
+    cost.store(previous > 0.0f ? previous + (sample - previous) * 0.125f : sample, memory_order_relaxed);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////
+// Function: Submit
+// Description: Queues tasks. A worker adding tasks pushes them on its own deque without
+//              any lock, the other threads add them to the injection queue (one lock for
+//              all of them, no contention with the workers running tasks). The sleeping
+//              workers are woken once.
+// Parameters:
+//   - first: First task to be queued (owned by the pool until it ran).
+//   - count: Number of tasks, contiguous from first.
+////////////////////////////////////////////////////////////////////////////////////////
+void ThreadPool::Submit(Task* first, size_t count)
+{
+    if (currentPool == this)
+    {
+        for (size_t t = 0; t < count; ++t)
+        {
+            deques[currentWorker]->Push(first + t);
+        }
+    }
+    else
     {
-        unique_lock<mutex> lock(mutexT);
-        tasks.emplace(task, name); // initial state pending
+        lock_guard<mutex> lock(mutexT);
+        for (size_t t = 0; t < count; ++t)
+        {
+            tasks.push_back(first + t);
+        }
+        injected += count;
+    }
+
+    // Counted once visible, a worker seeing queued > 0 finds them
+    queued += count;
+    if (sleepers.load() > 0)
+    {
+        // The workers are either waiting or still checking queued under the mutex
+        { lock_guard<mutex> lock(sleepMutex); }
+        if (count == 1)
+        {
+            notify.notify_one();
+        }
+        else
+        {
+            notify.notify_all();
+        }
+    }
+    if (helpers.load() > 0)
+    {
+        // A waiting thread may run them too
+        { lock_guard<mutex> lock(doneMutex); }
+        complete.notify_all();
     }
-    notify.notify_one();
 }
 
 
@@ -64,68 +860,248 @@ void ThreadPool::Add_Task(const function<void()>& task, const string& name)
 ////////////////////////////////////////////////////////////////////////////////////////
 void ThreadPool::Free_Resource()
 {
-    unique_lock<mutex> lock(mutexT);
-    complete.wait(lock, [this] {
+    if (runningPool == this)
+    {
+        // The calling task is one of the unfinished tasks
+        cerr << "[Error]: Free_Resource called from a task of the pool, wait for a TaskGroup instead." << endl;
+        return;
+    }
+
+    Help([this] {
         // all tasks are completed
-        return tasks.empty() && P == 0;
+        return unfinished.load() == 0;
     });
 }
 
 
 ////////////////////////////////////////////////////////////////////////////////////////
-// Function: Schedule_Workers
-// Description: Schedules the workers to execute tasks.
+// Function: Wait
+// Description: Waits for the tasks of a group only. Unlike Free_Resource it is not a barrier
+//              for the whole pool: the tasks of other groups (other stages) keep running.
+//              The waiting thread runs queued tasks meanwhile (first the ones it added, when
+//              it is a worker), so a task can add tasks and wait for them without blocking
+//              a worker, at any depth.
+// Parameters:
+//   - group: Group of tasks to wait for.
 ////////////////////////////////////////////////////////////////////////////////////////
-void ThreadPool::Schedule_Workers()
+void ThreadPool::Wait(TaskGroup& group)
 {
-    while (true)
+    Help([&group] {
+        return group.pending.load() == 0;
+    });
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////
+// Function: Help
+// Description: Runs queued tasks on the calling thread (worker or not) until the condition
+//              holds. When there is none to run, the awaited tasks are running on other
+//              threads: sleep until a task completes a group / the pool or a task is added.
+// Parameters:
+//   - done: Condition awaited (checked after every task).
+////////////////////////////////////////////////////////////////////////////////////////
+void ThreadPool::Help(const function<bool()>& done)
+{
+    const size_t index = currentPool == this ? currentWorker : deques.size();
+
+    while (!done())
     {
-        Task task([] {}, ""); //  DUMMY TASK == NO TASK
+        Task* task = Find_Task(index);
+        if (task != nullptr)
         {
-            unique_lock<mutex> lock(mutexT);
-            notify.wait(lock, [this] {
-                return stop || !tasks.empty();
-            });
+            --queued;
+            Run_Task(task);
+            continue;
+        }
+
+        if (Spin_Idle([&] { return done() || queued.load() > 0; }))
+        {
+            continue;
+        }
 
-            if (stop && tasks.empty())
+        unique_lock<mutex> lock(doneMutex);
+        ++helpers;
+        complete.wait(lock, [&] {
+            return done() || queued.load() > 0;
+        });
+        --helpers;
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////
+// Function: Spin_Idle
+// Description: Idle phase before a thread sleeps: it checks ready() with a CPU pause
+//              (spins), then yielding its core (yields, and until the hot time after the
+//              start of the phase is over). A task queued meanwhile is taken without any
+//              wake up, at the cost of the core kept busy for the phase.
+// Parameters:
+//   - ready: Condition ending the phase (a task queued, the group done, the pool stopped).
+// Returns:
+//   - true if ready() holds, false if the thread should sleep.
+////////////////////////////////////////////////////////////////////////////////////////
+bool ThreadPool::Spin_Idle(const function<bool()>& ready) const
+{
+    const int spins = idleSpins.load(memory_order_relaxed);
+    const int yields = idleYields.load(memory_order_relaxed);
+    const chrono::microseconds hot(idleHot.load(memory_order_relaxed));
+    const chrono::steady_clock::time_point since = chrono::steady_clock::now();
+
+    for (int round = 0; !ready(); ++round)
+    {
+        if (round < spins)
+        {
+            CpuRelax();
+            continue;
+        }
+        if (round >= spins + yields && chrono::steady_clock::now() - since >= hot)
+        {
+            return false;
+        }
+        this_thread::yield();
+    }
+    return true;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////
+// Function: Find_Task
+// Description: Next task of a worker: the last one pushed on its own deque (hot in cache),
+//              else a batch of the injection queue (the rest of the batch goes to its deque,
+//              where the others can steal it), else the oldest task of a random victim.
+// Parameters:
+//   - index: Index of the worker (deques.size() for a thread outside the pool).
+// Returns:
+//   - The task, nullptr if none was found.
+////////////////////////////////////////////////////////////////////////////////////////
+Task* ThreadPool::Find_Task(size_t index)
+{
+    const bool worker = index < deques.size();
+
+    Task* task = worker ? deques[index]->Pop() : nullptr;
+    if (task != nullptr)
+    {
+        return task;
+    }
+
+    if (injected.load(memory_order_relaxed) > 0)
+    {
+        lock_guard<mutex> lock(mutexT);
+        if (!tasks.empty())
+        {
+            task = tasks.front();
+            tasks.pop_front();
+            size_t share = worker ? tasks.size() / workers.size() : 0;
+            for (size_t i = 0; i < share; ++i)
             {
-                return;
+                deques[index]->Push(tasks.front());
+                tasks.pop_front();
             }
+            injected -= share + 1;
+            return task;
+        }
+    }
+
+    const size_t count = deques.size();
+    const size_t start = NextRandom(stealSeed) % count;
+    for (size_t i = 0; i < count; ++i)
+    {
+        size_t victim = (start + i) % count;
+        if (victim == index)
+        {
+            continue;
+        }
+        task = deques[victim]->Steal();
+        if (task != nullptr)
+        {
+            return task;
+        }
+    }
+    return nullptr;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////
+// Function: Run_Task
+// Description: Runs a task, then marks it as completed and wakes the threads waiting on
+//              its group or on the pool when it was the last one. The id needs no check,
+//              unknown names are rejected when the task is added.
+// Parameters:
+//   - task: Task to run (recycled once done, its block deleted when it is the last one).
+////////////////////////////////////////////////////////////////////////////////////////
+void ThreadPool::Run_Task(Task* task)
+{
+    task->state = TaskState::Running;
+    ThreadPool* outer = runningPool;
+    runningPool = this;
+    task->func();
+    runningPool = outer;
+    task->state = TaskState::Completed;
+
+    // The group may be destroyed by its waiter as soon as pending reaches 0, it is not used after
+    // (the task is recycled after: its function may own the group, see Async)
+    TaskBlock* block = task->block;
+    bool groupDone = task->group != nullptr && task->group->pending.fetch_sub(1) == 1;
+    bool poolDone = unfinished.fetch_sub(1) == 1;
+    if (block == nullptr)
+    {
+        Recycle_Task(task);
+    }
+    else if (block->remaining.fetch_sub(1) == 1)
+    {
+        TaskBlock::Destroy(block);
+    }
+    if (groupDone || poolDone)
+    {
+        { lock_guard<mutex> lock(doneMutex); }
+        // Several threads may wait (Free_Resource and the groups of concurrent stages)
+        complete.notify_all();
+    }
+}
 
-            task = move(tasks.front());
-            tasks.pop();
-            task.state = TaskState::Running;
 
-            ++P;
+////////////////////////////////////////////////////////////////////////////////////////
+// Function: Schedule_Workers
+// Description: Schedules the workers to execute tasks: run the tasks found (own deque,
+//              injection queue, steals), sleep when there is none.
+// Parameters:
+//   - index: Index of the worker (its deque).
+////////////////////////////////////////////////////////////////////////////////////////
+void ThreadPool::Schedule_Workers(size_t index)
+{
+    currentPool = this;
+    currentWorker = index;
+    stealSeed = static_cast<uint32_t>(index) * 2654435761u + 1u;
+
+    while (true)
+    {
+        Task* task = Find_Task(index);
+        if (task != nullptr)
+        {
+            --queued;
+            Run_Task(task);
+            continue;
         }
 
-        static const unordered_set<string> set_tasks_names = 
-        { 
-            "COMBINE_IMAGES", 
-            "SOBEL_BINARY_EDGE", 
-            "HATCHING", 
-            "HORIZONTAL_BLUR", 
-            "VERTICAL_BLUR" 
-        };
-        
-        if (!task.name.empty() && set_tasks_names.find(task.name) == set_tasks_names.end())
+        if (Spin_Idle([this] { return stop || queued.load() > 0; }))
         {
-            cerr << "[Error]: Task '" << task.name << "' is not recognized." << endl;
+            if (stop && queued.load() == 0)
             {
-                unique_lock<mutex> lock(mutexT);
-                --P;
-                complete.notify_one();
+                return;
             }
             continue;
         }
 
-        task.func();
+        unique_lock<mutex> lock(sleepMutex);
+        ++sleepers;
+        notify.wait(lock, [this] {
+            return stop || queued.load() > 0;
+        });
+        --sleepers;
 
+        if (stop && queued.load() == 0)
         {
-            unique_lock<mutex> lock(mutexT);
-            --P;
-            task.state = TaskState::Completed;
-            complete.notify_one();
+            return;
         }
     }
 }
@@ -1,16 +1,28 @@
+#pragma once
+
 #include <thread>
 #include <mutex>
+#include <atomic>
+#include <chrono>
+#include <future>
 #include <functional>
 #include <condition_variable>
 
-#include <queue>
+#include <deque>
+#include <memory>
 #include <string>
 #include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <new>
+#include <type_traits>
 
 /// References: used for the implementation of the ThreadPool class
 /// https://stackoverflow.com/questions/75912758/condition-variables-in-c-how-do-i-use-them-properly
 /// https://github.com/progschj/ThreadPool/blob/master/ThreadPool.h
 /// https://matgomes.com/thread-pools-cpp-with-queues/?utm_source=chatgpt.com
+/// Work stealing deque: Chase, Lev - Dynamic Circular Work-Stealing Deque (SPAA 2005)
+/// and Le, Pop, Cohen, Zappa Nardelli - Correct and Efficient Work-Stealing for Weak Memory Models (PPoPP 2013)
 
 // Pipeline stages
 enum class TaskState
@@ -21,46 +33,481 @@ enum class TaskState
 };
 
 
-// Task structure (function, state, name)
+// Tasks of the set (interned names: a task carries its id, the name is only looked up when given as a string)
+enum class TaskId : uint8_t
+{
+    CombineImages,
+    SobelBinaryEdge,
+    Hatching,
+    HorizontalBlur,
+    VerticalBlur,
+    VerticalRecursiveBlur,    // on columns, its own cost per element
+    SketchBand,
+    LumaPlane,
+    ExpandPlane,
+    HatchMask,
+    PipelineStage,
+    ParallelRegion,
+    HashImage,
+    Count
+};
+
+
+// Grain of a Parallel_For tuned from the measured cost of the previous chunks of the same task id (see Auto_Grain)
+const int kAutoGrain = 0;
+
+// Duration aimed at by the auto tuned chunks (long enough to hide the dispatch, short enough to balance)
+const int64_t kChunkNanoseconds = 100000;
+
+// Auto tuned chunks per worker at least (a slow core or a preempted worker leaves the others its tail)
+const int kChunksPerWorker = 4;
+
+
+// Group of tasks awaited together (e.g. the chunks of one pipeline stage), independently of the other tasks
+struct TaskGroup
+{
+	std::atomic<size_t> pending; // tasks of the group not completed yet
+
+    TaskGroup() : pending(0) {}
+};
+
+
+// Handle of a task added with Async: its own group (awaited independently of the other tasks) and its result
+template <typename R>
+struct TaskHandle
+{
+    std::shared_ptr<TaskGroup> group;
+    std::future<R> result;
+};
+
+
+// Move only function of a task, stored inline when it fits (the lambdas of the chunks: no allocation),
+// on the heap otherwise
+class TaskFunction
+{
+public:
+    TaskFunction() : invoke(nullptr), manage(nullptr) {}
+
+    template <typename F, typename = typename std::enable_if<
+        !std::is_same<typename std::decay<F>::type, TaskFunction>::value>::type>
+    TaskFunction(F&& f) : invoke(nullptr), manage(nullptr)
+    {
+        typedef typename std::decay<F>::type D;
+        Store(std::forward<F>(f), std::integral_constant<bool,
+            sizeof(D) <= kInlineSize &&
+            alignof(std::max_align_t) % alignof(D) == 0 &&
+            std::is_nothrow_move_constructible<D>::value>());
+    }
+
+    TaskFunction(TaskFunction&& other) : invoke(nullptr), manage(nullptr)
+    {
+        Take(other);
+    }
+
+    TaskFunction& operator=(TaskFunction&& other)
+    {
+        if (this != &other)
+        {
+            Reset();
+            Take(other);
+        }
+        return *this;
+    }
+
+    TaskFunction(const TaskFunction&) = delete;
+    TaskFunction& operator=(const TaskFunction&) = delete;
+
+    ~TaskFunction() { Reset(); }
+
+    void operator()() { invoke(&storage); }
+    explicit operator bool() const { return invoke != nullptr; }
+
+private:
+    enum Operation { Move, Destroy };
+
+    static const size_t kInlineSize = 48;
+
+	// Inline: the function itself is in the storage
+    template <typename F>
+    void Store(F&& f, std::true_type)
+    {
+        typedef typename std::decay<F>::type D;
+        new (&storage) D(std::forward<F>(f));
+        invoke = [](void* self) { (*static_cast<D*>(self))(); };
+        manage = [](Operation operation, void* self, void* other)
+        {
+            if (operation == Move)
+            {
+                new (self) D(std::move(*static_cast<D*>(other)));
+            }
+            else
+            {
+                static_cast<D*>(self)->~D();
+            }
+        };
+    }
+
+	// Heap: the storage holds a pointer to the function
+    template <typename F>
+    void Store(F&& f, std::false_type)
+    {
+        typedef typename std::decay<F>::type D;
+        new (&storage) D*(new D(std::forward<F>(f)));
+        invoke = [](void* self) { (**static_cast<D**>(self))(); };
+        manage = [](Operation operation, void* self, void* other)
+        {
+            if (operation == Move)
+            {
+                new (self) D*(*static_cast<D**>(other));
+                *static_cast<D**>(other) = nullptr;
+            }
+            else
+            {
+                delete *static_cast<D**>(self);
+            }
+        };
+    }
+
+    void Take(TaskFunction& other)
+    {
+        if (other.manage != nullptr)
+        {
+            other.manage(Move, &storage, &other.storage);
+            invoke = other.invoke;
+            manage = other.manage;
+            other.Reset();
+        }
+    }
+
+    void Reset()
+    {
+        if (manage != nullptr)
+        {
+            manage(Destroy, &storage, nullptr);
+        }
+        invoke = nullptr;
+        manage = nullptr;
+    }
+
+    typename std::aligned_storage<kInlineSize, alignof(std::max_align_t)>::type storage;
+    void (*invoke)(void*);
+    void (*manage)(Operation, void*, void*);
+};
+
+
+struct TaskBlock;
+
+// Task structure (function, state, id)
 struct Task
 {
-	std::function<void()> func; // function to be executed
-	TaskState state;            // state of the task
-	std::string name;           // name of the task (from a set of tasks)
+	TaskFunction func;  // function to be executed
+	TaskState state;    // state of the task
+	TaskId id;          // id of the task (from the set of tasks)
+	TaskGroup* group;   // group notified on completion (optional)
+	TaskBlock* block;   // tasks allocated together (Parallel_For), nullptr if allocated alone
 
-    Task(std::function<void()> f, const std::string& n = "") :
-        func(move(f)),
+    Task() : state(TaskState::Pending), id(TaskId::PipelineStage), group(nullptr), block(nullptr) {}
+
+    Task(TaskFunction f, TaskId i, TaskGroup* g = nullptr) :
+        func(std::move(f)),
         state(TaskState::Pending),
-        name(n) {
+        id(i),
+        group(g),
+        block(nullptr) {
     }
 };
 
 
+// Tasks of a Parallel_For: one allocation (the tasks follow the block), freed by the last one completed
+struct TaskBlock
+{
+    std::atomic<size_t> remaining;
+    size_t count;
+
+	// Block and its count tasks, and their release
+    static TaskBlock* Create(size_t count)
+    {
+        TaskBlock* block = new (::operator new(TasksOffset() + count * sizeof(Task))) TaskBlock(count);
+        Task* tasks = block->Tasks();
+        for (size_t t = 0; t < count; ++t)
+        {
+            new (&tasks[t]) Task();
+        }
+        return block;
+    }
+
+    static void Destroy(TaskBlock* block)
+    {
+        Task* tasks = block->Tasks();
+        for (size_t t = 0; t < block->count; ++t)
+        {
+            tasks[t].~Task();
+        }
+        block->~TaskBlock();
+        ::operator delete(block);
+    }
+
+    Task* Tasks()
+    {
+        return reinterpret_cast<Task*>(reinterpret_cast<unsigned char*>(this) + TasksOffset());
+    }
+
+private:
+    explicit TaskBlock(size_t count) : remaining(count), count(count) {}
+
+	// Bytes of the block before its tasks (aligned for them)
+    static size_t TasksOffset()
+    {
+        return (sizeof(TaskBlock) + alignof(Task) - 1) / alignof(Task) * alignof(Task);
+    }
+};
+
+
+// Placement of the workers on the CPUs (Linux only, the workers run unpinned elsewhere)
+enum class Affinity
+{
+    None,       // not pinned, placed by the OS
+    Compact,    // the SMT siblings of a core, then the next core, then the next socket / NUMA node
+    Scatter,    // one worker per core of each NUMA node in turn, the SMT siblings after every core
+    NoSMT       // one worker per physical core, the SMT siblings only when there are more workers than cores
+};
+
+
+// Idle phase of the workers (and of the threads waiting for a group) before they sleep: a sleeping worker
+// costs a futex wake up to the next stage, a spinning one takes its chunks at once but keeps its core busy
+struct IdlePolicy
+{
+    int spins;                          // checks with a CPU pause
+    int yields;                         // checks with a yield of the core, after the spins
+    std::chrono::microseconds hot;      // least time looking for tasks after the last one (yielding), then sleep
+};
+
+// Batch use (power aware): a short spin for the chunks of the same stage, then sleep
+const IdlePolicy kBatchIdle = { 64, 8, std::chrono::microseconds(0) };
+// Interactive previews: the workers stay hot about a frame after the last task, the next run starts at once
+const IdlePolicy kLatencyIdle = { 1024, 64, std::chrono::microseconds(20000) };
+
+
+// Step of a parallel region: fn(start, end) on the chunks of [begin, end), all of them done before the next step
+struct RegionStep
+{
+    int begin;
+    int end;
+    int grain;                              // kAutoGrain: tuned from the cost of id, as Parallel_For
+    std::function<void(int, int)> fn;
+    TaskId id;
+};
+
+
+// Function of a task added with Async: runs the packaged task, keeps the group of the handle alive until done
+template <typename R>
+struct AsyncTask
+{
+    std::packaged_task<R()> task;
+    std::shared_ptr<TaskGroup> group;
+
+    void operator()() { task(); }
+};
+
+
+// Lock free work stealing deque (Chase - Lev): the owner pushes and pops at the bottom, the thieves steal at the top
+class WorkDeque
+{
+public:
+    WorkDeque();
+    ~WorkDeque();
+
+	// Owner only
+    void Push(Task* task);
+    Task* Pop();
+	// Any thread, nullptr if empty or lost to another thief
+    Task* Steal();
+
+private:
+	// Circular buffer, replaced by one twice as large when full (the old ones stay alive for the thieves)
+    struct Buffer
+    {
+        int64_t capacity;
+        std::unique_ptr<std::atomic<Task*>[]> slots;
+
+        explicit Buffer(int64_t c) : capacity(c), slots(new std::atomic<Task*>[c]) {}
+        Task* Get(int64_t i) const { return slots[i & (capacity - 1)].load(std::memory_order_relaxed); }
+        void Put(int64_t i, Task* t) { slots[i & (capacity - 1)].store(t, std::memory_order_relaxed); }
+    };
+
+    Buffer* Grow(Buffer* buffer, int64_t bottom, int64_t top);
+
+    std::atomic<int64_t> top;
+    std::atomic<int64_t> bottom;
+    std::atomic<Buffer*> buffer;
+    std::vector<std::unique_ptr<Buffer>> buffers; // owner only
+};
+
+
 class ThreadPool
 {
 public:
-    ThreadPool(size_t P);
+    ThreadPool(size_t P, Affinity affinity = Affinity::None);
     ~ThreadPool();
 
 	// Add a task to the queue with a name (MUST be from a set of tasks)
-    void Add_Task(const std::function<void()>& task, const std::string& name);
-	// Wait for all tasks to complete
+    void Add_Task(TaskFunction task, const std::string& name);
+	// Add a task belonging to a group (the group must outlive its tasks)
+    void Add_Task(TaskFunction task, const std::string& name, TaskGroup& group);
+	// Same with the id of the name (no lookup)
+    void Add_Task(TaskFunction task, TaskId id);
+    void Add_Task(TaskFunction task, TaskId id, TaskGroup& group);
+	// Add fn(start, end) on the chunks of grain elements of [begin, end) at once (one allocation, one lock,
+	// one wake up), fn must stay alive until the group is awaited. The chunks are distributed dynamically
+	// (stolen by the idle workers), kAutoGrain sizes them from the measured cost of the task.
+    template <typename F>
+    void Parallel_For(int begin, int end, int grain, const F& fn, TaskId id, TaskGroup& group);
+	// Run steps in one persistent parallel region: the workers join it once and go from step to step through a
+	// spinning barrier (no task queued, no sleep and no wake up between the steps). The caller takes part.
+    void Run_Region(const std::vector<RegionStep>& steps);
+	// Idle phase of the workers before they sleep (kBatchIdle by default, kLatencyIdle for interactive use)
+    void Set_Idle_Policy(const IdlePolicy& policy);
+    IdlePolicy Get_Idle_Policy() const;
+	// NUMA node of a worker (-1: not pinned)
+    int Worker_Node(size_t index) const;
+	// Prefer the NUMA nodes of the workers for the pages of a new buffer (one band per worker, in order)
+    void Place(void* data, size_t bytes) const;
+	// Add a task and return its handle (its result is returned by Get)
+    template <typename F>
+    TaskHandle<typename std::result_of<F()>::type> Async(F func, TaskId id);
+	// Wait for all tasks to complete (not from inside a task, it would wait for itself)
     void Free_Resource();
+	// Wait for the tasks of a group only (the other tasks keep running), the waiting thread runs queued tasks
+	// meanwhile, so a task can wait for the tasks it added (nested parallelism)
+    void Wait(TaskGroup& group);
+	// Wait for the task of a handle (as Wait) and return its result
+    template <typename R>
+    R Get(TaskHandle<R>& handle);
+
+	// Chunk size of count elements of a task: chunks of about kChunkNanoseconds from the cost per element
+	// measured on its previous chunks, at least kChunksPerWorker chunks per worker
+    int Auto_Grain(TaskId id, int count) const;
+	// Id of a task name (false if it is not from the set), name of an id
+    static bool Task_Id(const std::string& name, TaskId& id);
+    static const char* Task_Name(TaskId id);
 
 private:
 	// Worker function, execute each task with no concurrency issues
-    void Schedule_Workers();
+    void Schedule_Workers(size_t index);
+	// Queue tasks: on the deque of the calling worker (fast path) or on the shared injection queue
+    void Submit(Task* first, size_t count);
+	// Next task of a worker: its own deque, the injection queue, then the deques of random victims
+	// (index deques.size(): a thread outside the pool, without deque)
+    Task* Find_Task(size_t index);
+	// Single task from the free list (allocated when it is empty), and its return once run
+    Task* New_Task(TaskFunction task, TaskId id, TaskGroup* group);
+    void Recycle_Task(Task* task);
+	// Run a task and mark it as done (its group and the pool counters)
+    void Run_Task(Task* task);
+	// Run queued tasks until done() holds, sleep while there is none to run
+    void Help(const std::function<bool()>& done);
+	// Idle phase of the policy: true as soon as ready() holds, false when the thread should sleep
+    bool Spin_Idle(const std::function<bool()>& ready) const;
+	// Update the cost per element of a task with a chunk measured
+    void Record_Cost(TaskId id, int elements, int64_t nanoseconds);
+	// Take part in a parallel region until its last step is done
+    struct Region;
+    void Join_Region(Region& region);
 
 public:
     std::vector<std::thread> workers;
 
 private:
-    bool stop = false;
-    size_t P = 0;
+    std::atomic<bool> stop;
+
+    std::vector<std::unique_ptr<WorkDeque>> deques;  // one per worker
+
+    std::mutex mutexT;          // injection queue (tasks added from outside the workers)
+    std::deque<Task*> tasks;
+    std::atomic<size_t> injected;   // size of the injection queue (read without the lock)
 
-    std::mutex mutexT;
+    std::mutex freeMutex;           // single tasks run, kept for the next Add_Task (see New_Task)
+    std::vector<Task*> freeTasks;
+
+    std::atomic<size_t> queued;     // tasks queued and not taken yet
+    std::atomic<size_t> unfinished; // tasks added and not completed yet
+
+    std::mutex sleepMutex;          // idle workers
+    std::atomic<size_t> sleepers;
     std::condition_variable notify;
+
+    std::mutex doneMutex;           // threads waiting for the pool or a group
+    std::atomic<size_t> helpers;    // waiting threads sleeping, woken by new tasks too
     std::condition_variable complete;
 
-    std::queue<Task> tasks;
+    std::atomic<float> costs[static_cast<size_t>(TaskId::Count)]; // nanoseconds per element, 0 if not measured
+
+    std::atomic<int> idleSpins;     // idle policy (read by the idle threads)
+    std::atomic<int> idleYields;
+    std::atomic<int64_t> idleHot;   // microseconds
+
+    std::vector<int> cpus;      // CPU each worker is pinned to, -1 if not pinned
+    std::vector<int> nodes;     // NUMA node of each worker, -1 if not pinned
+    bool multiNode;             // the workers run on more than one NUMA node
 };
+
+
+template <typename F>
+void ThreadPool::Parallel_For(int begin, int end, int grain, const F& fn, TaskId id, TaskGroup& group)
+{
+    if (end <= begin)
+    {
+        return;
+    }
+    if (grain <= kAutoGrain)
+    {
+        grain = Auto_Grain(id, end - begin);
+    }
+
+    const size_t count = (end - begin + grain - 1) / grain;
+    TaskBlock* block = TaskBlock::Create(count);
+    Task* tasks = block->Tasks();
+    for (size_t c = 0; c < count; ++c)
+    {
+        const int start = begin + static_cast<int>(c) * grain;
+        const int stop = end - start > grain ? start + grain : end;
+        Task& task = tasks[c];
+        task.func = [this, &fn, start, stop, id] {
+            const std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+            fn(start, stop);
+            Record_Cost(id, stop - start, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - begin).count());
+        };
+        task.id = id;
+        task.group = &group;
+        task.block = block;
+    }
+
+    group.pending += count;
+    unfinished += count;
+    Submit(tasks, count);
+}
+
+
+template <typename F>
+TaskHandle<typename std::result_of<F()>::type> ThreadPool::Async(F func, TaskId id)
+{
+    typedef typename std::result_of<F()>::type R;
+
+    TaskHandle<R> handle;
+    handle.group = std::make_shared<TaskGroup>();
+    std::packaged_task<R()> task(std::move(func));
+    handle.result = task.get_future();
+
+    // The task keeps the group alive, the handle may be dropped before it runs
+    Add_Task(AsyncTask<R>{ std::move(task), handle.group }, id, *handle.group);
+    return handle;
+}
+
+
+template <typename R>
+R ThreadPool::Get(TaskHandle<R>& handle)
+{
+    Wait(*handle.group);
+    return handle.result.get();
+}
@@ -0,0 +1,138 @@
+#include "CPU_Kernels.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <cstdio>
+#include <vector>
+#include <string>
+#include <iostream>
+
+/// Fixed point gaussian kernels: the Q0.16 weights of a normalized kernel sum to 65536 (a constant image stays
+/// constant), and the blurs of radius 0, whose single tap cannot weigh 65536 in 16 bits, give their input back
+/// (row and band, plane and RGBA8, alpha forced to 255).
+
+using namespace std;
+
+
+namespace
+{
+    // Normalized gaussian of 2 * radius + 1 taps (radius 0: the single tap 1.0)
+    vector<float> Gaussian(float sigma, int radius)
+    {
+        vector<float> weights(2 * radius + 1);
+        float sum = 0.0f;
+        for (int i = -radius; i <= radius; ++i)
+        {
+            weights[i + radius] = exp(-float(i * i) / (2.0f * sigma * sigma));
+            sum += weights[i + radius];
+        }
+        for (float& weight : weights)
+        {
+            weight /= sum;
+        }
+        return weights;
+    }
+
+    vector<unsigned char> TestImage(int width, int height, int channels)
+    {
+        vector<unsigned char> image(width * height * channels);
+        for (size_t i = 0; i < image.size(); ++i)
+        {
+            image[i] = static_cast<unsigned char>((i * 37 + i / 7) & 255);
+        }
+        return image;
+    }
+
+    // Pixels of out different from in (the alpha of RGBA8 pixels expected to be 255)
+    int Mismatches(const vector<unsigned char>& in, const vector<unsigned char>& out, int channels)
+    {
+        int mismatches = 0;
+        for (size_t i = 0; i < in.size(); ++i)
+        {
+            const unsigned char expected = channels == 4 && i % 4 == 3 ? 255 : in[i];
+            mismatches += out[i] != expected ? 1 : 0;
+        }
+        return mismatches;
+    }
+
+    bool Check(const string& name, int mismatches)
+    {
+        printf("%-22s mismatches %d\n", name.c_str(), mismatches);
+        if (mismatches != 0)
+        {
+            cerr << "[Error]: " << name << " of radius 0 changed " << mismatches << " bytes of its input." << endl;
+            return false;
+        }
+        return true;
+    }
+}
+
+
+int main()
+{
+    const int width = 97;
+    const int height = 61;
+    bool passed = true;
+
+    // Sum of the weights
+    for (int radius = 0; radius <= 48; ++radius)
+    {
+        const vector<float> weights = Gaussian(0.5f + 0.5f * radius, radius);
+        vector<unsigned short> fixed(weights.size());
+        CPU_Kernels::FixedWeights(weights.data(), static_cast<int>(weights.size()), fixed.data());
+
+        int sum = 0;
+        for (unsigned short weight : fixed)
+        {
+            sum += weight;
+        }
+        const int expected = radius == 0 ? 65535 : 65536;
+        if (sum != expected)
+        {
+            cerr << "[Error]: Fixed weights of radius " << radius << " sum to " << sum << ", expected " << expected
+                 << "." << endl;
+            passed = false;
+        }
+    }
+
+    // Radius 0: the input
+    const vector<float> weights = Gaussian(1.0f, 0);
+    unsigned short fixed[1];
+    CPU_Kernels::FixedWeights(weights.data(), 1, fixed);
+
+    for (int channels : { 1, 4 })
+    {
+        const bool plane = channels == 1;
+        const string kind = plane ? "Plane" : "RGBA";
+        const vector<unsigned char> in = TestImage(width, height, channels);
+        vector<unsigned char> out(in.size());
+
+        vector<unsigned char> rowScratch(CPU_Kernels::BlurRowFixedScratchSize(width, 0, channels));
+        for (int y = 0; y < height; ++y)
+        {
+            const int row = y * width * channels;
+            if (plane)
+            {
+                CPU_Kernels::BlurRowFixedPlane(&in[row], &out[row], width, fixed, 0, rowScratch.data());
+            }
+            else
+            {
+                CPU_Kernels::BlurRowFixedRGBA(&in[row], &out[row], width, fixed, 0, rowScratch.data());
+            }
+        }
+        passed = Check("BlurRowFixed" + kind, Mismatches(in, out, channels)) && passed;
+
+        vector<unsigned char> bandScratch(CPU_Kernels::BlurBandFixedScratchSize(0));
+        if (plane)
+        {
+            CPU_Kernels::BlurBandFixedPlane(in.data(), out.data(), width, height, 0, height, fixed, 0, bandScratch.data());
+        }
+        else
+        {
+            CPU_Kernels::BlurBandFixedRGBA(in.data(), out.data(), width, height, 0, height, fixed, 0, bandScratch.data());
+        }
+        passed = Check("BlurBandFixed" + kind, Mismatches(in, out, channels)) && passed;
+    }
+
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}